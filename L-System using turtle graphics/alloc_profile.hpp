@@ -0,0 +1,324 @@
+#pragma once
+
+// Allocation profiling (opt-in). Define LSYSTEM_ALLOC_PROFILE for the whole build and
+// LSYSTEM_ALLOC_PROFILE_IMPLEMENTATION in exactly one source file before including this
+// header first (ahead of l_system.hpp, which includes it too); that file then replaces
+// the global operator new / delete (the aligned forms included). Every allocation is attributed to the phase of the
+// thread at the time (set by AllocPhaseScope, LTurtle marks its phases) and frees are
+// credited back to the phase that allocated the block.
+// Without LSYSTEM_ALLOC_PROFILE the scopes compile to nothing.
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+#include <iomanip>
+
+/// Phases allocations are attributed to.
+enum class AllocPhase : int {
+    Other,
+    RuleCompile,        // copying the rules into the turtle
+    Expansion,          // deriving the sentence (LTurtle::run)
+    PushPop,            // the turtle stack and the skeleton
+    OutputGrowth,       // growing the branch and leaf vectors
+    Count,
+};
+
+inline char const* alloc_phase_name(AllocPhase const phase) {
+
+    switch ( phase )
+    {
+    case AllocPhase::RuleCompile:
+        return "rule compile";
+    case AllocPhase::Expansion:
+        return "expansion";
+    case AllocPhase::PushPop:
+        return "push/pop";
+    case AllocPhase::OutputGrowth:
+        return "output growth";
+    default:
+        return "other";
+    }
+}
+
+/// Heap traffic of one phase.
+struct AllocPhaseStats {
+    std::uint64_t allocations = 0U;
+    std::uint64_t frees = 0U;
+    std::uint64_t bytes = 0U;           // allocated in total
+    std::int64_t live = 0;              // allocated and not yet freed
+    std::int64_t peak = 0;              // highest "live"
+};
+
+#ifdef LSYSTEM_ALLOC_PROFILE
+
+/// Global counters, zero initialized before any constructor runs.
+struct AllocCounters {
+
+    static constexpr int phases = static_cast<int>( AllocPhase::Count );
+
+    static inline std::atomic<std::uint64_t> allocations[phases] = {};
+    static inline std::atomic<std::uint64_t> frees[phases] = {};
+    static inline std::atomic<std::uint64_t> bytes[phases] = {};
+    static inline std::atomic<std::int64_t> live[phases] = {};
+    static inline std::atomic<std::int64_t> peak[phases] = {};
+
+    static inline thread_local int phase = 0;
+
+    static void allocated(int const p, std::size_t const size) {
+
+        allocations[p].fetch_add( 1U, std::memory_order_relaxed );
+        bytes[p].fetch_add( size, std::memory_order_relaxed );
+
+        std::int64_t now = live[p].fetch_add( static_cast<std::int64_t>( size ), std::memory_order_relaxed ) + static_cast<std::int64_t>( size );
+        std::int64_t highest = peak[p].load( std::memory_order_relaxed );
+        while ( now > highest && !peak[p].compare_exchange_weak( highest, now, std::memory_order_relaxed ) ) {}
+    }
+
+    static void freed(int const p, std::size_t const size) {
+
+        frees[p].fetch_add( 1U, std::memory_order_relaxed );
+        live[p].fetch_sub( static_cast<std::int64_t>( size ), std::memory_order_relaxed );
+    }
+};
+
+/// Attributes the allocations of the current thread to "phase" until the scope ends.
+struct AllocPhaseScope {
+
+    explicit AllocPhaseScope(AllocPhase const phase)
+        : previous(AllocCounters::phase)
+    {
+        AllocCounters::phase = static_cast<int>( phase );
+    }
+
+    ~AllocPhaseScope() {
+
+        AllocCounters::phase = previous;
+    }
+
+    AllocPhaseScope(AllocPhaseScope const&) = delete;
+    AllocPhaseScope& operator=(AllocPhaseScope const&) = delete;
+
+private:
+    int previous;
+};
+
+inline AllocPhaseStats alloc_stats(AllocPhase const phase) {
+
+    int p = static_cast<int>( phase );
+
+    AllocPhaseStats stats;
+    stats.allocations = AllocCounters::allocations[p].load();
+    stats.frees = AllocCounters::frees[p].load();
+    stats.bytes = AllocCounters::bytes[p].load();
+    stats.live = AllocCounters::live[p].load();
+    stats.peak = AllocCounters::peak[p].load();
+
+    return stats;
+}
+
+/// Zeroes the counters (the peaks restart from the memory live now).
+inline void reset_alloc_stats() {
+
+    for ( int p = 0; p < AllocCounters::phases; ++p )
+    {
+        AllocCounters::allocations[p] = 0U;
+        AllocCounters::frees[p] = 0U;
+        AllocCounters::bytes[p] = 0U;
+        AllocCounters::peak[p] = AllocCounters::live[p].load();
+    }
+}
+
+/// Prints a table of all phases, e.g. right after LTurtle::run().
+inline void print_alloc_stats(std::ostream& out) {
+
+    out << std::left << std::setw( 16 ) << "phase" << std::right << std::setw( 12 ) << "allocs" << std::setw( 12 ) << "frees"
+        << std::setw( 14 ) << "bytes" << std::setw( 14 ) << "live" << std::setw( 14 ) << "peak live" << '\n';
+
+    for ( int p = 0; p < AllocCounters::phases; ++p )
+    {
+        AllocPhaseStats stats = alloc_stats( static_cast<AllocPhase>( p ) );
+        out << std::left << std::setw( 16 ) << alloc_phase_name( static_cast<AllocPhase>( p ) ) << std::right
+            << std::setw( 12 ) << stats.allocations << std::setw( 12 ) << stats.frees << std::setw( 14 ) << stats.bytes
+            << std::setw( 14 ) << stats.live << std::setw( 14 ) << stats.peak << '\n';
+    }
+}
+
+#ifdef LSYSTEM_ALLOC_PROFILE_IMPLEMENTATION
+
+#include <cstdlib>
+#include <new>
+
+#if defined(_MSC_VER)
+#define LSYSTEM_ALLOC_NOINLINE __declspec(noinline)
+#else
+#define LSYSTEM_ALLOC_NOINLINE __attribute__((noinline))
+#endif
+
+// every block is preceded by its header (16 bytes keep the alignment of max_align_t)
+struct AllocHeader {
+    std::size_t size;
+    std::uint32_t phase;
+    std::uint32_t offset;               // of the block from the start of the malloc'ed memory
+};
+
+constexpr std::size_t alloc_header = 16U;
+static_assert( sizeof(AllocHeader) <= alloc_header, "the header has to fit in front of the block" );
+
+// malloc and free are only called out of line: an inlined new / delete pair would show the
+// compiler memory from malloc reaching operator delete (-Wmismatched-new-delete)
+
+/// A block of "size" bytes aligned to "alignment" (a power of two), nullptr when out of memory.
+LSYSTEM_ALLOC_NOINLINE void* alloc_profile_allocate(std::size_t const size, std::size_t const alignment) noexcept {
+
+    char* memory = static_cast<char*>( std::malloc( size + alloc_header + alignment - 1U ) );
+    if ( memory == nullptr )
+        return nullptr;
+
+    std::size_t misalignment = reinterpret_cast<std::uintptr_t>( memory + alloc_header ) & ( alignment - 1U );
+    std::size_t offset = alloc_header + ( misalignment == 0U ? 0U : alignment - misalignment );
+    char* block = memory + offset;
+
+    int phase = AllocCounters::phase;
+    AllocHeader* header = reinterpret_cast<AllocHeader*>( block - alloc_header );
+    header->size = size;
+    header->phase = static_cast<std::uint32_t>( phase );
+    header->offset = static_cast<std::uint32_t>( offset );
+    AllocCounters::allocated( phase, size );
+
+    return block;
+}
+
+/// Frees a block of alloc_profile_allocate() (nullptr is ignored).
+LSYSTEM_ALLOC_NOINLINE void alloc_profile_release(void* const pointer) noexcept {
+
+    if ( pointer == nullptr )
+        return;
+
+    char* block = static_cast<char*>( pointer );
+    AllocHeader const* header = reinterpret_cast<AllocHeader const*>( block - alloc_header );
+    AllocCounters::freed( static_cast<int>( header->phase ), header->size );
+    std::free( block - header->offset );
+}
+
+void* operator new(std::size_t size) {
+
+    void* block = alloc_profile_allocate( size, __STDCPP_DEFAULT_NEW_ALIGNMENT__ );
+    if ( block == nullptr )
+        throw std::bad_alloc();
+
+    return block;
+}
+
+void* operator new[](std::size_t size) {
+
+    return operator new( size );
+}
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+
+    return alloc_profile_allocate( size, __STDCPP_DEFAULT_NEW_ALIGNMENT__ );
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept {
+
+    return operator new( size, std::nothrow );
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+
+    void* block = alloc_profile_allocate( size, static_cast<std::size_t>( alignment ) );
+    if ( block == nullptr )
+        throw std::bad_alloc();
+
+    return block;
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+
+    return operator new( size, alignment );
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept {
+
+    return alloc_profile_allocate( size, static_cast<std::size_t>( alignment ) );
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, std::nothrow_t const&) noexcept {
+
+    return operator new( size, alignment, std::nothrow );
+}
+
+// every block knows where its memory starts, so all forms of delete free alike
+
+void operator delete(void* pointer) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete[](void* pointer) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete(void* pointer, std::nothrow_t const&) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete[](void* pointer, std::nothrow_t const&) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete(void* pointer, std::align_val_t, std::nothrow_t const&) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+void operator delete[](void* pointer, std::align_val_t, std::nothrow_t const&) noexcept {
+
+    alloc_profile_release( pointer );
+}
+
+#endif // LSYSTEM_ALLOC_PROFILE_IMPLEMENTATION
+
+#else
+
+/// Profiling is off -> nothing to attribute.
+struct AllocPhaseScope {
+
+    explicit AllocPhaseScope(AllocPhase const) {}
+};
+
+#endif // LSYSTEM_ALLOC_PROFILE
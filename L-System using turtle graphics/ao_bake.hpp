@@ -0,0 +1,91 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "sampling.hpp"
+#include "parallel.hpp"
+#include <cmath>
+#include <cstdint>
+
+/// Settings of the ambient occlusion bake.
+struct AOBakeSettings {
+    int points = 4;                 // surface points per primitive
+    int rays = 16;                  // hemisphere rays per point
+    float max_distance = 0.0f;      // occluders farther away are ignored (0 -> sky visibility)
+    bool ground = true;             // the ground plane occludes as well
+    unsigned int threads = 0U;      // 0 -> all hardware threads
+    std::uint32_t seed = 0U;
+};
+
+/// Bakes ambient occlusion (or sky visibility) once per branch and per leaf into the
+/// "ao" arrays of the scene records, where Trace() picks it up for its ambient term.
+/// Every primitive shoots cosine distributed rays from a few points of its surface
+/// through the BVH of the scene; primitives are baked in parallel.
+inline void bake_ambient_occlusion(Scene& scene, AOBakeSettings const& settings = AOBakeSettings()) {
+
+    const float epsilon = 0.01f;
+    float maxDistance = settings.max_distance > 0.0f ? settings.max_distance : 1e20f;
+
+    // fraction of the rays from the point that reach the sky (or max_distance)
+    auto visibility = [&](glm::vec3 const& point, glm::vec3 const& normal, Random& random) {
+        int open = 0;
+        for ( int r = 0; r < settings.rays; ++r )
+        {
+            glm::vec3 direction = sample_cosine_hemisphere( normal, random.next(), random.next() );
+            Ray ray{ point + epsilon * normal, direction };
+
+            bool blocked = false;
+            if ( settings.ground && direction.y < 0.0f && ray.origin.y > 0.0f )
+                blocked = -ray.origin.y / direction.y < maxDistance;
+
+            if ( !blocked && !Occluded( scene, ray, maxDistance ) )
+                ++open;
+        }
+        return static_cast<float>( open ) / settings.rays;
+    };
+
+    std::size_t branchCount = scene.records.branches.size();
+    std::size_t total = branchCount + scene.records.leaves.size();
+
+    parallel_for( total, settings.threads, [&](std::size_t const i) {
+        Random random( Random::seed( static_cast<std::uint32_t>( i ), 0U, settings.seed ) );
+        float sum = 0.0f;
+
+        if ( i < branchCount )
+        {
+            BranchRecord branch = scene.records.branches[i];
+            glm::vec3 t, b;
+            orthonormal_basis( branch.axis, t, b );
+
+            for ( int p = 0; p < settings.points; ++p )
+            {
+                // stratified along the axis, random around it
+                float s = ( p + random.next() ) / settings.points;
+                float phi = 6.28318530718f * random.next();
+                glm::vec3 radial = std::cos( phi ) * t + std::sin( phi ) * b;
+                float radius = branch.r1 + ( branch.r2 - branch.r1 ) * s;
+
+                glm::vec3 point = branch.p1 + branch.axis * ( branch.length * s ) + radial * radius;
+                glm::vec3 normal = glm::normalize( radial + branch.axis * branch.slope );
+
+                sum += visibility( point, normal, random );
+            }
+
+            scene.records.branches.ao[i] = sum / settings.points;
+        }
+        else
+        {
+            std::size_t leaf = i - branchCount;
+            LeafRecord record = scene.records.leaves[leaf];
+            glm::vec3 n = glm::vec3( record.plane );
+
+            for ( int p = 0; p < settings.points; ++p )
+            {
+                // leaves are two-sided -> alternate the sides
+                glm::vec3 point = leaf_point( record, random.next(), random.next() );
+                sum += visibility( point, ( p % 2 == 0 ) ? n : -n, random );
+            }
+
+            scene.records.leaves.ao[leaf] = sum / settings.points;
+        }
+    } );
+}
@@ -0,0 +1,625 @@
+#pragma once
+
+#include "perf_counters.hpp"
+#include "l_system.hpp"
+#include "grammar.hpp"
+#include "determinism.hpp"
+#include "ray_tracing.hpp"
+#include "leaf_lanes.hpp"
+#include "shadow_map.hpp"
+#include "denoiser.hpp"
+#include "tree_query.hpp"
+#include "ray_sorting.hpp"
+#include "temporal.hpp"
+#include "wind.hpp"
+#include "irradiance_cache.hpp"
+#include "out_of_core.hpp"
+#include <vector>
+#include <string>
+#include <chrono>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+/// Result of a benchmark: the time of every repetition and the counters summed over them.
+/// "units" is the work of one repetition (symbols, rays, ...) named by "unit".
+struct BenchmarkResult {
+    std::string name;
+    std::string unit;
+    double units = 0.0;
+    std::vector<double> seconds;
+    PerfReading counters;
+
+    double median_seconds() const {
+
+        if ( seconds.empty() )
+            return 0.0;
+
+        std::vector<double> sorted( seconds );
+        std::nth_element( sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end() );
+        return sorted[sorted.size() / 2];
+    }
+
+    /// Units per second at the median time.
+    double throughput() const {
+
+        double median = median_seconds();
+        return median > 0.0 ? units / median : 0.0;
+    }
+
+    /// Count of an event per unit of work (negative when the event was not counted).
+    double per_unit(PerfEvent const event) const {
+
+        if ( !counters.has( event ) || units <= 0.0 || seconds.empty() )
+            return -1.0;
+
+        return static_cast<double>( counters[event] ) / ( units * seconds.size() );
+    }
+};
+
+/// Runs "task" once to warm up, then "repetitions" times under a timer and the perf counters.
+template <typename Task>
+BenchmarkResult run_benchmark(std::string const& name, std::string const& unit, double const units,
+                              int const repetitions, Task&& task) {
+
+    using Clock = std::chrono::steady_clock;
+
+    BenchmarkResult result;
+    result.name = name;
+    result.unit = unit;
+    result.units = units;
+
+    task();
+
+    // opened after the warm up, inherited by the threads the task starts
+    PerfCounters counters;
+
+    for ( int r = 0; r < repetitions; ++r )
+    {
+        counters.start();
+        Clock::time_point begin = Clock::now();
+
+        task();
+
+        Clock::time_point end = Clock::now();
+        PerfReading reading = counters.stop();
+
+        result.seconds.push_back( std::chrono::duration<double>( end - begin ).count() );
+        for ( std::size_t e = 0; e < perf_event_count; ++e )
+        {
+            result.counters.values[e] += reading.values[e];
+            result.counters.valid[e] = reading.valid[e];
+        }
+    }
+
+    return result;
+}
+
+/// Prints one line per benchmark: median time, throughput, IPC and misses per unit ("n/a" when not counted).
+inline void print_result(std::ostream& out, BenchmarkResult const& result) {
+
+    auto perUnit = [&](char const* label, PerfEvent const event) {
+        double value = result.per_unit( event );
+        out << "  " << label << "/" << result.unit << " ";
+        if ( value < 0.0 )
+            out << "n/a";
+        else
+            out << std::setprecision( 4 ) << value;
+    };
+
+    out << std::left << std::setw( 24 ) << result.name << std::right
+        << std::fixed << std::setprecision( 3 ) << result.median_seconds() * 1e3 << " ms  "
+        << std::defaultfloat << std::setprecision( 4 ) << result.throughput() << " " << result.unit << "/s  IPC ";
+
+    if ( result.counters.has( PerfEvent::Cycles ) && result.counters.has( PerfEvent::Instructions ) )
+        out << std::setprecision( 3 ) << result.counters.ipc();
+    else
+        out << "n/a";
+
+    perUnit( "cache misses", PerfEvent::CacheMisses );
+    perUnit( "branch misses", PerfEvent::BranchMisses );
+    perUnit( "dTLB misses", PerfEvent::TLBMisses );
+    out << '\n';
+}
+
+/// Number of symbols LTurtle processes for the axiom (the length of the derived string).
+inline double derived_length(LTurtle::Config const& config, LTurtle::Rules const& rules, std::string const& axiom) {
+
+    // lengths[d][c] -> symbols processed for rule "c" expanded at depth d, filled from the deepest level up
+    std::vector<std::unordered_map<char, double>> lengths( config.max_depth + 2U );
+
+    auto length = [&](std::string const& sentence, unsigned int const depth) {
+        double sum = 0.0;
+        for ( char c : sentence )
+        {
+            auto found = depth < config.max_depth ? lengths[depth + 1U].find( c ) : lengths[depth + 1U].end();
+            sum += found != lengths[depth + 1U].end() ? found->second : 1.0;
+        }
+        return sum;
+    };
+
+    for ( unsigned int depth = config.max_depth; depth-- > 0U; )
+    {
+        for ( auto const& rule : rules )
+        {
+            lengths[depth + 1U][rule.first] = length( rule.second, depth + 1U );
+        }
+    }
+
+    return length( axiom, 0U );
+}
+
+/// Benchmarks the derivation and interpretation of an L-system (per processed symbol).
+inline BenchmarkResult benchmark_generation(std::string const& name, LTurtle::Config const& config, LTurtle::Rules const& rules,
+                                            std::string const& axiom, int const repetitions = 10) {
+
+    std::vector<Branch> branches;
+    std::vector<Leaf> leaves;
+
+    return run_benchmark( name, "symbol", derived_length( config, rules, axiom ), repetitions, [&]() {
+        branches.clear();
+        leaves.clear();
+        LTurtle turtle( config, rules, branches, leaves );
+        turtle.run( axiom );
+    } );
+}
+
+/// Benchmarks GrammarPack::load (per load, "loads" of them cycling through the pack at "path",
+/// which holds "grammars"). "identical" tells whether every loaded grammar generates the same
+/// geometry as the one it was written from.
+inline BenchmarkResult benchmark_grammar_pack(std::string const& name, std::string const& path, std::vector<Grammar> const& grammars,
+                                              int const loads, bool& identical, int const repetitions = 5) {
+
+    GrammarPack pack( path );
+    Grammar loaded;
+
+    BenchmarkResult result = run_benchmark( name, "load", static_cast<double>( loads ), repetitions, [&]() {
+        for ( int i = 0; i < loads; ++i )
+        {
+            pack.load( static_cast<std::size_t>( i ) % pack.grammar_count(), loaded );
+        }
+    } );
+
+    auto generate = [](Grammar const& grammar) {
+        std::vector<Branch> branches;
+        std::vector<Leaf> leaves;
+        LTurtle turtle( grammar.config, grammar.symbols, grammar.rules, branches, leaves );
+        turtle.run( grammar.axiom );
+        return hash_geometry( branches, leaves );
+    };
+
+    identical = pack.grammar_count() == grammars.size();
+    for ( std::size_t g = 0; identical && g < grammars.size(); ++g )
+    {
+        identical = pack.load( g, loaded ) && loaded.name == grammars[g].name && generate( loaded ) == generate( grammars[g] );
+    }
+
+    return result;
+}
+
+/// Benchmarks rendering a frame (per camera ray, the shadow and indirect rays they spawn included).
+inline BenchmarkResult benchmark_render(std::string const& name, Scene const& scene, Camera const& camera,
+                                        int const width, int const height, RenderSettings const& settings = RenderSettings(),
+                                        int const repetitions = 5) {
+
+    Image image( width, height );
+
+    return run_benchmark( name, "ray", static_cast<double>( width ) * height * settings.samples, repetitions, [&]() {
+        render( scene, camera, image, settings );
+    } );
+}
+
+/// The reference IrradianceCache is checked against: the mean of "paths" paths of up to
+/// "bounces" bounces traced from every shading point, nothing is cached.
+struct PathTracedIndirect : public IndirectSource {
+    int paths = 64;
+    int bounces = 4;
+
+    glm::vec3 irradiance(Scene const& scene, Hit const& hit, Random* random) const override {
+
+        // without a generator of the pixel the paths are seeded by the position
+        std::uint32_t bits[3];
+        std::memcpy( bits, &hit.intersection, sizeof( bits ) );
+        Random local( ( static_cast<std::uint64_t>( bits[0] ) << 32 ) ^ ( static_cast<std::uint64_t>( bits[1] ) << 16 ) ^ bits[2] );
+        Random& rng = random != nullptr ? *random : local;
+
+        glm::vec3 sum( 0.0f );
+        for ( int i = 0; i < paths; ++i )
+        {
+            sum += trace_path( scene, hit, bounces, rng );
+        }
+
+        return sum / static_cast<float>( paths );
+    }
+
+    /// Radiance arriving at the hit from one cosine distributed direction, shaded
+    /// at the next hit like IrradianceCache does, with the bounces beyond traced.
+    static glm::vec3 trace_path(Scene const& scene, Hit const& hit, int const bounces, Random& random) {
+
+        const float epsilon = 0.01f;
+
+        glm::vec3 direction = sample_cosine_hemisphere( hit.normal, random.next(), random.next() );
+        Hit next = Evaluate( scene, Ray{ hit.intersection + epsilon * hit.normal, direction } );
+
+        if ( next.is_miss() )
+            return Sky( scene, direction );
+
+        glm::vec3 material = Material( scene, next );
+        glm::vec3 L = scene.light.direction;
+        float cosine = std::max( glm::dot( next.normal, L ), 0.0f );
+
+        glm::vec3 radiance( 0.0f );
+        if ( cosine > 0.0f && !Occluded( scene, Ray{ next.intersection + epsilon * next.normal, L } ) )
+            radiance = 0.8f * material * scene.light.diffuse * cosine;
+
+        if ( bounces > 1 )
+            radiance += material * trace_path( scene, next, bounces - 1, random );
+
+        return radiance;
+    }
+};
+
+/// Benchmarks rendering a frame with an IrradianceCache as scene.indirect, starting empty
+/// every repetition (per camera ray). "cachePsnr" is set to the PSNR of the frame rendered
+/// with the warmed up cache against PathTracedIndirect, "ambientPsnr" to that of the
+/// constant ambient term (no indirect source). scene.indirect is left as it was.
+inline BenchmarkResult benchmark_irradiance_cache(std::string const& name, Scene& scene, Camera const& camera,
+                                                  int const width, int const height, IrradianceCacheSettings const& cacheSettings,
+                                                  RenderSettings const& settings, float& cachePsnr, float& ambientPsnr,
+                                                  int const repetitions = 5) {
+
+    IndirectSource const* previous = scene.indirect;
+    IrradianceCache cache( cacheSettings );
+    Image image( width, height );
+    scene.indirect = &cache;
+
+    BenchmarkResult result = run_benchmark( name, "ray", static_cast<double>( width ) * height * settings.samples, repetitions, [&]() {
+        cache.clear();
+        render( scene, camera, image, settings );
+    } );
+
+    // the frame after the warm up one
+    render( scene, camera, image, settings );
+
+    PathTracedIndirect pathTraced;
+    Image reference( width, height );
+    scene.indirect = &pathTraced;
+    render( scene, camera, reference, settings );
+    cachePsnr = psnr( image, reference );
+
+    Image ambient( width, height );
+    scene.indirect = nullptr;
+    render( scene, camera, ambient, settings );
+    ambientPsnr = psnr( ambient, reference );
+
+    scene.indirect = previous;
+
+    return result;
+}
+
+/// Benchmarks render_sorted() (per camera ray); with settings.sort on and off the cache
+/// misses per ray show what sorting the shadow rays saves.
+inline BenchmarkResult benchmark_render_sorted(std::string const& name, Scene const& scene, Camera const& camera,
+                                               int const width, int const height,
+                                               SortedRenderSettings const& settings = SortedRenderSettings(), int const repetitions = 5) {
+
+    Image image( width, height );
+
+    return run_benchmark( name, "ray", static_cast<double>( width ) * height * settings.render.samples, repetitions, [&]() {
+        render_sorted( scene, camera, image, settings );
+    } );
+}
+
+/// Benchmarks render_out_of_core() of the treelet file at "path" keeping at most "budget"
+/// bytes mapped (per camera ray, with a cache starting empty every repetition). "loads" and
+/// "mappedBytes" are set to the treelets mapped for a frame and their bytes, "framePsnr" to
+/// the PSNR of the frame against render() of "scene" (the geometry written to the file).
+inline BenchmarkResult benchmark_out_of_core(std::string const& name, std::string const& path, std::uint64_t const budget,
+                                             Scene const& scene, Camera const& camera, int const width, int const height,
+                                             std::uint64_t& loads, std::uint64_t& mappedBytes, float& framePsnr,
+                                             int const repetitions = 5) {
+
+    Image image( width, height );
+
+    BenchmarkResult result = run_benchmark( name, "ray", static_cast<double>( width ) * height, repetitions, [&]() {
+        TreeletCache cache( path, budget );
+        render_out_of_core( cache, scene, camera, image );
+    } );
+
+    TreeletCache cache( path, budget );
+    render_out_of_core( cache, scene, camera, image );
+    loads = cache.loads();
+    mappedBytes = cache.mapped_bytes();
+
+    Image reference( width, height );
+    render( scene, camera, reference );
+    framePsnr = psnr( image, reference );
+
+    return result;
+}
+
+/// Benchmarks building "map" from "settings" for the camera (per depth texel of all cascades).
+/// The map is left built, e.g. to render with it as scene.shadows.
+inline BenchmarkResult benchmark_shadow_map(std::string const& name, ShadowMap& map, ShadowMapSettings const& settings,
+                                            Scene const& scene, std::vector<Branch> const& branches, std::vector<Leaf> const& leaves,
+                                            Camera const& camera, int const width, int const height, int const repetitions = 5) {
+
+    map = ShadowMap( settings );
+    double texels = static_cast<double>( settings.resolution ) * settings.resolution * std::max( settings.cascades, 1 );
+
+    return run_benchmark( name, "texel", texels, repetitions, [&]() {
+        map.build( scene, branches, leaves, &camera, width, height );
+    } );
+}
+
+/// Benchmarks drawing a preview of the tree with the Rasterizer (per pixel). "agreement" is set
+/// to the fraction of the pixels showing the tree (in either image) where the preview shows the
+/// primitive Evaluate() finds for the primary ray through the pixel center.
+inline BenchmarkResult benchmark_raster(std::string const& name, Scene const& scene, std::vector<Branch> const& branches,
+                                        std::vector<Leaf> const& leaves, Camera const& camera, int const width, int const height,
+                                        RasterSettings const& settings, double& agreement, int const repetitions = 5) {
+
+    Rasterizer rasterizer( settings );
+    RasterView view = RasterView::from_camera( camera, width, height );
+    RasterTarget target;
+
+    BenchmarkResult result = run_benchmark( name, "pixel", static_cast<double>( width ) * height, repetitions, [&]() {
+        rasterizer.draw( scene, branches, leaves, view, target );
+    } );
+
+    // sky and ground agree almost everywhere, only the pixels of the tree are counted
+    auto tree = [](std::uint32_t const id) {
+        return ( id >> 30 ) >= static_cast<std::uint32_t>( Hit::Kind::Branch );
+    };
+
+    std::size_t covered = 0U, same = 0U;
+    for ( int y = 0; y < height; ++y )
+    {
+        for ( int x = 0; x < width; ++x )
+        {
+            std::uint32_t traced = Evaluate( scene, camera.generate_ray( x + 0.5f, y + 0.5f, width, height ) ).id();
+            std::uint32_t drawn = target.ids[static_cast<std::size_t>( y ) * width + x];
+
+            if ( tree( traced ) || tree( drawn ) )
+            {
+                ++covered;
+                same += traced == drawn ? 1U : 0U;
+            }
+        }
+    }
+    agreement = covered > 0U ? static_cast<double>( same ) / covered : 1.0;
+
+    return result;
+}
+
+/// Benchmarks denoising "noisy" with the guides of "gbuffer" into "output" (per megapixel,
+/// so 1e3 / throughput() is the time in ms per megapixel).
+inline BenchmarkResult benchmark_denoiser(std::string const& name, Image const& noisy, GBuffer const& gbuffer, Image& output,
+                                          DenoiserSettings const& settings = DenoiserSettings(), int const repetitions = 5) {
+
+    Denoiser denoiser( settings );
+
+    return run_benchmark( name, "megapixel", 1e-6 * noisy.width * noisy.height, repetitions, [&]() {
+        denoiser.denoise( noisy, gbuffer, output );
+    } );
+}
+
+/// Benchmarks WindDeformer::deform (per frame, "frames" of them a tenth of a second apart).
+inline BenchmarkResult benchmark_wind(std::string const& name, Skeleton const& skeleton, std::vector<Branch> const& branches,
+                                      std::vector<Leaf> const& leaves, int const frames = 100, int const repetitions = 5) {
+
+    WindDeformer deformer( skeleton, branches, leaves );
+    WindSettings settings;
+    std::vector<Branch> posedBranches;
+    std::vector<Leaf> posedLeaves;
+
+    return run_benchmark( name, "frame", static_cast<double>( frames ), repetitions, [&]() {
+        for ( int frame = 0; frame < frames; ++frame )
+        {
+            deformer.deform( 0.1f * frame, settings, posedBranches, posedLeaves );
+        }
+    } );
+}
+
+/// A camera path of "frames" cameras orbiting the target of "camera" by "turn" radians
+/// per frame while moving "advance" world units towards it.
+inline std::vector<Camera> camera_path(Camera const& camera, int const frames, float const turn, float const advance) {
+
+    std::vector<Camera> path;
+    glm::vec3 offset = camera.position - camera.target;
+
+    for ( int i = 0; i < frames; ++i )
+    {
+        float angle = turn * i;
+        glm::vec3 direction( offset.x * std::cos( angle ) + offset.z * std::sin( angle ), offset.y,
+                             offset.z * std::cos( angle ) - offset.x * std::sin( angle ) );
+
+        Camera frame = camera;
+        frame.position = camera.target + direction * ( 1.0f - advance * i / glm::length( offset ) );
+        path.push_back( frame );
+    }
+
+    return path;
+}
+
+/// Benchmarks rendering the camera path with TemporalRenderer (per frame). "rays" is set
+/// to the rays it traced per frame on average, "worstPsnr" to the lowest PSNR of a frame
+/// against rendering it from scratch with render().
+inline BenchmarkResult benchmark_temporal(std::string const& name, Scene const& scene, std::vector<Camera> const& path,
+                                          int const width, int const height, TemporalSettings const& settings,
+                                          double& rays, float& worstPsnr, int const repetitions = 5) {
+
+    Image image( width, height );
+
+    BenchmarkResult result = run_benchmark( name, "frame", static_cast<double>( path.size() ), repetitions, [&]() {
+        TemporalRenderer temporal( settings );
+        for ( Camera const& camera : path )
+        {
+            temporal.render( scene, camera, image );
+        }
+    } );
+
+    TemporalRenderer temporal( settings );
+    Image reference( width, height );
+    std::size_t traced = 0U;
+    worstPsnr = std::numeric_limits<float>::infinity();
+
+    for ( Camera const& camera : path )
+    {
+        temporal.render( scene, camera, image );
+        render( scene, camera, reference, settings.render );
+
+        traced += temporal.traced_pixels();
+        worstPsnr = std::min( worstPsnr, psnr( image, reference ) );
+    }
+    rays = static_cast<double>( traced ) / path.size();
+
+    return result;
+}
+
+/// Benchmarks TreeQuery::nearest_branches for the points (per query).
+inline BenchmarkResult benchmark_nearest_branches(std::string const& name, TreeQuery const& query, std::vector<glm::vec3> const& points,
+                                                  unsigned int const threads = 0U, int const repetitions = 5) {
+
+    std::vector<NearestBranch> results;
+
+    return run_benchmark( name, "query", static_cast<double>( points.size() ), repetitions, [&]() {
+        query.nearest_branches( points, results, std::numeric_limits<float>::infinity(), threads );
+    } );
+}
+
+/// Benchmarks TreeQuery::segment_casts from "from[i]" to "to[i]" (per segment).
+inline BenchmarkResult benchmark_segment_casts(std::string const& name, TreeQuery const& query, std::vector<glm::vec3> const& from,
+                                               std::vector<glm::vec3> const& to, unsigned int const threads = 0U, int const repetitions = 5) {
+
+    std::vector<Hit> results;
+
+    return run_benchmark( name, "segment", static_cast<double>( std::min( from.size(), to.size() ) ), repetitions, [&]() {
+        query.segment_casts( from, to, results, threads );
+    } );
+}
+
+/// UVs to look a texture up at: "count" random ones (the incoherent access of rays hitting
+/// random surfaces), or about as many on a row-major grid over [0, 1]^2 when "coherent".
+inline std::vector<glm::vec2> benchmark_uvs(std::size_t const count, bool const coherent, std::uint64_t const seed = 1U) {
+
+    std::vector<glm::vec2> uvs;
+    uvs.reserve( count );
+
+    if ( coherent )
+    {
+        std::size_t side = std::max<std::size_t>( static_cast<std::size_t>( std::sqrt( static_cast<double>( count ) ) ), 1U );
+        for ( std::size_t y = 0; y < side; ++y )
+        {
+            for ( std::size_t x = 0; x < side; ++x )
+            {
+                uvs.push_back( glm::vec2( ( x + 0.5f ) / side, ( y + 0.5f ) / side ) );
+            }
+        }
+        return uvs;
+    }
+
+    Random random( seed );
+    for ( std::size_t i = 0; i < count; ++i )
+    {
+        uvs.push_back( glm::vec2( random.next(), random.next() ) );
+    }
+
+    return uvs;
+}
+
+/// Benchmarks bilinear lookups of the texture at the UVs (per texel fetch, four per lookup);
+/// "footprint" selects the mip level as for a ray.
+inline BenchmarkResult benchmark_texture(std::string const& name, Texture2D const& texture, std::vector<glm::vec2> const& uvs,
+                                         float const footprint = 0.0f, int const repetitions = 5) {
+
+    glm::vec4 sum(0.0f);
+
+    BenchmarkResult result = run_benchmark( name, "texel fetch", 4.0 * uvs.size(), repetitions, [&]() {
+        for ( glm::vec2 const& uv : uvs )
+        {
+            sum = sum + texture.sample( uv, footprint );
+        }
+    } );
+
+    // read afterwards, so the lookups are not optimized away
+    volatile float sink = sum.x;
+    static_cast<void>( sink );
+
+    return result;
+}
+
+/// Benchmarks intersecting camera rays (a "width" x "height" grid) with every leaf of the
+/// scene (per ray-leaf test), either one leaf at a time with RayLeafIntersection over a plain
+/// array of LeafRecord or leaf_lane_count at a time with the lane kernel. The closest hit of
+/// every ray is compared with the one of the other path (the same leaf, t within 1e-5
+/// relative); "mismatches" counts the rays that differ.
+inline BenchmarkResult benchmark_leaf_tests(std::string const& name, Scene const& scene, Camera const& camera,
+                                            int const width, int const height, bool const lanes, std::size_t& mismatches,
+                                            int const repetitions = 5) {
+
+    std::vector<Ray> rays;
+    for ( int y = 0; y < height; ++y )
+    {
+        for ( int x = 0; x < width; ++x )
+        {
+            rays.push_back( camera.generate_ray( x + 0.5f, y + 0.5f, width, height ) );
+        }
+    }
+
+    LeafRecords const& leaves = scene.records.leaves;
+
+    // the scalar path reads whole records, not the 12 arrays of LeafRecords
+    std::vector<LeafRecord> records( leaves.size() );
+    for ( std::size_t i = 0; i < leaves.size(); ++i )
+    {
+        records[i] = leaves[i];
+    }
+
+    auto closestHit = [&](Ray const& ray, bool const useLanes) {
+        Hit closest;
+
+        if ( useLanes )
+        {
+            RayLeafRangeIntersection( ray, leaves, 0U, leaves.size(), closest, [](glm::vec2 const&) { return true; } );
+        }
+        else
+        {
+            for ( std::size_t i = 0; i < records.size(); ++i )
+            {
+                if ( RayLeafIntersection( ray, records[i], closest.t, closest ) )
+                    closest.index = static_cast<std::uint32_t>( i );
+            }
+        }
+
+        return closest;
+    };
+
+    // the results are kept, so the loops are not optimized away
+    std::vector<Hit> found( rays.size() );
+
+    BenchmarkResult result = run_benchmark( name, "leaf test", static_cast<double>( rays.size() ) * leaves.size(), repetitions, [&]() {
+        for ( std::size_t r = 0; r < rays.size(); ++r )
+        {
+            found[r] = closestHit( rays[r], lanes );
+        }
+    } );
+
+    mismatches = 0U;
+    for ( std::size_t r = 0; r < rays.size(); ++r )
+    {
+        Hit expected = closestHit( rays[r], !lanes );
+        bool same = found[r].is_miss() == expected.is_miss();
+        if ( same && !expected.is_miss() )
+            same = found[r].index == expected.index && std::abs( found[r].t - expected.t ) <= 1e-5f * expected.t;
+
+        mismatches += same ? 0U : 1U;
+    }
+
+    return result;
+}
@@ -0,0 +1,418 @@
+#pragma once
+
+#include "intersection_records.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+/// An axis aligned bounding box.
+struct Bounds {
+    glm::vec3 minimum = glm::vec3( std::numeric_limits<float>::max() );
+    glm::vec3 maximum = glm::vec3( -std::numeric_limits<float>::max() );
+
+    void grow(glm::vec3 const& p) {
+
+        minimum = glm::min( minimum, p );
+        maximum = glm::max( maximum, p );
+    }
+
+    void grow(Bounds const& b) {
+
+        minimum = glm::min( minimum, b.minimum );
+        maximum = glm::max( maximum, b.maximum );
+    }
+
+    bool empty() const {
+
+        return minimum.x > maximum.x;
+    }
+
+    glm::vec3 center() const {
+
+        return 0.5f * ( minimum + maximum );
+    }
+
+    float area() const {
+
+        if ( empty() )
+            return 0.0f;
+
+        glm::vec3 d = maximum - minimum;
+        return 2.0f * ( d.x * d.y + d.y * d.z + d.z * d.x );
+    }
+};
+
+/// Bounds of a branch (both end spheres).
+inline Bounds branch_bounds(BranchRecord const& branch) {
+
+    Bounds b;
+    b.grow( branch.p1 - branch.r1 );
+    b.grow( branch.p1 + branch.r1 );
+    b.grow( branch.p2 - branch.r2 );
+    b.grow( branch.p2 + branch.r2 );
+
+    return b;
+}
+
+/// Bounds of a leaf (its four corners), empty for a degenerate leaf no ray hits.
+inline Bounds leaf_bounds(LeafRecord const& leaf) {
+
+    Bounds b;
+    if ( leaf_degenerate( leaf ) )
+        return b;
+
+    b.grow( leaf_point( leaf, 0.0f, 0.0f ) );
+    b.grow( leaf_point( leaf, 1.0f, 0.0f ) );
+    b.grow( leaf_point( leaf, 0.0f, 1.0f ) );
+    b.grow( leaf_point( leaf, 1.0f, 1.0f ) );
+
+    return b;
+}
+
+/// Bounds of a primitive given by its Hit::id().
+inline Bounds primitive_bounds(PrimitiveRecords const& records, std::uint32_t const id) {
+
+    std::uint32_t index = id & 0x3FFFFFFFU;
+
+    if ( ( id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+        return branch_bounds( records.branches[index] );
+
+    return leaf_bounds( records.leaves[index] );
+}
+
+/// A bounding volume hierarchy over the branches and leaves of the records,
+/// built with binned SAH. Nodes are stored depth first: the left child of
+/// an inner node directly follows it, the right child is at "first".
+struct BVH {
+
+    struct Node {
+        glm::vec3 minimum;
+        std::uint32_t first;        // first primitive (leaf node) or right child (inner node)
+        glm::vec3 maximum;
+        std::uint32_t count;        // number of primitives, 0 for inner nodes
+
+        bool is_leaf() const {
+
+            return count > 0U;
+        }
+    };
+
+    std::vector<Node> nodes;
+    std::vector<std::uint32_t> primitives;      // Hit::id() of the primitives, ordered by the leaf nodes
+
+    /// Entries of the traversal stacks. A traversal holds at most one entry per level plus
+    /// one, so build() stops splitting at depth stack_size - 1 (the rest becomes one leaf).
+    static constexpr std::uint32_t stack_size = 64U;
+
+    bool empty() const {
+
+        return nodes.empty();
+    }
+
+    void build(PrimitiveRecords const& records) {
+
+        std::vector<std::uint32_t> ids;
+        std::vector<Bounds> bounds;
+
+        for ( std::size_t i = 0; i < records.branches.size(); ++i )
+        {
+            ids.push_back( Hit::make_id( Hit::Kind::Branch, static_cast<std::uint32_t>( i ) ) );
+        }
+        for ( std::size_t i = 0; i < records.leaves.size(); ++i )
+        {
+            ids.push_back( Hit::make_id( Hit::Kind::Leaf, static_cast<std::uint32_t>( i ) ) );
+        }
+
+        bounds.reserve( ids.size() );
+        for ( std::uint32_t id : ids )
+        {
+            bounds.push_back( primitive_bounds( records, id ) );
+        }
+
+        build( ids, bounds );
+    }
+
+    /// Builds over any boxes (e.g. the instances of a forest, see impostor.hpp);
+    /// "ids[i]" is what traverse() passes to the test for "bounds[i]".
+    void build(std::vector<std::uint32_t> const& ids, std::vector<Bounds> const& bounds) {
+
+        nodes.clear();
+        primitives = ids;
+
+        if ( primitives.empty() )
+            return;
+
+        std::vector<glm::vec3> centers;
+        centers.reserve( bounds.size() );
+        for ( Bounds const& b : bounds )
+        {
+            centers.push_back( b.center() );
+        }
+
+        // primitives are referenced through "order" while building
+        std::vector<std::uint32_t> order( primitives.size() );
+        for ( std::uint32_t i = 0; i < order.size(); ++i )
+        {
+            order[i] = i;
+        }
+
+        nodes.reserve( 2 * primitives.size() );
+        build_node( bounds, centers, order, 0U, static_cast<std::uint32_t>( order.size() ), 0U );
+
+        std::vector<std::uint32_t> sorted( order.size() );
+        for ( std::size_t i = 0; i < order.size(); ++i )
+        {
+            sorted[i] = primitives[order[i]];
+        }
+        primitives.swap( sorted );
+    }
+
+    /// Updates the boxes after the primitives moved (the topology is kept).
+    void refit(PrimitiveRecords const& records) {
+
+        // children follow their parents -> walking backwards visits children first
+        for ( std::size_t n = nodes.size(); n-- > 0; )
+        {
+            Node& node = nodes[n];
+            Bounds b;
+
+            if ( node.is_leaf() )
+            {
+                for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+                {
+                    b.grow( primitive_bounds( records, primitives[i] ) );
+                }
+            }
+            else
+            {
+                Node const& left = nodes[n + 1];
+                Node const& right = nodes[node.first];
+                b.minimum = glm::min( left.minimum, right.minimum );
+                b.maximum = glm::max( left.maximum, right.maximum );
+            }
+
+            node.minimum = b.minimum;
+            node.maximum = b.maximum;
+        }
+    }
+
+    /// Distance at which the ray enters the box of a node (infinity when it misses it before "t_max").
+    static float enter(Node const& node, glm::vec3 const& origin, glm::vec3 const& inv_direction, float const t_max) {
+
+        glm::vec3 t0 = ( node.minimum - origin ) * inv_direction;
+        glm::vec3 t1 = ( node.maximum - origin ) * inv_direction;
+        glm::vec3 near = glm::min( t0, t1 );
+        glm::vec3 far = glm::max( t0, t1 );
+
+        float tNear = std::max( std::max( near.x, near.y ), std::max( near.z, 0.0f ) );
+        float tFar = std::min( std::min( far.x, far.y ), std::min( far.z, t_max ) );
+
+        return tNear <= tFar ? tNear : std::numeric_limits<float>::infinity();
+    }
+
+    /// Walks the nodes the ray enters before "t_max", closer boxes first.
+    /// "test(id)" intersects a primitive and may lower "t_max" (it is re-read after every call);
+    /// returning true stops the traversal (e.g. for shadow rays).
+    /// Returns the number of nodes visited.
+    template <typename Test>
+    std::uint32_t traverse(Ray const& ray, float const& t_max, Test&& test) const {
+
+        if ( nodes.empty() )
+            return 0U;
+
+        return traverse( nodes.data(), primitives.data(), ray, t_max, test );
+    }
+
+    /// The same traversal over nodes and primitives stored elsewhere (e.g. a mapped treelet, see out_of_core.hpp).
+    template <typename Test>
+    static std::uint32_t traverse(Node const* nodes, std::uint32_t const* primitives, Ray const& ray, float const& t_max, Test&& test) {
+
+        return traverse_leaves( nodes, primitives, ray, t_max, [&](std::uint32_t const* ids, std::uint32_t const count) {
+            for ( std::uint32_t i = 0; i < count; ++i )
+            {
+                if ( test( ids[i] ) )
+                    return true;
+            }
+            return false;
+        } );
+    }
+
+    /// Walks the nodes like traverse(), but "test(ids, count)" gets all the primitives of a
+    /// leaf node at once (e.g. to test its leaves together, see EvaluatePrimitives()).
+    /// A node holds up to 16 primitives (4 * max_leaf_size when no split is cheaper), more only at the depth limit.
+    template <typename Test>
+    std::uint32_t traverse_leaves(Ray const& ray, float const& t_max, Test&& test) const {
+
+        if ( nodes.empty() )
+            return 0U;
+
+        return traverse_leaves( nodes.data(), primitives.data(), ray, t_max, test );
+    }
+
+    template <typename Test>
+    static std::uint32_t traverse_leaves(Node const* nodes, std::uint32_t const* primitives, Ray const& ray, float const& t_max,
+                                         Test&& test) {
+
+        glm::vec3 invDirection = 1.0f / ray.direction;
+        std::uint32_t visited = 0U;
+
+        std::uint32_t stack[stack_size];
+        int top = 0;
+        stack[top++] = 0U;
+
+        while ( top > 0 )
+        {
+            Node const& node = nodes[stack[--top]];
+            ++visited;
+
+            if ( enter( node, ray.origin, invDirection, t_max ) == std::numeric_limits<float>::infinity() )
+                continue;
+
+            if ( node.is_leaf() )
+            {
+                if ( test( primitives + node.first, node.count ) )
+                    return visited;
+                continue;
+            }
+
+            // push the farther child first so the closer one is visited next
+            std::uint32_t left = static_cast<std::uint32_t>( &node - nodes ) + 1U;
+            std::uint32_t right = node.first;
+            float tLeft = enter( nodes[left], ray.origin, invDirection, t_max );
+            float tRight = enter( nodes[right], ray.origin, invDirection, t_max );
+
+            if ( tLeft > tRight )
+            {
+                std::swap( tLeft, tRight );
+                std::swap( left, right );
+            }
+            if ( tRight != std::numeric_limits<float>::infinity() )
+                stack[top++] = right;
+            if ( tLeft != std::numeric_limits<float>::infinity() )
+                stack[top++] = left;
+        }
+
+        return visited;
+    }
+
+private:
+
+    static constexpr std::uint32_t max_leaf_size = 4U;
+    static constexpr int bin_count = 16;
+
+    std::uint32_t build_node(std::vector<Bounds> const& bounds, std::vector<glm::vec3> const& centers,
+                             std::vector<std::uint32_t>& order, std::uint32_t const begin, std::uint32_t const end,
+                             std::uint32_t const depth) {
+
+        std::uint32_t index = static_cast<std::uint32_t>( nodes.size() );
+        nodes.push_back( Node() );
+
+        Bounds nodeBounds, centerBounds;
+        for ( std::uint32_t i = begin; i < end; ++i )
+        {
+            nodeBounds.grow( bounds[order[i]] );
+            centerBounds.grow( centers[order[i]] );
+        }
+
+        nodes[index].minimum = nodeBounds.minimum;
+        nodes[index].maximum = nodeBounds.maximum;
+
+        std::uint32_t count = end - begin;
+        bool leaf = count <= max_leaf_size || depth + 1U >= stack_size;
+        std::uint32_t mid = leaf ? begin : split( bounds, centers, order, begin, end, nodeBounds, centerBounds );
+
+        if ( mid == begin || mid == end )
+        {
+            nodes[index].first = begin;
+            nodes[index].count = count;
+            return index;
+        }
+
+        nodes[index].count = 0U;
+        build_node( bounds, centers, order, begin, mid, depth + 1U );
+        std::uint32_t right = build_node( bounds, centers, order, mid, end, depth + 1U );
+        nodes[index].first = right;
+
+        return index;
+    }
+
+    /// Finds the cheapest binned SAH split and partitions "order", returns the middle
+    /// (or "begin" when no split beats a leaf).
+    std::uint32_t split(std::vector<Bounds> const& bounds, std::vector<glm::vec3> const& centers,
+                        std::vector<std::uint32_t>& order, std::uint32_t const begin, std::uint32_t const end,
+                        Bounds const& nodeBounds, Bounds const& centerBounds) const {
+
+        glm::vec3 extent = centerBounds.maximum - centerBounds.minimum;
+        int axis = extent.x > extent.y ? ( extent.x > extent.z ? 0 : 2 ) : ( extent.y > extent.z ? 1 : 2 );
+
+        if ( extent[axis] <= 0.0f )
+            return median( centers, order, begin, end, axis );
+
+        Bounds binBounds[bin_count];
+        std::uint32_t binCounts[bin_count] = {};
+        float scale = bin_count / extent[axis];
+
+        auto binOf = [&](std::uint32_t const i) {
+            int bin = static_cast<int>( ( centers[i][axis] - centerBounds.minimum[axis] ) * scale );
+            return std::min( std::max( bin, 0 ), bin_count - 1 );
+        };
+
+        for ( std::uint32_t i = begin; i < end; ++i )
+        {
+            int bin = binOf( order[i] );
+            binBounds[bin].grow( bounds[order[i]] );
+            ++binCounts[bin];
+        }
+
+        // sweep from the right, then from the left
+        float rightCost[bin_count];
+        Bounds accumulated;
+        std::uint32_t accumulatedCount = 0U;
+        for ( int b = bin_count - 1; b > 0; --b )
+        {
+            accumulated.grow( binBounds[b] );
+            accumulatedCount += binCounts[b];
+            rightCost[b] = accumulated.area() * accumulatedCount;
+        }
+
+        float bestCost = std::numeric_limits<float>::max();
+        int bestSplit = -1;
+        accumulated = Bounds();
+        accumulatedCount = 0U;
+        for ( int b = 0; b < bin_count - 1; ++b )
+        {
+            accumulated.grow( binBounds[b] );
+            accumulatedCount += binCounts[b];
+            float cost = accumulated.area() * accumulatedCount + rightCost[b + 1];
+            if ( accumulatedCount > 0U && cost < bestCost )
+            {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        float leafCost = nodeBounds.area() * ( end - begin );
+        if ( bestSplit < 0 || ( bestCost >= leafCost && end - begin <= 4U * max_leaf_size ) )
+            return begin;
+
+        std::uint32_t* mid = std::partition( order.data() + begin, order.data() + end, [&](std::uint32_t const i) {
+            return binOf( i ) <= bestSplit;
+        } );
+
+        std::uint32_t middle = static_cast<std::uint32_t>( mid - order.data() );
+        return ( middle == begin || middle == end ) ? median( centers, order, begin, end, axis ) : middle;
+    }
+
+    static std::uint32_t median(std::vector<glm::vec3> const& centers, std::vector<std::uint32_t>& order,
+                                std::uint32_t const begin, std::uint32_t const end, int const axis) {
+
+        std::uint32_t middle = begin + ( end - begin ) / 2U;
+        std::nth_element( order.data() + begin, order.data() + middle, order.data() + end, [&](std::uint32_t const a, std::uint32_t const b) {
+            return centers[a][axis] < centers[b][axis];
+        } );
+
+        return middle;
+    }
+};
@@ -0,0 +1,328 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "image.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+// The loops over a row take their sums as __restrict parameters, which only hold while
+// the function is not inlined (inlined, the compiler needs more alias checks against the
+// inputs than it makes before vectorizing).
+#if defined(_MSC_VER)
+#define LSYSTEM_DENOISER_NOINLINE __declspec(noinline)
+#else
+#define LSYSTEM_DENOISER_NOINLINE __attribute__((noinline))
+#endif
+
+/// Settings of the edge-aware denoiser.
+struct DenoiserSettings {
+    int iterations = 5;             // the footprint is 2^(iterations + 2) - 3 pixels wide
+    float sigma_color = 4.0f;       // luminance difference, in standard deviations of the noise
+    float sigma_albedo = 0.1f;      // albedo difference
+    float sigma_depth = 0.02f;      // relative depth difference per pixel of distance
+    unsigned int threads = 0U;      // 0 -> all hardware threads
+};
+
+/// e^-x for x >= 0 within 1e-4 relative (down to 2^-126, larger x give that). Unlike
+/// std::exp it has no branches and no calls, so the loops over it vectorize.
+inline float exp_negative(float const x) {
+
+    float y = x * -1.44269504f;
+
+    // clamped at -126 through the bits: negative floats order like their bits read as integers
+    // (a float select here turns into a branch, the whole result is constant past it)
+    std::int32_t yBits;
+    std::memcpy( &yBits, &y, sizeof(yBits) );
+    yBits = std::min( yBits, static_cast<std::int32_t>( 0xC2FC0000 ) );
+    std::memcpy( &y, &yBits, sizeof(y) );
+
+    // 2^y = 2^i * 2^f with i = round(y) read from the mantissa of y + 1.5 * 2^23, f in [-0.5, 0.5]
+    float shifted = y + 12582912.0f;
+    float f = y - ( shifted - 12582912.0f );
+    std::int32_t i;
+    std::memcpy( &i, &shifted, sizeof(i) );
+
+    float p = 1.0f + f * ( 0.6931472f + f * ( 0.2402265f + f * ( 0.05550411f + f * 0.009618129f ) ) );
+
+    std::int32_t scaleBits = ( i - 0x4B400000 + 127 ) << 23;
+    float scale;
+    std::memcpy( &scale, &scaleBits, sizeof(scale) );
+
+    return p * scale;
+}
+
+/// An edge-aware a-trous wavelet filter guided by the G-buffer of the tracer (as SVGF
+/// without the temporal part). The lighting is filtered without the albedo (so textures
+/// stay sharp) with a 5x5 B3-spline kernel whose taps spread twice as far in every iteration.
+/// Taps are weighted down across normal, depth and albedo edges, and across luminance
+/// differences larger than the noise: the variance of the luminance is estimated from the
+/// neighbourhood of every pixel and filtered along with the color, so flat noisy areas blur
+/// and shadow edges stay. The planes are stored per channel, kept between calls, and every
+/// tap is applied to a whole row, a loop without branches that vectorizes (the sums are the
+/// output row itself); rows run in parallel.
+struct Denoiser {
+
+    explicit Denoiser(DenoiserSettings const& settings_ = DenoiserSettings())
+        : settings(settings_)
+    {}
+
+    void denoise(Image const& noisy, GBuffer const& gbuffer, Image& output) {
+
+        width = noisy.width;
+        height = noisy.height;
+        std::size_t count = static_cast<std::size_t>( width ) * height;
+
+        for ( std::vector<float>* plane : { &r, &g, &b, &ar, &ag, &ab, &nx, &ny, &nz, &luminance, &variance, &invSigmaColor,
+                                            &outR, &outG, &outB, &outVariance, &weights } )
+        {
+            plane->resize( count );
+        }
+        depth = gbuffer.depth;
+
+        // demodulate: divide the albedo out of the color
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            glm::vec3 albedo = gbuffer.albedo.pixels[i];
+            glm::vec3 safe = glm::max( albedo, glm::vec3(1e-3f) );
+            glm::vec3 lighting = noisy.pixels[i] / safe;
+
+            r[i] = lighting.r; g[i] = lighting.g; b[i] = lighting.b;
+            ar[i] = albedo.r; ag[i] = albedo.g; ab[i] = albedo.b;
+            nx[i] = gbuffer.normal.pixels[i].x; ny[i] = gbuffer.normal.pixels[i].y; nz[i] = gbuffer.normal.pixels[i].z;
+            luminance[i] = 0.2126f * r[i] + 0.7152f * g[i] + 0.0722f * b[i];
+        }
+
+        parallel_for( static_cast<std::size_t>( height ), settings.threads, [&](std::size_t const row) {
+            estimate_variance_row( static_cast<int>( row ) );
+        } );
+
+        for ( int iteration = 0; iteration < settings.iterations; ++iteration )
+        {
+            int step = 1 << iteration;
+
+            for ( std::size_t i = 0; i < count; ++i )
+            {
+                luminance[i] = 0.2126f * r[i] + 0.7152f * g[i] + 0.0722f * b[i];
+                invSigmaColor[i] = 1.0f / ( settings.sigma_color * std::sqrt( variance[i] ) + 1e-4f );
+            }
+
+            parallel_for( static_cast<std::size_t>( height ), settings.threads, [&](std::size_t const row) {
+                filter_row( static_cast<int>( row ), step );
+            } );
+
+            r.swap( outR );
+            g.swap( outG );
+            b.swap( outB );
+            variance.swap( outVariance );
+        }
+
+        // remodulate
+        output = Image( width, height );
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            glm::vec3 albedo( ar[i], ag[i], ab[i] );
+            output.pixels[i] = glm::vec3( r[i], g[i], b[i] ) * glm::max( albedo, glm::vec3(1e-3f) );
+        }
+    }
+
+private:
+
+    /// Pointers into the guide planes, copied into the row loops so that the stores of the
+    /// sums cannot alias them (the compiler reloads members after every store otherwise).
+    struct Guides {
+        float const* nx; float const* ny; float const* nz;
+        float const* depth;
+        float const* ar; float const* ag; float const* ab;
+        float invSigmaAlbedo;
+
+        /// Weight of the tap from p to q for the normals, depths and albedos (1 for the same surface).
+        float weight(std::size_t const p, std::size_t const q, float const depthScale) const {
+
+            // normals: max(0, cos)^32, the max as arithmetic (see exp_negative())
+            float cosine = nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q];
+            float n = 0.5f * ( cosine + std::abs( cosine ) );
+            n *= n; n *= n; n *= n; n *= n; n *= n;
+
+            float dz = std::abs( depth[p] - depth[q] ) / ( depthScale * depth[p] + 1e-6f );
+            float da = ( ( ar[p] - ar[q] ) * ( ar[p] - ar[q] ) + ( ag[p] - ag[q] ) * ( ag[p] - ag[q] )
+                       + ( ab[p] - ab[q] ) * ( ab[p] - ab[q] ) ) * invSigmaAlbedo;
+
+            return n * exp_negative( dz + da );
+        }
+    };
+
+    Guides guides() const {
+
+        return { nx.data(), ny.data(), nz.data(), depth.data(), ar.data(), ag.data(), ab.data(),
+                 1.0f / ( settings.sigma_albedo * settings.sigma_albedo ) };
+    }
+
+    /// Adds the luminance of the pixels [rowQ + xs, rowQ + xe) and its square, weighted by
+    /// the guides, to the sums of [rowP + xs, rowP + xe) (row relative).
+    LSYSTEM_DENOISER_NOINLINE void add_moments(Guides const& guide, std::size_t const rowP, std::size_t const rowQ,
+                                               std::size_t const xs, std::size_t const xe, float* __restrict sumW,
+                                               float* __restrict sumL, float* __restrict sumL2) const {
+
+        float const* lum = luminance.data();
+
+        for ( std::size_t x = xs; x < xe; ++x )
+        {
+            std::size_t q = rowQ + x;
+            float w = guide.weight( rowP + x, q, settings.sigma_depth );
+
+            sumW[x] += w;
+            sumL[x] += w * lum[q];
+            sumL2[x] += w * lum[q] * lum[q];
+        }
+    }
+
+    /// The variance of the luminance around the pixels of row "y": the moments of the 5x5
+    /// neighbours on the same surface (a single sample per pixel has no variance of its own).
+    void estimate_variance_row(int const y) {
+
+        Guides const guide = guides();
+
+        std::size_t rowP = static_cast<std::size_t>( y ) * width;
+        float* sumW = weights.data() + rowP;
+        float* sumL = outR.data() + rowP;
+        float* sumL2 = outG.data() + rowP;
+
+        for ( float* sum : { sumW, sumL, sumL2 } )
+        {
+            std::fill( sum, sum + width, 0.0f );
+        }
+
+        for ( int qy = std::max( y - 2, 0 ); qy <= std::min( y + 2, height - 1 ); ++qy )
+        {
+            for ( int offset = -2; offset <= 2; ++offset )
+            {
+                std::size_t xs = static_cast<std::size_t>( std::max( 0, -offset ) );
+                std::size_t xe = static_cast<std::size_t>( std::min( width, width - offset ) );
+                std::size_t rowQ = static_cast<std::size_t>( qy ) * width + offset;
+
+                add_moments( guide, rowP, rowQ, xs, xe, sumW, sumL, sumL2 );
+            }
+        }
+
+        for ( int x = 0; x < width; ++x )
+        {
+            float inv = 1.0f / std::max( sumW[x], 1e-8f );
+            float mean = sumL[x] * inv;
+            variance[rowP + x] = std::max( sumL2[x] * inv - mean * mean, 0.0f );
+        }
+    }
+
+    /// Adds the taps from the pixels [rowQ + xs, rowQ + xe) to the sums of [rowP + xs, rowP + xe)
+    /// (row relative).
+    LSYSTEM_DENOISER_NOINLINE void add_taps(Guides const& guide, float const depthScale, float const k, std::size_t const rowP,
+                                            std::size_t const rowQ, std::size_t const xs, std::size_t const xe,
+                                            float* __restrict sumR, float* __restrict sumG, float* __restrict sumB,
+                                            float* __restrict sumV, float* __restrict sumW) const {
+
+        float const* lum = luminance.data();
+        float const* invSigma = invSigmaColor.data();
+        float const* inR = r.data();
+        float const* inG = g.data();
+        float const* inB = b.data();
+        float const* inV = variance.data();
+
+        for ( std::size_t x = xs; x < xe; ++x )
+        {
+            std::size_t p = rowP + x;
+            std::size_t q = rowQ + x;
+
+            float dc = std::abs( lum[p] - lum[q] ) * invSigma[p];
+            float w = k * guide.weight( p, q, depthScale ) * exp_negative( dc );
+
+            sumR[x] += w * inR[q];
+            sumG[x] += w * inG[q];
+            sumB[x] += w * inB[q];
+            sumV[x] += w * w * inV[q];
+            sumW[x] += w;
+        }
+    }
+
+    void filter_row(int const y, int const step) {
+
+        static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+        Guides const guide = guides();
+        float const depthScale = settings.sigma_depth * step;
+        float const* inR = r.data();
+        float const* inG = g.data();
+        float const* inB = b.data();
+        float const* inV = variance.data();
+
+        // the sums go straight into the output planes, the row is this thread's
+        std::size_t rowP = static_cast<std::size_t>( y ) * width;
+        float* sumR = outR.data() + rowP;
+        float* sumG = outG.data() + rowP;
+        float* sumB = outB.data() + rowP;
+        float* sumV = outVariance.data() + rowP;
+        float* sumW = weights.data() + rowP;
+
+        for ( float* sum : { sumR, sumG, sumB, sumV, sumW } )
+        {
+            std::fill( sum, sum + width, 0.0f );
+        }
+
+        for ( int ky = -2; ky <= 2; ++ky )
+        {
+            int qy = y + ky * step;
+            if ( qy < 0 || qy >= height )
+                continue;
+
+            for ( int kx = -2; kx <= 2; ++kx )
+            {
+                int offset = kx * step;
+                std::size_t xs = static_cast<std::size_t>( std::max( 0, -offset ) );
+                std::size_t xe = static_cast<std::size_t>( std::min( width, width - offset ) );
+                float k = kernel[ky + 2] * kernel[kx + 2];
+
+                std::size_t rowQ = static_cast<std::size_t>( qy ) * width + offset;
+
+                add_taps( guide, depthScale, k, rowP, rowQ, xs, xe, sumR, sumG, sumB, sumV, sumW );
+            }
+        }
+
+        for ( int x = 0; x < width; ++x )
+        {
+            std::size_t p = rowP + x;
+
+            // pixels without similar neighbours (not even themselves, e.g. zero normals) stay as they are
+            if ( sumW[x] > 1e-8f )
+            {
+                float inv = 1.0f / sumW[x];
+                sumR[x] *= inv;
+                sumG[x] *= inv;
+                sumB[x] *= inv;
+                sumV[x] *= inv * inv;
+            }
+            else
+            {
+                sumR[x] = inR[p];
+                sumG[x] = inG[p];
+                sumB[x] = inB[p];
+                sumV[x] = inV[p];
+            }
+        }
+    }
+
+    DenoiserSettings settings;
+    int width = 0;
+    int height = 0;
+
+    std::vector<float> r, g, b;             // demodulated lighting
+    std::vector<float> ar, ag, ab;          // albedo
+    std::vector<float> nx, ny, nz;          // normals
+    std::vector<float> depth;
+    std::vector<float> luminance;
+    std::vector<float> variance;            // of the luminance
+    std::vector<float> invSigmaColor;       // 1 / (sigma_color * standard deviation) per pixel
+    std::vector<float> outR, outG, outB, outVariance;
+    std::vector<float> weights;             // sums of the tap weights
+};
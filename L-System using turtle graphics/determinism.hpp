@@ -0,0 +1,115 @@
+#pragma once
+
+// Deterministic mode. Build with -DLSYSTEM_DETERMINISTIC to make generate_forest()
+// deterministic by default (see there); the turtle and the renderers already compute
+// every branch, leaf and pixel on its own in a fixed order, so their results do not
+// depend on the thread count. Bit-identical results across builds also need the same
+// floating-point code: no -ffast-math (refused below) and no contraction into fused
+// multiply-adds, i.e. -ffp-contract=off for GCC with -std=gnu++* (the -std=c++* modes
+// already imply it) and for Clang (also switched off below). The renderers stay
+// reproducible only without IndirectSource caches filled during the frame
+// (IrradianceCache), whose contents depend on the order the threads reach the cells.
+
+#include "draw_primitives.hpp"
+#include "image.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef LSYSTEM_DETERMINISTIC
+
+#ifdef __FAST_MATH__
+#error "LSYSTEM_DETERMINISTIC cannot be combined with -ffast-math"
+#endif
+
+#ifdef __clang__
+#pragma clang fp contract(off)
+#endif
+
+constexpr bool deterministic_build = true;
+
+#else
+
+constexpr bool deterministic_build = false;
+
+#endif // LSYSTEM_DETERMINISTIC
+
+/// 64-bit FNV-1a over raw bytes, continuing from "hash".
+inline std::uint64_t hash_bytes(void const* data, std::size_t const size, std::uint64_t hash = 14695981039346656037ULL) {
+
+    unsigned char const* bytes = static_cast<unsigned char const*>( data );
+    for ( std::size_t i = 0; i < size; ++i )
+    {
+        hash = ( hash ^ bytes[i] ) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/// Hash of the exact bits of generated geometry (field by field, so padding does not matter).
+inline std::uint64_t hash_geometry(std::vector<Branch> const& branches, std::vector<Leaf> const& leaves) {
+
+    std::uint64_t hash = hash_bytes( nullptr, 0U );
+
+    for ( Branch const& branch : branches )
+    {
+        hash = hash_bytes( &branch.p1, sizeof(branch.p1), hash );
+        hash = hash_bytes( &branch.r1, sizeof(branch.r1), hash );
+        hash = hash_bytes( &branch.p2, sizeof(branch.p2), hash );
+        hash = hash_bytes( &branch.r2, sizeof(branch.r2), hash );
+    }
+
+    // the counts separate the branches from the leaves
+    std::uint64_t counts[2] = { branches.size(), leaves.size() };
+    hash = hash_bytes( counts, sizeof(counts), hash );
+
+    for ( Leaf const& leaf : leaves )
+    {
+        hash = hash_bytes( &leaf.position, sizeof(leaf.position), hash );
+        hash = hash_bytes( &leaf.direction, sizeof(leaf.direction), hash );
+        hash = hash_bytes( &leaf.up, sizeof(leaf.up), hash );
+        hash = hash_bytes( &leaf.size, sizeof(leaf.size), hash );
+    }
+
+    return hash;
+}
+
+/// Hash of the exact bits of an image.
+inline std::uint64_t hash_image(Image const& image) {
+
+    int size[2] = { image.width, image.height };
+    std::uint64_t hash = hash_bytes( size, sizeof(size) );
+
+    for ( glm::vec3 const& pixel : image.pixels )
+    {
+        hash = hash_bytes( &pixel.x, sizeof(float), hash );
+        hash = hash_bytes( &pixel.y, sizeof(float), hash );
+        hash = hash_bytes( &pixel.z, sizeof(float), hash );
+    }
+
+    return hash;
+}
+
+/// Runs "task(threads)" (returning a hash of its output) for every thread count and tells
+/// whether all hashes agree; they are stored into "hashes" when passed.
+template <typename Task>
+bool same_across_threads(std::vector<unsigned int> const& thread_counts, Task&& task, std::vector<std::uint64_t>* hashes = nullptr) {
+
+    std::vector<std::uint64_t> results;
+    for ( unsigned int threads : thread_counts )
+    {
+        results.push_back( task( threads ) );
+    }
+
+    bool same = true;
+    for ( std::uint64_t h : results )
+    {
+        same = same && h == results.front();
+    }
+
+    if ( hashes != nullptr )
+        *hashes = results;
+
+    return same;
+}
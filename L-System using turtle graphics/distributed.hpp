@@ -0,0 +1,686 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+// Distributed rendering: a coordinator splits the image into tiles and sends them
+// to worker processes over TCP on the loopback interface (or any reachable host).
+// Every worker first receives the whole job (records, BVH, light, colors, camera and
+// settings), then renders tiles with render_pixel() and sends the pixels back.
+// Textures are not sent, workers shade with the colors of the scene.
+//
+// Messages are framed as { uint32 type, uint32 size, size bytes }.
+
+#ifdef _WIN32
+using socket_handle = SOCKET;
+constexpr socket_handle invalid_socket = INVALID_SOCKET;
+#else
+using socket_handle = int;
+constexpr socket_handle invalid_socket = -1;
+#endif
+
+enum class MessageType : std::uint32_t {
+    Job = 1,        // coordinator -> worker: the scene to render
+    Tile = 2,       // coordinator -> worker: { id, x, y, width, height }
+    Result = 3,     // worker -> coordinator: { id, width * height rgb floats }
+    Done = 4,       // coordinator -> worker: no more tiles
+};
+
+/// Starts (and stops) the socket library where it needs it.
+struct SocketLibrary {
+
+    SocketLibrary() {
+#ifdef _WIN32
+        WSADATA data;
+        WSAStartup( MAKEWORD(2, 2), &data );
+#endif
+    }
+
+    ~SocketLibrary() {
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+};
+
+inline void close_socket(socket_handle const s) {
+
+#ifdef _WIN32
+    closesocket( s );
+#else
+    close( s );
+#endif
+}
+
+/// Sends one message, false when the connection is gone.
+inline bool send_message(socket_handle const s, MessageType const type, std::vector<char> const& payload) {
+
+    std::uint32_t header[2] = { static_cast<std::uint32_t>( type ), static_cast<std::uint32_t>( payload.size() ) };
+
+    auto sendAll = [&](char const* data, std::size_t size) {
+        while ( size > 0U )
+        {
+#ifdef MSG_NOSIGNAL
+            // a killed peer must not kill us with SIGPIPE
+            long sent = static_cast<long>( send( s, data, size, MSG_NOSIGNAL ) );
+#else
+            long sent = static_cast<long>( send( s, data, static_cast<int>( size ), 0 ) );
+#endif
+            if ( sent <= 0 )
+                return false;
+
+            data += sent;
+            size -= static_cast<std::size_t>( sent );
+        }
+        return true;
+    };
+
+    return sendAll( reinterpret_cast<char const*>( header ), sizeof(header) ) && sendAll( payload.data(), payload.size() );
+}
+
+/// Receives one message (blocking), false when the connection is gone.
+inline bool receive_message(socket_handle const s, MessageType& type, std::vector<char>& payload) {
+
+    auto receiveAll = [&](char* data, std::size_t size) {
+        while ( size > 0U )
+        {
+            long received = static_cast<long>( recv( s, data, static_cast<int>( size ), 0 ) );
+            if ( received <= 0 )
+                return false;
+
+            data += received;
+            size -= static_cast<std::size_t>( received );
+        }
+        return true;
+    };
+
+    std::uint32_t header[2];
+    if ( !receiveAll( reinterpret_cast<char*>( header ), sizeof(header) ) )
+        return false;
+
+    type = static_cast<MessageType>( header[0] );
+    payload.resize( header[1] );
+
+    return receiveAll( payload.data(), payload.size() );
+}
+
+/// Appends plain values to a byte buffer.
+struct ByteWriter {
+    std::vector<char> bytes;
+
+    template <typename T>
+    void put(T const& value) {
+
+        put_bytes( &value, sizeof(T) );
+    }
+
+    void put_bytes(void const* data, std::size_t const size) {
+
+        char const* begin = static_cast<char const*>( data );
+        bytes.insert( bytes.end(), begin, begin + size );
+    }
+};
+
+/// Reads plain values back, every read fails once the buffer is exhausted.
+struct ByteReader {
+    std::vector<char> const& bytes;
+    std::size_t offset = 0U;
+
+    explicit ByteReader(std::vector<char> const& bytes_) : bytes(bytes_) {}
+
+    template <typename T>
+    bool get(T& value) {
+
+        return get_bytes( &value, sizeof(T) );
+    }
+
+    bool get_bytes(void* data, std::size_t const size) {
+
+        if ( bytes.size() - offset < size )
+            return false;
+
+        std::memcpy( data, bytes.data() + offset, size );
+        offset += size;
+        return true;
+    }
+};
+
+/// What a worker needs to render tiles.
+struct RenderJob {
+    Scene scene;
+    Camera camera;
+    RenderSettings settings;
+    int width = 0;
+    int height = 0;
+};
+
+inline std::vector<char> serialize_job(Scene const& scene, Camera const& camera, RenderSettings const& settings,
+                                       int const width, int const height) {
+
+    ByteWriter out;
+
+    out.put( static_cast<std::uint64_t>( scene.records.branches.size() ) );
+    for ( std::size_t i = 0; i < scene.records.branches.size(); ++i )
+    {
+        out.put( scene.records.branches[i] );
+        out.put( scene.records.branches.ao[i] );
+    }
+
+    out.put( static_cast<std::uint64_t>( scene.records.leaves.size() ) );
+    for ( std::size_t i = 0; i < scene.records.leaves.size(); ++i )
+    {
+        out.put( scene.records.leaves[i] );
+        out.put( scene.records.leaves.ao[i] );
+    }
+
+    out.put( static_cast<std::uint64_t>( scene.bvh.nodes.size() ) );
+    out.put_bytes( scene.bvh.nodes.data(), scene.bvh.nodes.size() * sizeof(BVH::Node) );
+    out.put( static_cast<std::uint64_t>( scene.bvh.primitives.size() ) );
+    out.put_bytes( scene.bvh.primitives.data(), scene.bvh.primitives.size() * sizeof(std::uint32_t) );
+
+    out.put( scene.light );
+    out.put( scene.branch_color );
+    out.put( scene.leaf_color );
+    out.put( scene.ground_color );
+    out.put( scene.sky_color );
+
+    out.put( camera );
+    out.put( settings );
+    out.put( width );
+    out.put( height );
+
+    return out.bytes;
+}
+
+inline bool deserialize_job(std::vector<char> const& bytes, RenderJob& job) {
+
+    ByteReader in( bytes );
+    std::uint64_t count;
+
+    if ( !in.get( count ) )
+        return false;
+    job.scene.records.branches.resize( static_cast<std::size_t>( count ) );
+    for ( std::size_t i = 0; i < count; ++i )
+    {
+        BranchRecord record;
+        if ( !in.get( record ) || !in.get( job.scene.records.branches.ao[i] ) )
+            return false;
+        job.scene.records.branches.set( i, record );
+    }
+
+    if ( !in.get( count ) )
+        return false;
+    job.scene.records.leaves.resize( static_cast<std::size_t>( count ) );
+    for ( std::size_t i = 0; i < count; ++i )
+    {
+        LeafRecord record;
+        if ( !in.get( record ) || !in.get( job.scene.records.leaves.ao[i] ) )
+            return false;
+        job.scene.records.leaves.set( i, record );
+    }
+
+    if ( !in.get( count ) )
+        return false;
+    job.scene.bvh.nodes.resize( static_cast<std::size_t>( count ) );
+    if ( !in.get_bytes( job.scene.bvh.nodes.data(), job.scene.bvh.nodes.size() * sizeof(BVH::Node) ) )
+        return false;
+
+    if ( !in.get( count ) )
+        return false;
+    job.scene.bvh.primitives.resize( static_cast<std::size_t>( count ) );
+    if ( !in.get_bytes( job.scene.bvh.primitives.data(), job.scene.bvh.primitives.size() * sizeof(std::uint32_t) ) )
+        return false;
+
+    return in.get( job.scene.light ) && in.get( job.scene.branch_color ) && in.get( job.scene.leaf_color )
+        && in.get( job.scene.ground_color ) && in.get( job.scene.sky_color )
+        && in.get( job.camera ) && in.get( job.settings ) && in.get( job.width ) && in.get( job.height );
+}
+
+/// A rectangle of the image.
+struct Tile {
+    std::uint32_t id;
+    std::int32_t x, y, width, height;
+};
+
+/// Runs a worker: connects to the coordinator, renders the tiles it is sent and
+/// returns when the coordinator is done (0) or the connection fails (1).
+/// "connect_timeout_ms" > 0 keeps trying to connect that long (for workers started
+/// before the coordinator listens).
+inline int run_worker(std::string const& host, std::uint16_t const port, int const connect_timeout_ms = 0) {
+
+    using Clock = std::chrono::steady_clock;
+
+    SocketLibrary library;
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons( port );
+    inet_pton( AF_INET, host.c_str(), &address.sin_addr );
+
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds( connect_timeout_ms );
+    socket_handle s = invalid_socket;
+
+    while ( true )
+    {
+        s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+        if ( s == invalid_socket )
+            return 1;
+
+        if ( connect( s, reinterpret_cast<sockaddr*>( &address ), sizeof(address) ) == 0 )
+            break;
+
+        close_socket( s );
+        if ( Clock::now() >= deadline )
+            return 1;
+
+        std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );
+    }
+
+    // the header and the pixels of a result go out in two sends, Nagle would hold the second
+    int noDelay = 1;
+    setsockopt( s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>( &noDelay ), sizeof(noDelay) );
+
+    RenderJob job;
+    MessageType type;
+    std::vector<char> payload;
+
+    if ( !receive_message( s, type, payload ) || type != MessageType::Job || !deserialize_job( payload, job ) )
+    {
+        close_socket( s );
+        return 1;
+    }
+
+    std::vector<glm::vec3> pixels;
+
+    while ( receive_message( s, type, payload ) )
+    {
+        if ( type == MessageType::Done )
+        {
+            close_socket( s );
+            return 0;
+        }
+
+        Tile tile;
+        ByteReader in( payload );
+        if ( type != MessageType::Tile || !in.get( tile ) )
+            break;
+
+        pixels.resize( static_cast<std::size_t>( tile.width ) * tile.height );
+        parallel_for( static_cast<std::size_t>( tile.height ), job.settings.threads, [&](std::size_t const row) {
+            for ( int x = 0; x < tile.width; ++x )
+            {
+                pixels[row * tile.width + x] = render_pixel( job.scene, job.camera, tile.x + x, tile.y + static_cast<int>( row ),
+                                                             job.width, job.height, job.settings );
+            }
+        } );
+
+        ByteWriter out;
+        out.put( tile.id );
+        out.put_bytes( pixels.data(), pixels.size() * sizeof(glm::vec3) );
+
+        if ( !send_message( s, MessageType::Result, out.bytes ) )
+            break;
+    }
+
+    close_socket( s );
+    return 1;
+}
+
+/// Settings of the coordinator.
+struct DistributedSettings {
+    int workers = 4;                        // connections to wait for
+    int tile_size = 64;
+    int tiles_in_flight = 2;                // per worker, hides the round trip
+    std::uint16_t port = 0U;                // 0 -> any free port
+    int connect_timeout_ms = 10000;         // waiting for the workers to connect
+    int tile_timeout_ms = 60000;            // a worker silent this long with tiles in flight is dropped
+    std::string worker_executable;          // started "workers" times with "127.0.0.1 <port>" (empty -> started by the caller)
+    RenderSettings render;                  // sent to the workers (threads per worker, 0 -> all hardware
+                                            // threads, shared by the workers started from worker_executable)
+};
+
+/// Renders the image on worker processes. Tiles are dealt to the workers in contiguous
+/// runs; a worker that runs out steals from the far end of the longest remaining run.
+/// When a worker disconnects (or stays silent too long) its tiles in flight go back to
+/// the queues of the others; tiles left without any worker are rendered here.
+/// Returns the number of workers that took part.
+inline int render_distributed(Scene const& scene, Camera const& camera, Image& image,
+                              DistributedSettings const& settings = DistributedSettings()) {
+
+    using Clock = std::chrono::steady_clock;
+
+    SocketLibrary library;
+
+    // tiles in row major order
+    std::vector<Tile> tiles;
+    for ( int y = 0; y < image.height; y += settings.tile_size )
+    {
+        for ( int x = 0; x < image.width; x += settings.tile_size )
+        {
+            Tile tile;
+            tile.id = static_cast<std::uint32_t>( tiles.size() );
+            tile.x = x;
+            tile.y = y;
+            tile.width = std::min( settings.tile_size, image.width - x );
+            tile.height = std::min( settings.tile_size, image.height - y );
+            tiles.push_back( tile );
+        }
+    }
+
+    std::vector<bool> finished( tiles.size(), false );
+    std::size_t remaining = tiles.size();
+
+    auto renderLocally = [&]() {
+        parallel_for( tiles.size(), settings.render.threads, [&](std::size_t const t) {
+            if ( finished[t] )
+                return;
+
+            Tile const& tile = tiles[t];
+            for ( int y = tile.y; y < tile.y + tile.height; ++y )
+            {
+                for ( int x = tile.x; x < tile.x + tile.width; ++x )
+                {
+                    image.at( x, y ) = render_pixel( scene, camera, x, y, image.width, image.height, settings.render );
+                }
+            }
+        } );
+    };
+
+    // listen on the loopback interface
+    socket_handle listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons( settings.port );
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t addressLength = sizeof(address);
+
+    if ( listener == invalid_socket
+      || bind( listener, reinterpret_cast<sockaddr*>( &address ), sizeof(address) ) != 0
+      || listen( listener, settings.workers ) != 0
+      || getsockname( listener, reinterpret_cast<sockaddr*>( &address ), &addressLength ) != 0 )
+    {
+        if ( listener != invalid_socket )
+            close_socket( listener );
+        renderLocally();
+        return 0;
+    }
+
+    std::string port = std::to_string( ntohs( address.sin_port ) );
+
+    // start the local workers
+#ifdef _WIN32
+    std::vector<PROCESS_INFORMATION> processes;
+#else
+    std::vector<pid_t> processes;
+#endif
+
+    for ( int w = 0; w < settings.workers && !settings.worker_executable.empty(); ++w )
+    {
+#ifdef _WIN32
+        std::string command = "\"" + settings.worker_executable + "\" 127.0.0.1 " + port;
+        STARTUPINFOA startup{};
+        startup.cb = sizeof(startup);
+        PROCESS_INFORMATION process{};
+        if ( CreateProcessA( nullptr, &command[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &process ) )
+            processes.push_back( process );
+#else
+        pid_t pid = fork();
+        if ( pid == 0 )
+        {
+            execl( settings.worker_executable.c_str(), settings.worker_executable.c_str(), "127.0.0.1", port.c_str(), static_cast<char*>( nullptr ) );
+            _exit( 127 );
+        }
+        if ( pid > 0 )
+            processes.push_back( pid );
+#endif
+    }
+
+    // wait for the connections
+    struct Worker {
+        socket_handle socket;
+        std::deque<std::uint32_t> queue;        // tiles dealt to this worker
+        std::vector<std::uint32_t> in_flight;
+        Clock::time_point last_message;
+        bool alive;
+    };
+
+    std::vector<Worker> workers;
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds( settings.connect_timeout_ms );
+
+    while ( static_cast<int>( workers.size() ) < settings.workers && Clock::now() < deadline )
+    {
+        fd_set readable;
+        FD_ZERO( &readable );
+        FD_SET( listener, &readable );
+
+        long left = static_cast<long>( std::chrono::duration_cast<std::chrono::milliseconds>( deadline - Clock::now() ).count() );
+        timeval timeout{ left / 1000, ( left % 1000 ) * 1000 };
+
+        if ( select( static_cast<int>( listener ) + 1, &readable, nullptr, nullptr, &timeout ) <= 0 )
+            break;
+
+        socket_handle s = accept( listener, nullptr, nullptr );
+        if ( s == invalid_socket )
+            continue;
+
+        int noDelay = 1;
+        setsockopt( s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>( &noDelay ), sizeof(noDelay) );
+        workers.push_back( Worker{ s, {}, {}, Clock::now(), true } );
+    }
+    close_socket( listener );
+
+    // workers started here share this machine
+    RenderSettings workerSettings = settings.render;
+    if ( !processes.empty() && workerSettings.threads == 0U )
+        workerSettings.threads = std::max( thread_count() / static_cast<unsigned int>( processes.size() ), 1U );
+
+    // send the job, deal the tiles in contiguous runs (neighbouring tiles share geometry)
+    std::vector<char> job = serialize_job( scene, camera, workerSettings, image.width, image.height );
+    for ( Worker& worker : workers )
+    {
+        worker.alive = send_message( worker.socket, MessageType::Job, job );
+    }
+
+    std::size_t liveCount = static_cast<std::size_t>( std::count_if( workers.begin(), workers.end(), [](Worker const& w) { return w.alive; } ) );
+    for ( std::size_t t = 0, w = 0; t < tiles.size() && liveCount > 0U; ++t )
+    {
+        // skip the workers that are already gone
+        std::size_t target = t * liveCount / tiles.size();
+        for ( w = 0; w < workers.size(); ++w )
+        {
+            if ( workers[w].alive && target-- == 0U )
+                break;
+        }
+        workers[w].queue.push_back( static_cast<std::uint32_t>( t ) );
+    }
+
+    // next tile for a worker: its own run first, then the far end of the longest run
+    auto nextTile = [&](Worker& worker, std::uint32_t& tile) {
+        if ( !worker.queue.empty() )
+        {
+            tile = worker.queue.front();
+            worker.queue.pop_front();
+            return true;
+        }
+
+        Worker* victim = nullptr;
+        for ( Worker& other : workers )
+        {
+            if ( !other.queue.empty() && ( victim == nullptr || other.queue.size() > victim->queue.size() ) )
+                victim = &other;
+        }
+        if ( victim == nullptr )
+            return false;
+
+        tile = victim->queue.back();
+        victim->queue.pop_back();
+        return true;
+    };
+
+    auto drop = [&](Worker& worker) {
+        close_socket( worker.socket );
+        worker.alive = false;
+
+        // tiles in flight go back to be stolen by the others
+        for ( std::uint32_t t : worker.in_flight )
+        {
+            worker.queue.push_front( t );
+        }
+        worker.in_flight.clear();
+    };
+
+    auto feed = [&](Worker& worker) {
+        std::uint32_t t;
+        while ( worker.alive && static_cast<int>( worker.in_flight.size() ) < settings.tiles_in_flight && nextTile( worker, t ) )
+        {
+            ByteWriter out;
+            out.put( tiles[t] );
+            worker.in_flight.push_back( t );
+
+            if ( !send_message( worker.socket, MessageType::Tile, out.bytes ) )
+                drop( worker );
+        }
+        worker.last_message = Clock::now();
+    };
+
+    for ( Worker& worker : workers )
+    {
+        feed( worker );
+    }
+
+    std::vector<char> payload;
+    while ( remaining > 0U )
+    {
+        fd_set readable;
+        FD_ZERO( &readable );
+        socket_handle highest = 0;
+        bool anyAlive = false;
+
+        for ( Worker const& worker : workers )
+        {
+            if ( !worker.alive )
+                continue;
+
+            FD_SET( worker.socket, &readable );
+            highest = std::max( highest, worker.socket );
+            anyAlive = true;
+        }
+
+        if ( !anyAlive )
+            break;
+
+        timeval timeout{ 1, 0 };
+        select( static_cast<int>( highest ) + 1, &readable, nullptr, nullptr, &timeout );
+
+        for ( Worker& worker : workers )
+        {
+            if ( !worker.alive )
+                continue;
+
+            if ( !FD_ISSET( worker.socket, &readable ) )
+            {
+                // silent for too long with work -> treat as dead
+                if ( !worker.in_flight.empty() && Clock::now() - worker.last_message > std::chrono::milliseconds( settings.tile_timeout_ms ) )
+                    drop( worker );
+                continue;
+            }
+
+            MessageType type;
+            std::uint32_t id;
+            ByteReader in( payload );
+
+            if ( !receive_message( worker.socket, type, payload ) || type != MessageType::Result || !in.get( id ) || id >= tiles.size() )
+            {
+                drop( worker );
+                continue;
+            }
+
+            Tile const& tile = tiles[id];
+            worker.in_flight.erase( std::remove( worker.in_flight.begin(), worker.in_flight.end(), id ), worker.in_flight.end() );
+
+            // a tile may arrive twice after a timeout -> keep the first
+            if ( !finished[id] && payload.size() == sizeof(id) + static_cast<std::size_t>( tile.width ) * tile.height * sizeof(glm::vec3) )
+            {
+                for ( int y = 0; y < tile.height; ++y )
+                {
+                    for ( int x = 0; x < tile.width; ++x )
+                    {
+                        glm::vec3 color;
+                        in.get( color );
+                        image.at( tile.x + x, tile.y + y ) = color;
+                    }
+                }
+
+                finished[id] = true;
+                --remaining;
+            }
+
+            feed( worker );
+        }
+
+        // idle workers pick up the tiles of dropped ones
+        for ( Worker& worker : workers )
+        {
+            if ( worker.alive && worker.in_flight.empty() )
+                feed( worker );
+        }
+    }
+
+    // whatever no worker finished
+    if ( remaining > 0U )
+        renderLocally();
+
+    int participants = static_cast<int>( workers.size() );
+    for ( Worker& worker : workers )
+    {
+        if ( !worker.alive )
+            continue;
+
+        send_message( worker.socket, MessageType::Done, std::vector<char>() );
+        close_socket( worker.socket );
+    }
+
+#ifdef _WIN32
+    for ( PROCESS_INFORMATION& process : processes )
+    {
+        WaitForSingleObject( process.hProcess, INFINITE );
+        CloseHandle( process.hProcess );
+        CloseHandle( process.hThread );
+    }
+#else
+    for ( pid_t pid : processes )
+    {
+        waitpid( pid, nullptr, 0 );
+    }
+#endif
+
+    return participants;
+}
@@ -0,0 +1,180 @@
+// Checks render_distributed() against render() with worker processes on this machine:
+//
+//   distributed_check <worker executable> [--workers <n>]
+//
+// The first frame is rendered by workers the coordinator starts from the executable
+// (distributed_worker.cpp). For the second one the check starts the workers itself and
+// kills one of them while the frame is in progress (not on Windows); the other workers
+// and the coordinator have to finish its tiles. Both frames have to match render()
+// pixel for pixel. The exit code is 1 when they do not, 0 otherwise. Build both
+// programs with the same flags, e.g.
+//   g++ -O2 -std=c++17 distributed_worker.cpp -o distributed_worker -pthread
+//   g++ -O2 -std=c++17 distributed_check.cpp -o distributed_check -pthread
+
+#include "distributed.hpp"
+#include "l_system.hpp"
+#include "ray_tracing.hpp"
+#include "parallel.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+/// Largest difference of a color channel between the images.
+static float max_difference(Image const& a, Image const& b) {
+
+    float difference = 0.0f;
+    for ( std::size_t i = 0; i < a.pixels.size(); ++i )
+    {
+        glm::vec3 d = glm::abs( a.pixels[i] - b.pixels[i] );
+        difference = std::max( difference, std::max( d.x, std::max( d.y, d.z ) ) );
+    }
+
+    return difference;
+}
+
+#ifndef _WIN32
+/// A free port on the loopback interface (the workers started here need to know it up front).
+static std::uint16_t free_port() {
+
+    socket_handle s = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    socklen_t length = sizeof(address);
+
+    std::uint16_t port = 0U;
+    if ( bind( s, reinterpret_cast<sockaddr*>( &address ), sizeof(address) ) == 0
+      && getsockname( s, reinterpret_cast<sockaddr*>( &address ), &length ) == 0 )
+        port = ntohs( address.sin_port );
+
+    close_socket( s );
+    return port;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+
+    using Clock = std::chrono::steady_clock;
+
+    std::string workerExecutable;
+    int workerCount = 4;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+        std::string arg = argv[i];
+
+        if ( arg == "--workers" && i + 1 < argc )
+            workerCount = std::max( std::atoi( argv[++i] ), 2 );
+        else if ( workerExecutable.empty() && arg.compare( 0, 2, "--" ) != 0 )
+            workerExecutable = arg;
+        else
+        {
+            workerExecutable.clear();
+            break;
+        }
+    }
+
+    if ( workerExecutable.empty() )
+    {
+        std::cerr << "usage: " << argv[0] << " <worker executable> [--workers <n>]\n";
+        return 2;
+    }
+
+    // the test tree of perf_gate, rendered with soft shadows so a frame takes a while
+    LTurtle::Config config{ 0.1f, 1.0f, 0.3f, glm::radians( 35.0f ), glm::radians( 25.0f ), 0.75f, 6U };
+    LTurtle::Rules rules = { { 'X', "B[&+*X][&-*X][^*X]*L" } };
+
+    std::vector<Branch> branches;
+    std::vector<Leaf> leaves;
+    LTurtle turtle( config, rules, branches, leaves );
+    turtle.run( "BBX" );
+
+    Scene scene;
+    scene.build( branches, leaves );
+    scene.light.angular_radius = 0.05f;
+
+    Camera camera;
+    camera.position = glm::vec3(0.0f, 4.0f, 12.0f);
+    camera.target = glm::vec3(0.0f, 3.0f, 0.0f);
+
+    DistributedSettings settings;
+    settings.workers = workerCount;
+    settings.tile_size = 16;
+    settings.render.samples = 8;
+
+    Image reference( 480, 360 );
+    Clock::time_point begin = Clock::now();
+    render( scene, camera, reference, settings.render );
+    double referenceSeconds = std::chrono::duration<double>( Clock::now() - begin ).count();
+
+    // workers started by the coordinator
+    settings.worker_executable = workerExecutable;
+    Image spawned( reference.width, reference.height );
+    int participants = render_distributed( scene, camera, spawned, settings );
+    float spawnedDifference = max_difference( spawned, reference );
+
+    std::cout << "render():            " << referenceSeconds * 1e3 << " ms\n"
+              << "started workers:     " << participants << " of " << workerCount << " took part, largest difference "
+              << spawnedDifference << '\n';
+
+    bool passed = participants == workerCount && spawnedDifference == 0.0f;
+
+#ifndef _WIN32
+    // workers started here, one of them killed a third of the way into the frame
+    settings.worker_executable.clear();
+    settings.port = free_port();
+    settings.render.threads = std::max( thread_count() / static_cast<unsigned int>( workerCount ), 1U );
+
+    std::vector<pid_t> pids;
+    for ( int w = 0; w < workerCount; ++w )
+    {
+        pid_t pid = fork();
+        if ( pid == 0 )
+            _exit( run_worker( "127.0.0.1", settings.port, settings.connect_timeout_ms ) );
+        if ( pid > 0 )
+            pids.push_back( pid );
+    }
+
+    std::atomic<bool> frameDone( false );
+    std::atomic<bool> killedInFrame( false );
+    std::thread killer( [&]() {
+        std::this_thread::sleep_for( std::chrono::duration<double>( referenceSeconds / 3.0 ) );
+        killedInFrame = !frameDone;
+        kill( pids[0], SIGKILL );
+    } );
+
+    Image survived( reference.width, reference.height );
+    participants = render_distributed( scene, camera, survived, settings );
+    frameDone = true;
+    killer.join();
+
+    // the victim has to die by the signal, not leave after the Done message
+    int status = 0;
+    waitpid( pids[0], &status, 0 );
+    killedInFrame = killedInFrame && WIFSIGNALED( status );
+    for ( std::size_t w = 1; w < pids.size(); ++w )
+    {
+        waitpid( pids[w], nullptr, 0 );
+    }
+
+    float survivedDifference = max_difference( survived, reference );
+    std::cout << "killed one worker:   " << ( killedInFrame ? "during" : "AFTER" ) << " the frame, " << participants
+              << " of " << workerCount << " took part, largest difference " << survivedDifference << '\n';
+
+    // a kill after the frame proves nothing, the frame needs to take longer
+    passed = passed && killedInFrame && survivedDifference == 0.0f;
+#endif
+
+    std::cout << ( passed ? "passed" : "FAILED" ) << '\n';
+    return passed ? 0 : 1;
+}
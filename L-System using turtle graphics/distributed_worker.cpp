@@ -0,0 +1,16 @@
+// A worker process of render_distributed() (see distributed.hpp).
+// Usage: distributed_worker <coordinator address> <port>
+
+#include "distributed.hpp"
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+
+    if ( argc < 3 )
+    {
+        std::cerr << "usage: " << argv[0] << " <coordinator address> <port>" << std::endl;
+        return 2;
+    }
+
+    return run_worker( argv[1], static_cast<std::uint16_t>( std::atoi( argv[2] ) ) );
+}
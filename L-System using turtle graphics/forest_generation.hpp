@@ -0,0 +1,93 @@
+#pragma once
+
+#include "l_system.hpp"
+#include "spatial_hash.hpp"
+#include "parallel.hpp"
+#include "determinism.hpp"
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/// One tree to grow: its L-system and where it stands.
+struct TreeSpec {
+    LTurtle::Config config;
+    LTurtle::Rules rules;
+    std::string axiom;
+    glm::vec3 position = glm::vec3(0.0f);
+};
+
+/// The geometry of all trees, tree after tree; tree i owns the branches
+/// [branch_offsets[i], branch_offsets[i + 1]) and likewise for the leaves.
+struct GeneratedForest {
+    std::vector<Branch> branches;
+    std::vector<Leaf> leaves;
+    std::vector<std::size_t> branch_offsets;
+    std::vector<std::size_t> leaf_offsets;
+};
+
+/// Grows the trees in parallel. With an environment the trees compete for space:
+/// each one is its own owner in the hash (index into "trees"), so branches growing
+/// into a neighbour or an obstacle (SpatialHash::insert_box) are pruned. Which of two
+/// trees claims a contested cell first depends on the thread timing, unless "deterministic"
+/// is set: then the trees grow in two parallel passes, still on "threads" threads. The
+/// first grows every tree as if alone among the obstacles and claims its space in a second
+/// hash, where the lowest tree index wins a contested cell; the second grows them again,
+/// each one yielding to the space claimed by the trees before it. The environment is only
+/// read during the passes and gets the final branches afterwards (again the lowest index
+/// wins), so the forest and the hash are the same for any thread count. A tree may yield to
+/// space a tree before it claimed in the first pass and lost in the second.
+/// Without an environment the trees are independent and always deterministic.
+inline GeneratedForest generate_forest(std::vector<TreeSpec> const& trees, SpatialHash* environment = nullptr,
+                                       unsigned int const threads = 0U, bool const deterministic = deterministic_build) {
+
+    std::vector<std::vector<Branch>> branches( trees.size() );
+    std::vector<std::vector<Leaf>> leaves( trees.size() );
+
+    auto grow = [&](LTurtle::Growth const growth, SpatialHash* claims) {
+        parallel_for( trees.size(), threads, [&](std::size_t const i) {
+            TreeSpec const& spec = trees[i];
+
+            branches[i].clear();
+            leaves[i].clear();
+
+            LTurtle turtle( spec.config, spec.rules, branches[i], leaves[i] );
+            turtle.set_position( spec.position );
+            turtle.set_environment( environment, static_cast<std::uint32_t>( i ), growth, claims );
+            turtle.run( spec.axiom );
+        } );
+    };
+
+    if ( environment != nullptr && deterministic )
+    {
+        SpatialHash claims( environment->hash_settings() );
+        grow( LTurtle::Growth::Claim, &claims );
+        grow( LTurtle::Growth::Yield, &claims );
+
+        // the branches of a tree are exactly the segments it tested against the hashes
+        parallel_for( trees.size(), threads, [&](std::size_t const i) {
+            for ( Branch const& branch : branches[i] )
+            {
+                environment->claim_segment( branch.p1, branch.p2, static_cast<std::uint32_t>( i ) );
+            }
+        } );
+    }
+    else
+    {
+        grow( LTurtle::Growth::Insert, nullptr );
+    }
+
+    // merge in tree order
+    GeneratedForest forest;
+    forest.branch_offsets.push_back( 0U );
+    forest.leaf_offsets.push_back( 0U );
+
+    for ( std::size_t i = 0; i < trees.size(); ++i )
+    {
+        forest.branches.insert( forest.branches.end(), branches[i].begin(), branches[i].end() );
+        forest.leaves.insert( forest.leaves.end(), leaves[i].begin(), leaves[i].end() );
+        forest.branch_offsets.push_back( forest.branches.size() );
+        forest.leaf_offsets.push_back( forest.leaves.size() );
+    }
+
+    return forest;
+}
@@ -0,0 +1,537 @@
+#pragma once
+
+#include "l_system.hpp"
+#include "symbols.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// An L-system loaded from a grammar file, ready for LTurtle( grammar.config, grammar.symbols, grammar.rules, ... ).
+struct Grammar {
+    std::string name;
+    LTurtle::Config config{ 0.1f, 1.0f, 0.3f, glm::radians( 35.0f ), glm::radians( 25.0f ), 0.75f, 6U };
+    SymbolTable symbols;
+    SymbolRules rules;
+    std::vector<Symbol> axiom;
+};
+
+// Text grammars, one statement per line; empty lines and lines starting with '#' are skipped:
+//
+//   name = oak
+//   axiom = BBX
+//   radius = 0.1                   config constants: radius, distance, leaf_size, angle_world_y,
+//   angle_world_y = 35             angle_turtle_left (degrees), brush_decay_coef, max_depth,
+//   tropism = 0 -1 0               tropism (x y z), susceptibility, seed
+//   {Internode} = B                the named token acts as the turtle command B
+//   X -> B[&+*X][&-*X]*{Internode}L
+//   X (0.25) -> B[^*X]*L           stochastic alternative of weight 0.25 (default 1)
+//
+// Spaces inside axioms and bodies are ignored, "{name}" is a named symbol.
+
+namespace grammar_detail {
+
+    inline std::string_view trim(std::string_view text) {
+
+        while ( !text.empty() && ( text.front() == ' ' || text.front() == '\t' || text.front() == '\r' ) )
+        {
+            text.remove_prefix( 1U );
+        }
+        while ( !text.empty() && ( text.back() == ' ' || text.back() == '\t' || text.back() == '\r' ) )
+        {
+            text.remove_suffix( 1U );
+        }
+        return text;
+    }
+
+    /// Parses the numbers of "text" separated by spaces, false unless exactly "count" of them.
+    template <typename T>
+    bool parse_numbers(std::string_view text, T* values, std::size_t const count) {
+
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            text = trim( text );
+            std::from_chars_result result = std::from_chars( text.data(), text.data() + text.size(), values[i] );
+            if ( result.ec != std::errc() )
+                return false;
+            text.remove_prefix( static_cast<std::size_t>( result.ptr - text.data() ) );
+        }
+
+        return trim( text ).empty();
+    }
+
+    /// Sets the config constant "key", false for an unknown key or a bad value.
+    inline bool parse_constant(std::string_view const key, std::string_view const value, LTurtle::Config& config) {
+
+        float number = 0.0f;
+
+        if ( key == "max_depth" )
+            return parse_numbers( value, &config.max_depth, 1U );
+        if ( key == "seed" )
+            return parse_numbers( value, &config.seed, 1U );
+        if ( key == "tropism" )
+        {
+            float xyz[3];
+            if ( !parse_numbers( value, xyz, 3U ) )
+                return false;
+            config.tropism = glm::vec3( xyz[0], xyz[1], xyz[2] );
+            return true;
+        }
+
+        if ( !parse_numbers( value, &number, 1U ) )
+            return false;
+
+        if ( key == "radius" )
+            config.radius = number;
+        else if ( key == "distance" )
+            config.distance = number;
+        else if ( key == "leaf_size" )
+            config.leaf_size = number;
+        else if ( key == "angle_world_y" )
+            config.angle_world_y = glm::radians( number );
+        else if ( key == "angle_turtle_left" )
+            config.angle_turtle_left = glm::radians( number );
+        else if ( key == "brush_decay_coef" )
+            config.brush_decay_coef = number;
+        else if ( key == "susceptibility" )
+            config.susceptibility = number;
+        else
+            return false;
+
+        return true;
+    }
+
+} // namespace grammar_detail
+
+/// Parses a text grammar into "grammar" (starting from its current contents, normally a
+/// fresh Grammar). The text is read in place: apart from growing the tables of the grammar
+/// (and interning new named tokens) only a scratch buffer for the symbols of a statement
+/// is allocated. Returns false on the first bad line, whose number (from 1) is stored into
+/// "error_line" when passed.
+inline bool parse_grammar(std::string_view text, Grammar& grammar, std::size_t* error_line = nullptr) {
+
+    using namespace grammar_detail;
+
+    std::vector<Symbol> body;
+    std::size_t line = 0U;
+
+    auto fail = [&]() {
+        if ( error_line != nullptr )
+            *error_line = line;
+        return false;
+    };
+
+    while ( !text.empty() )
+    {
+        ++line;
+        std::size_t end = text.find( '\n' );
+        std::string_view statement = trim( text.substr( 0U, end ) );
+        text.remove_prefix( end == std::string_view::npos ? text.size() : end + 1U );
+
+        if ( statement.empty() || statement[0] == '#' )
+            continue;
+
+        std::size_t arrow = statement.find( "->" );
+        if ( arrow != std::string_view::npos )
+        {
+            // head [(weight)] -> body
+            std::string_view left = trim( statement.substr( 0U, arrow ) );
+            float weight = 1.0f;
+
+            if ( !left.empty() && left.back() == ')' )
+            {
+                std::size_t open = left.rfind( '(' );
+                if ( open == std::string_view::npos || !parse_numbers( left.substr( open + 1U, left.size() - open - 2U ), &weight, 1U ) || !( weight > 0.0f ) )
+                    return fail();
+                left = trim( left.substr( 0U, open ) );
+            }
+
+            body.clear();
+            if ( !grammar.symbols.parse( left, body ) || body.size() != 1U )
+                return fail();
+            Symbol head = body[0];
+
+            body.clear();
+            if ( !grammar.symbols.parse( statement.substr( arrow + 2U ), body ) )
+                return fail();
+
+            grammar.rules.add_alternative( head, body.data(), body.size(), weight );
+            continue;
+        }
+
+        std::size_t equals = statement.find( '=' );
+        if ( equals == std::string_view::npos )
+            return fail();
+
+        std::string_view key = trim( statement.substr( 0U, equals ) );
+        std::string_view value = trim( statement.substr( equals + 1U ) );
+
+        if ( key == "name" )
+        {
+            grammar.name.assign( value.data(), value.size() );
+        }
+        else if ( key == "axiom" )
+        {
+            grammar.axiom.clear();
+            if ( !grammar.symbols.parse( value, grammar.axiom ) )
+                return fail();
+        }
+        else if ( key.size() > 2U && key.front() == '{' && key.back() == '}' )
+        {
+            // binding of a named token to a turtle command
+            Symbol symbol = grammar.symbols.intern( key.substr( 1U, key.size() - 2U ) );
+            if ( symbol == invalid_symbol || value.size() != 1U )
+                return fail();
+            grammar.symbols.bind( symbol, value[0] );
+        }
+        else if ( !parse_constant( key, value, grammar.config ) )
+        {
+            return fail();
+        }
+    }
+
+    return true;
+}
+
+/// Reads a text grammar file. Throws when the file cannot be read, returns false on a bad line (see parse_grammar).
+inline bool read_grammar(std::string const& path, Grammar& grammar, std::size_t* error_line = nullptr) {
+
+    std::ifstream file( path, std::ios::binary );
+    if ( !file )
+        throw std::runtime_error( "cannot open " + path );
+
+    std::ostringstream text;
+    text << file.rdbuf();
+
+    return parse_grammar( text.str(), grammar, error_line );
+}
+
+// Precompiled grammar packs: many grammars in one binary file that is mapped into memory.
+// Opening a pack reads nothing but its directory; a grammar is copied out of the mapping
+// with a few memcpy calls when it is loaded.
+
+/// Header of a grammar pack, followed by grammar_count GrammarPackEntry.
+struct GrammarPackHeader {
+    char magic[8] = { 'L', 'S', 'Y', 'S', 'G', 'R', 'M', '1' };
+    std::uint32_t version = 1U;
+    std::uint32_t grammar_count = 0U;
+};
+
+struct GrammarPackEntry {
+    std::uint64_t offset = 0U;          // of the record in the file (8-byte aligned)
+    std::uint64_t size = 0U;
+};
+
+/// Record of one grammar: this header, then the arrays of SymbolRules (per head: firsts,
+/// counts, totals; per alternative: offsets, lengths, weights; the body symbols), the axiom,
+/// the command of every symbol and the names of the named tokens and of the grammar.
+struct GrammarRecord {
+    float radius;
+    float distance;
+    float leaf_size;
+    float angle_world_y;
+    float angle_turtle_left;
+    float brush_decay_coef;
+    std::uint32_t max_depth;
+    float tropism[3];
+    float susceptibility;
+    std::uint32_t head_count;
+    std::uint64_t seed;
+    std::uint32_t alternative_count;
+    std::uint32_t symbol_count;
+    std::uint32_t axiom_length;
+    std::uint32_t command_count;        // = symbols in the table, the named tokens are [256, command_count)
+    std::uint32_t names_size;           // bytes of the names, each ends with '\0', the grammar's name last
+    std::uint32_t padding = 0U;
+};
+
+/// Writes the grammars as a pack. Throws when the file cannot be written.
+inline void write_grammar_pack(std::string const& path, std::vector<Grammar> const& grammars) {
+
+    std::ofstream file( path, std::ios::binary );
+    if ( !file )
+        throw std::runtime_error( "cannot write " + path );
+
+    auto put = [&](void const* data, std::size_t const size) {
+        file.write( static_cast<char const*>( data ), static_cast<std::streamsize>( size ) );
+    };
+    auto align = [&]() {
+        char const zeros[8] = {};
+        std::uint64_t position = static_cast<std::uint64_t>( file.tellp() );
+        put( zeros, static_cast<std::size_t>( ( 8U - position % 8U ) % 8U ) );
+    };
+
+    GrammarPackHeader header;
+    header.grammar_count = static_cast<std::uint32_t>( grammars.size() );
+    put( &header, sizeof(header) );
+
+    // the directory is written again once the records are placed
+    std::vector<GrammarPackEntry> entries( grammars.size() );
+    std::uint64_t directory = static_cast<std::uint64_t>( file.tellp() );
+    put( entries.data(), entries.size() * sizeof(GrammarPackEntry) );
+
+    for ( std::size_t g = 0; g < grammars.size(); ++g )
+    {
+        Grammar const& grammar = grammars[g];
+        SymbolRules const& rules = grammar.rules;
+        LTurtle::Config const& config = grammar.config;
+
+        std::string names;
+        for ( std::size_t s = 256U; s < grammar.symbols.size(); ++s )
+        {
+            names += grammar.symbols.name( static_cast<Symbol>( s ) );
+            names += '\0';
+        }
+        names += grammar.name;
+        names += '\0';
+
+        GrammarRecord record{ config.radius, config.distance, config.leaf_size, config.angle_world_y, config.angle_turtle_left,
+                              config.brush_decay_coef, config.max_depth, { config.tropism.x, config.tropism.y, config.tropism.z },
+                              config.susceptibility, static_cast<std::uint32_t>( rules.firsts.size() ), config.seed,
+                              static_cast<std::uint32_t>( rules.offsets.size() ), static_cast<std::uint32_t>( rules.symbols.size() ),
+                              static_cast<std::uint32_t>( grammar.axiom.size() ), static_cast<std::uint32_t>( grammar.symbols.size() ),
+                              static_cast<std::uint32_t>( names.size() ) };
+
+        align();
+        entries[g].offset = static_cast<std::uint64_t>( file.tellp() );
+
+        put( &record, sizeof(record) );
+        put( rules.firsts.data(), rules.firsts.size() * sizeof(std::uint32_t) );
+        put( rules.counts.data(), rules.counts.size() * sizeof(std::uint32_t) );
+        put( rules.totals.data(), rules.totals.size() * sizeof(float) );
+        put( rules.offsets.data(), rules.offsets.size() * sizeof(std::uint32_t) );
+        put( rules.lengths.data(), rules.lengths.size() * sizeof(std::uint32_t) );
+        put( rules.weights.data(), rules.weights.size() * sizeof(float) );
+        put( rules.symbols.data(), rules.symbols.size() * sizeof(Symbol) );
+        put( grammar.axiom.data(), grammar.axiom.size() * sizeof(Symbol) );
+        put( grammar.symbols.command_table().data(), grammar.symbols.size() );
+        put( names.data(), names.size() );
+
+        entries[g].size = static_cast<std::uint64_t>( file.tellp() ) - entries[g].offset;
+    }
+
+    file.seekp( static_cast<std::streamoff>( directory ) );
+    put( entries.data(), entries.size() * sizeof(GrammarPackEntry) );
+
+    if ( !file )
+        throw std::runtime_error( "cannot write " + path );
+}
+
+/// A grammar pack mapped read-only into memory. load() may be called from any number of threads.
+struct GrammarPack {
+
+    explicit GrammarPack(std::string const& path) {
+
+#ifdef _WIN32
+        file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+        LARGE_INTEGER fileSize;
+        if ( file == INVALID_HANDLE_VALUE || !GetFileSizeEx( file, &fileSize ) )
+        {
+            close_file();
+            throw std::runtime_error( "cannot open " + path );
+        }
+        size = static_cast<std::size_t>( fileSize.QuadPart );
+        mapping = size > 0U ? CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr ) : nullptr;
+        base = mapping != nullptr ? MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : nullptr;
+#else
+        file = open( path.c_str(), O_RDONLY );
+        struct stat status;
+        if ( file < 0 || fstat( file, &status ) != 0 )
+        {
+            close_file();
+            throw std::runtime_error( "cannot open " + path );
+        }
+        size = static_cast<std::size_t>( status.st_size );
+        base = size > 0U ? mmap( nullptr, size, PROT_READ, MAP_SHARED, file, 0 ) : nullptr;
+        if ( base == MAP_FAILED )
+            base = nullptr;
+#endif
+
+        if ( base == nullptr )
+        {
+            close_file();
+            throw std::runtime_error( "cannot map " + path );
+        }
+
+        GrammarPackHeader header;
+        if ( size < sizeof(header) )
+        {
+            close_file();
+            throw std::runtime_error( path + " is not a grammar pack" );
+        }
+
+        std::memcpy( &header, base, sizeof(header) );
+        if ( std::memcmp( header.magic, GrammarPackHeader().magic, sizeof(header.magic) ) != 0 || header.version != 1U
+             || size < sizeof(header) + header.grammar_count * sizeof(GrammarPackEntry) )
+        {
+            close_file();
+            throw std::runtime_error( path + " is not a grammar pack" );
+        }
+
+        count = header.grammar_count;
+        entries = reinterpret_cast<GrammarPackEntry const*>( static_cast<char const*>( base ) + sizeof(header) );
+    }
+
+    ~GrammarPack() {
+
+        close_file();
+    }
+
+    GrammarPack(GrammarPack const&) = delete;
+    GrammarPack& operator=(GrammarPack const&) = delete;
+
+    std::size_t grammar_count() const {
+
+        return count;
+    }
+
+    /// Copies grammar "index" into "grammar", false (leaving "grammar" as it was) when its record is damaged.
+    bool load(std::size_t const index, Grammar& grammar) const {
+
+        if ( index >= count || entries[index].offset > size || entries[index].size > size - entries[index].offset )
+            return false;
+
+        char const* bytes = static_cast<char const*>( base ) + entries[index].offset;
+        char const* end = bytes + entries[index].size;
+
+        GrammarRecord record;
+        if ( static_cast<std::size_t>( end - bytes ) < sizeof(record) )
+            return false;
+        std::memcpy( &record, bytes, sizeof(record) );
+        bytes += sizeof(record);
+
+        std::uint64_t expected = ( 3U * std::uint64_t( record.head_count ) + 3U * std::uint64_t( record.alternative_count ) ) * 4U
+                               + ( std::uint64_t( record.symbol_count ) + record.axiom_length ) * sizeof(Symbol)
+                               + record.command_count + record.names_size;
+        if ( static_cast<std::uint64_t>( end - bytes ) < expected || record.command_count < 256U || record.command_count > invalid_symbol )
+            return false;
+
+        auto take = [&](auto& values, std::size_t const n) {
+            values.resize( n );
+            std::memcpy( values.data(), bytes, n * sizeof(values[0]) );
+            bytes += n * sizeof(values[0]);
+        };
+
+        // built aside, "grammar" only changes once the record passed every check
+        Grammar loaded;
+        LTurtle::Config& config = loaded.config;
+        config.radius = record.radius;
+        config.distance = record.distance;
+        config.leaf_size = record.leaf_size;
+        config.angle_world_y = record.angle_world_y;
+        config.angle_turtle_left = record.angle_turtle_left;
+        config.brush_decay_coef = record.brush_decay_coef;
+        config.max_depth = record.max_depth;
+        config.tropism = glm::vec3( record.tropism[0], record.tropism[1], record.tropism[2] );
+        config.susceptibility = record.susceptibility;
+        config.seed = record.seed;
+
+        SymbolRules& rules = loaded.rules;
+        take( rules.firsts, record.head_count );
+        take( rules.counts, record.head_count );
+        take( rules.totals, record.head_count );
+        take( rules.offsets, record.alternative_count );
+        take( rules.lengths, record.alternative_count );
+        take( rules.weights, record.alternative_count );
+        take( rules.symbols, record.symbol_count );
+        take( loaded.axiom, record.axiom_length );
+
+        char const* commands = bytes;
+        std::string_view names( bytes + record.command_count, record.names_size );
+
+        // the named tokens are interned in id order -> they get their old ids back
+        for ( std::uint32_t s = 256U; s < record.command_count; ++s )
+        {
+            std::size_t terminator = names.find( '\0' );
+            if ( terminator == std::string_view::npos || loaded.symbols.intern( names.substr( 0U, terminator ) ) != s )
+                return false;
+            names.remove_prefix( terminator + 1U );
+        }
+        for ( std::uint32_t s = 0U; s < record.command_count; ++s )
+        {
+            loaded.symbols.bind( static_cast<Symbol>( s ), commands[s] );
+        }
+
+        loaded.name.assign( names.data(), names.find( '\0' ) == std::string_view::npos ? names.size() : names.find( '\0' ) );
+
+        // every rule and symbol must stay inside the tables
+        for ( std::size_t h = 0; h < rules.firsts.size(); ++h )
+        {
+            if ( rules.firsts[h] != SymbolRules::no_rule
+                 && ( rules.counts[h] == 0U || rules.firsts[h] > rules.offsets.size() || rules.counts[h] > rules.offsets.size() - rules.firsts[h] ) )
+                return false;
+        }
+        for ( std::size_t a = 0; a < rules.offsets.size(); ++a )
+        {
+            if ( rules.offsets[a] > rules.symbols.size() || rules.lengths[a] > rules.symbols.size() - rules.offsets[a] )
+                return false;
+        }
+        for ( Symbol s : rules.symbols )
+        {
+            if ( s >= record.command_count )
+                return false;
+        }
+        for ( Symbol s : loaded.axiom )
+        {
+            if ( s >= record.command_count )
+                return false;
+        }
+
+        grammar = std::move( loaded );
+        return true;
+    }
+
+private:
+
+    void close_file() {
+
+#ifdef _WIN32
+        if ( base != nullptr )
+            UnmapViewOfFile( base );
+        if ( mapping != nullptr )
+            CloseHandle( mapping );
+        if ( file != INVALID_HANDLE_VALUE )
+            CloseHandle( file );
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if ( base != nullptr )
+            munmap( base, size );
+        if ( file >= 0 )
+            close( file );
+        file = -1;
+#endif
+        base = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int file = -1;
+#endif
+
+    void* base = nullptr;
+    std::size_t size = 0U;
+    std::size_t count = 0U;
+    GrammarPackEntry const* entries = nullptr;
+};
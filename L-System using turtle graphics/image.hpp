@@ -0,0 +1,80 @@
+#pragma once
+
+#include "glm_headers.hpp"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/// A linear RGB image with float channels produced by the CPU renderers.
+struct Image {
+
+    Image() = default;
+
+    Image(int const width_, int const height_)
+        : width(width_)
+        , height(height_)
+        , pixels(static_cast<std::size_t>(width_) * height_, glm::vec3(0.0f))
+    {}
+
+    glm::vec3& at(int const x, int const y) {
+
+        return pixels[static_cast<std::size_t>(y) * width + x];
+    }
+
+    glm::vec3 const& at(int const x, int const y) const {
+
+        return pixels[static_cast<std::size_t>(y) * width + x];
+    }
+
+    int width = 0;
+    int height = 0;
+    std::vector<glm::vec3> pixels;
+};
+
+/// Saves the image as binary PPM (colors are clamped to [0, 1]).
+inline bool write_ppm(std::string const& path, Image const& image) {
+
+    std::ofstream file( path, std::ios::binary );
+    if ( !file )
+        return false;
+
+    file << "P6\n" << image.width << " " << image.height << "\n255\n";
+
+    std::vector<unsigned char> row( static_cast<std::size_t>(image.width) * 3 );
+    for ( int y = 0; y < image.height; ++y )
+    {
+        for ( int x = 0; x < image.width; ++x )
+        {
+            glm::vec3 c = glm::clamp( image.at( x, y ), 0.0f, 1.0f );
+            row[x * 3 + 0] = static_cast<unsigned char>( c.r * 255.0f + 0.5f );
+            row[x * 3 + 1] = static_cast<unsigned char>( c.g * 255.0f + 0.5f );
+            row[x * 3 + 2] = static_cast<unsigned char>( c.b * 255.0f + 0.5f );
+        }
+        file.write( reinterpret_cast<char const*>( row.data() ), static_cast<std::streamsize>( row.size() ) );
+    }
+
+    return static_cast<bool>( file );
+}
+
+/// Mean squared error of two images of the same size (over all channels).
+inline float mean_squared_error(Image const& a, Image const& b) {
+
+    double sum = 0.0;
+    for ( std::size_t i = 0; i < a.pixels.size(); ++i )
+    {
+        glm::vec3 d = a.pixels[i] - b.pixels[i];
+        sum += glm::dot( d, d );
+    }
+
+    return a.pixels.empty() ? 0.0f : static_cast<float>( sum / ( 3.0 * a.pixels.size() ) );
+}
+
+/// Peak signal to noise ratio in dB for colors in [0, 1].
+inline float psnr(Image const& a, Image const& b) {
+
+    float mse = mean_squared_error( a, b );
+    return mse > 0.0f ? -10.0f * std::log10( mse ) : std::numeric_limits<float>::infinity();
+}
@@ -0,0 +1,344 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "bvh.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+/// Maps a unit direction to [0, 1]^2 (octahedral mapping, Y is up).
+inline glm::vec2 octahedral_encode(glm::vec3 const& direction) {
+
+    glm::vec3 d = direction / ( std::abs( direction.x ) + std::abs( direction.y ) + std::abs( direction.z ) );
+    glm::vec2 p( d.x, d.z );
+
+    if ( d.y < 0.0f )
+    {
+        p = glm::vec2( ( 1.0f - std::abs( d.z ) ) * ( d.x >= 0.0f ? 1.0f : -1.0f ),
+                       ( 1.0f - std::abs( d.x ) ) * ( d.z >= 0.0f ? 1.0f : -1.0f ) );
+    }
+
+    return 0.5f * p + 0.5f;
+}
+
+/// Inverse of octahedral_encode.
+inline glm::vec3 octahedral_decode(glm::vec2 const& uv) {
+
+    glm::vec2 p = 2.0f * uv - 1.0f;
+    glm::vec3 d( p.x, 1.0f - std::abs( p.x ) - std::abs( p.y ), p.y );
+
+    if ( d.y < 0.0f )
+    {
+        d.x = ( 1.0f - std::abs( p.y ) ) * ( p.x >= 0.0f ? 1.0f : -1.0f );
+        d.z = ( 1.0f - std::abs( p.x ) ) * ( p.y >= 0.0f ? 1.0f : -1.0f );
+    }
+
+    return glm::normalize( d );
+}
+
+/// Settings of the impostor baker.
+struct ImpostorSettings {
+    int frames = 8;                 // the atlas holds frames x frames views
+    int frame_size = 64;            // texels along each side of a view
+    unsigned int threads = 0U;      // 0 -> all hardware threads
+};
+
+/// An octahedral impostor of one tree: orthographic views of the tree from
+/// directions spread over the sphere, stored in an atlas of color (albedo),
+/// normal and depth (relative to the plane of the view, in bounding radii).
+struct Impostor {
+
+    int frames = 0;
+    int frame_size = 0;
+    glm::vec3 center = glm::vec3(0.0f);
+    float radius = 0.0f;
+
+    Image color;
+    Image normal;
+    std::vector<float> depth;
+    std::vector<float> coverage;
+
+    /// Renders all the views of the tree (the ground of the scene is left out).
+    void bake(Scene const& tree, ImpostorSettings const& settings = ImpostorSettings()) {
+
+        frames = settings.frames;
+        frame_size = settings.frame_size;
+
+        if ( tree.bvh.empty() )
+            return;
+
+        BVH::Node const& root = tree.bvh.nodes[0];
+        center = 0.5f * ( root.minimum + root.maximum );
+        radius = 0.5f * glm::length( root.maximum - root.minimum );
+
+        int size = frames * frame_size;
+        color = Image( size, size );
+        normal = Image( size, size );
+        depth.assign( static_cast<std::size_t>( size ) * size, 0.0f );
+        coverage.assign( static_cast<std::size_t>( size ) * size, 0.0f );
+
+        parallel_for( static_cast<std::size_t>( frames ) * frames, settings.threads, [&](std::size_t const frame) {
+            int fx = static_cast<int>( frame ) % frames;
+            int fy = static_cast<int>( frame ) / frames;
+
+            glm::vec3 d, right, up;
+            frame_basis( fx, fy, d, right, up );
+
+            for ( int py = 0; py < frame_size; ++py )
+            {
+                for ( int px = 0; px < frame_size; ++px )
+                {
+                    float x = 2.0f * ( px + 0.5f ) / frame_size - 1.0f;
+                    float y = 1.0f - 2.0f * ( py + 0.5f ) / frame_size;
+
+                    // orthographic ray from in front of the tree towards the plane of the view
+                    Ray ray{ center + radius * ( x * right + y * up + 2.0f * d ), -d };
+                    Hit hit;
+                    EvaluatePrimitives( tree, ray, hit );
+
+                    int ax = fx * frame_size + px, ay = fy * frame_size + py;
+                    std::size_t texel = static_cast<std::size_t>( ay ) * color.width + ax;
+
+                    if ( hit.is_miss() )
+                        continue;
+
+                    color.at( ax, ay ) = Material( tree, hit );
+                    normal.at( ax, ay ) = hit.normal;
+                    depth[texel] = ( 2.0f * radius - hit.t ) / radius;
+                    coverage[texel] = 1.0f;
+                }
+            }
+        } );
+    }
+
+    /// Intersects a ray in the space of the tree with the view closest to the ray's direction.
+    bool intersect(Ray const& ray, float const t_max, float& t, glm::vec3& surface_normal, glm::vec3& albedo) const {
+
+        if ( frames == 0 || color.pixels.empty() )
+            return false;
+
+        // the view looking the same way as the ray
+        glm::vec2 uv = octahedral_encode( -ray.direction );
+        int fx = std::min( static_cast<int>( uv.x * frames ), frames - 1 );
+        int fy = std::min( static_cast<int>( uv.y * frames ), frames - 1 );
+
+        glm::vec3 d, right, up;
+        frame_basis( fx, fy, d, right, up );
+
+        float denom = glm::dot( ray.direction, d );
+        if ( denom > -1e-6f )
+            return false;
+
+        // texel where the ray crosses the plane of the view
+        float tPlane = glm::dot( center - ray.origin, d ) / denom;
+        glm::vec3 p = ray.origin + tPlane * ray.direction - center;
+        float x = glm::dot( p, right ) / radius;
+        float y = glm::dot( p, up ) / radius;
+
+        if ( x < -1.0f || x >= 1.0f || y <= -1.0f || y > 1.0f )
+            return false;
+
+        int px = std::min( static_cast<int>( 0.5f * ( x + 1.0f ) * frame_size ), frame_size - 1 );
+        int py = std::min( static_cast<int>( 0.5f * ( 1.0f - y ) * frame_size ), frame_size - 1 );
+        int ax = fx * frame_size + px, ay = fy * frame_size + py;
+        std::size_t texel = static_cast<std::size_t>( ay ) * color.width + ax;
+
+        if ( coverage[texel] < 0.5f )
+            return false;
+
+        // move from the plane to the stored surface
+        t = ( depth[texel] * radius - glm::dot( ray.origin - center, d ) ) / denom;
+        if ( t <= 0.0f || t >= t_max )
+            return false;
+
+        surface_normal = normal.at( ax, ay );
+        albedo = color.at( ax, ay );
+
+        return true;
+    }
+
+private:
+
+    /// Direction (towards the viewer), right and up vectors of a view.
+    void frame_basis(int const fx, int const fy, glm::vec3& d, glm::vec3& right, glm::vec3& up) const {
+
+        d = octahedral_decode( glm::vec2( ( fx + 0.5f ) / frames, ( fy + 0.5f ) / frames ) );
+
+        glm::vec3 helper = std::abs( d.y ) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+        right = glm::normalize( glm::cross( helper, d ) );
+        up = glm::cross( d, right );
+    }
+};
+
+/// A unique tree of a forest with its impostor (may be nullptr -> always full geometry).
+struct ForestTree {
+    Scene const* scene = nullptr;
+    Impostor const* impostor = nullptr;
+};
+
+/// A placed copy of a tree: translated, rotated about Y and uniformly scaled.
+struct ForestInstance {
+    std::uint32_t tree = 0U;
+    glm::vec3 position = glm::vec3(0.0f);
+    float rotation = 0.0f;
+    float scale = 1.0f;
+};
+
+/// A forest of instanced trees. Instances farther than "impostor_distance" from
+/// the camera are drawn with their impostor instead of their geometry.
+/// Rays find the instances through a BVH over their bounding spheres: call build()
+/// after filling (or changing) "trees" and "instances".
+struct Forest {
+    std::vector<ForestTree> trees;
+    std::vector<ForestInstance> instances;
+    float impostor_distance = 50.0f;
+
+    DirectionalLight light;
+    glm::vec3 ground_color = glm::vec3(0.4f, 0.4f, 0.35f);
+    glm::vec3 sky_color = glm::vec3(0.6f, 0.75f, 0.95f);
+
+    /// Places the bounding sphere of every instance and builds the BVH over their boxes
+    /// (instances of trees without geometry are left out).
+    void build() {
+
+        spheres.assign( instances.size(), glm::vec4(0.0f) );
+
+        std::vector<std::uint32_t> ids;
+        std::vector<Bounds> bounds;
+
+        for ( std::size_t i = 0; i < instances.size(); ++i )
+        {
+            ForestInstance const& instance = instances[i];
+            ForestTree const& tree = trees[instance.tree];
+            if ( tree.scene == nullptr || tree.scene->bvh.empty() )
+                continue;
+
+            BVH::Node const& root = tree.scene->bvh.nodes[0];
+            glm::vec3 localCenter = 0.5f * ( root.minimum + root.maximum );
+            float radius = 0.5f * glm::length( root.maximum - root.minimum ) * instance.scale;
+            glm::vec3 worldCenter = instance.position + instance.scale * rotate_y( localCenter, instance.rotation );
+            spheres[i] = glm::vec4( worldCenter, radius );
+
+            Bounds box;
+            box.grow( worldCenter - radius );
+            box.grow( worldCenter + radius );
+            ids.push_back( static_cast<std::uint32_t>( i ) );
+            bounds.push_back( box );
+        }
+
+        bvh.build( ids, bounds );
+    }
+
+    /// Traces the ray through the forest (shadows are traced within the hit tree only,
+    /// impostors are not shadowed).
+    glm::vec3 Trace(Ray const& ray) const {
+
+        const float epsilon = 0.01f;
+
+        Hit ground;
+        RayPlaneIntersection( ray, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f), ground.t, ground );
+
+        float closest = ground.t;
+        glm::vec3 normal = ground.normal, albedo = ground_color;
+        float ambient = 1.0f;
+        bool hitSomething = !ground.is_miss();
+        ForestInstance const* shadowInstance = nullptr;
+        glm::vec3 shadowOrigin( 0.0f );
+
+        // the instances whose boxes the ray enters before the closest hit so far
+        bvh.traverse( ray, closest, [&](std::uint32_t const i) {
+            ForestInstance const& instance = instances[i];
+            ForestTree const& tree = trees[instance.tree];
+            glm::vec3 worldCenter( spheres[i] );
+            float radius = spheres[i].w;
+
+            // bounding sphere
+            glm::vec3 oc = ray.origin - worldCenter;
+            float b = glm::dot( oc, ray.direction );
+            float c = glm::dot( oc, oc ) - radius * radius;
+            float h = b * b - c;
+            if ( h < 0.0f || -b - std::sqrt( h ) >= closest || -b + std::sqrt( h ) <= 0.0f )
+                return false;
+
+            // the ray in the space of the tree
+            Ray local{ rotate_y( ray.origin - instance.position, -instance.rotation ) / instance.scale,
+                       rotate_y( ray.direction, -instance.rotation ) };
+            float localClosest = closest / instance.scale;
+
+            if ( tree.impostor != nullptr && glm::length( oc ) > impostor_distance )
+            {
+                float t;
+                glm::vec3 n, color;
+                if ( tree.impostor->intersect( local, localClosest, t, n, color ) )
+                {
+                    closest = t * instance.scale;
+                    normal = rotate_y( n, instance.rotation );
+                    albedo = color;
+                    ambient = 1.0f;
+                    hitSomething = true;
+                    shadowInstance = nullptr;
+                }
+            }
+            else
+            {
+                Hit hit;
+                hit.t = localClosest;
+                EvaluatePrimitives( *tree.scene, local, hit );
+
+                if ( !hit.is_miss() )
+                {
+                    closest = hit.t * instance.scale;
+                    normal = rotate_y( hit.normal, instance.rotation );
+                    albedo = Material( *tree.scene, hit );
+                    ambient = AmbientOcclusion( *tree.scene, hit );
+                    hitSomething = true;
+                    shadowInstance = &instance;
+                    shadowOrigin = hit.intersection + epsilon * hit.normal;
+                }
+            }
+
+            return false;
+        } );
+
+        if ( !hitSomething )
+            return sky_color;
+
+        glm::vec3 L = light.direction;
+        glm::vec3 color = 0.2f * albedo * ambient + 0.8f * albedo * light.diffuse * std::max( glm::dot( normal, L ), 0.0f );
+
+        if ( shadowInstance != nullptr )
+        {
+            Ray shadowRay{ shadowOrigin, rotate_y( L, -shadowInstance->rotation ) };
+            if ( Occluded( *trees[shadowInstance->tree].scene, shadowRay ) )
+                color = 0.2f * color;
+        }
+
+        return color;
+    }
+
+    static glm::vec3 rotate_y(glm::vec3 const& v, float const angle) {
+
+        float c = std::cos( angle ), s = std::sin( angle );
+        return glm::vec3( c * v.x + s * v.z, v.y, -s * v.x + c * v.z );
+    }
+
+private:
+
+    std::vector<glm::vec4> spheres;     // world center and radius of each instance
+    BVH bvh;                            // over "spheres", the ids are instance indices
+};
+
+/// Renders the forest with one ray through each pixel center.
+inline void render(Forest const& forest, Camera const& camera, Image& image, RenderSettings const& settings = RenderSettings()) {
+
+    parallel_for( static_cast<std::size_t>( image.height ), settings.threads, [&](std::size_t const row) {
+        int y = static_cast<int>( row );
+        for ( int x = 0; x < image.width; ++x )
+        {
+            image.at( x, y ) = forest.Trace( camera.generate_ray( x + 0.5f, y + 0.5f, image.width, image.height ) );
+        }
+    } );
+}
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "intersection_records.hpp"
+#include "bvh.hpp"
+#include "sampling.hpp"
+#include "draw_primitives.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+// Correctness check of the intersection records: random rays are fired at the primitives
+// of generated trees and the record tests (RayBranchIntersection, RayLeafIntersection)
+// have to agree with the naive tests below, which derive everything from the Branch or
+// Leaf on every call. perf_gate runs it.
+
+/// Naive ray / rounded cone test straight from the branch: the unnormalized formulation
+/// RayBranchIntersection is derived from. Only hits with t in (0, t_max) count.
+inline bool NaiveBranchIntersection(Ray const& ray, Branch const& branch, float const t_max, Hit& hit) {
+
+    glm::vec3 ba = branch.p2 - branch.p1;
+    glm::vec3 oa = ray.origin - branch.p1;
+    glm::vec3 ob = ray.origin - branch.p2;
+    float ra = branch.r1, rb = branch.r2;
+    float rr = ra - rb;
+
+    float m0 = glm::dot( ba, ba );
+    float m1 = glm::dot( ba, oa );
+    float m2 = glm::dot( ba, ray.direction );
+    float m3 = glm::dot( ray.direction, oa );
+    float m5 = glm::dot( oa, oa );
+    float m6 = glm::dot( ob, ray.direction );
+    float m7 = glm::dot( ob, ob );
+
+    // body
+    float d2 = m0 - rr * rr;
+    float k2 = d2 - m2 * m2;
+    float k1 = d2 * m3 - m1 * m2 + m2 * rr * ra;
+    float k0 = d2 * m5 - m1 * m1 + 2.0f * m1 * rr * ra - m0 * ra * ra;
+    float h = k1 * k1 - k0 * k2;
+
+    if ( h < 0.0f )
+        return false;
+
+    float t = ( -std::sqrt( h ) - k1 ) / k2;
+    float y = m1 - ra * rr + t * m2;
+
+    if ( y > 0.0f && y < d2 )
+    {
+        if ( t <= 0.0f || t >= t_max )
+            return false;
+
+        hit.t = t;
+        hit.normal = glm::normalize( d2 * ( oa + t * ray.direction ) - ba * y );
+    }
+    else
+    {
+        // caps
+        float h1 = m3 * m3 - m5 + ra * ra;
+        float h2 = m6 * m6 - m7 + rb * rb;
+
+        float best = t_max;
+        glm::vec3 normal;
+
+        if ( h1 > 0.0f )
+        {
+            float t1 = -m3 - std::sqrt( h1 );
+            if ( t1 > 0.0f && t1 < best )
+            {
+                best = t1;
+                normal = ( oa + t1 * ray.direction ) / ra;
+            }
+        }
+        if ( h2 > 0.0f )
+        {
+            float t2 = -m6 - std::sqrt( h2 );
+            if ( t2 > 0.0f && t2 < best )
+            {
+                best = t2;
+                normal = ( ob + t2 * ray.direction ) / rb;
+            }
+        }
+
+        if ( best >= t_max )
+            return false;
+
+        hit.t = best;
+        hit.normal = glm::normalize( normal );
+    }
+
+    hit.intersection = ray.origin + hit.t * ray.direction;
+    hit.kind = Hit::Kind::Branch;
+
+    return true;
+}
+
+/// Naive ray / parallelogram test straight from the leaf: the plane from the cross product
+/// of the edges, the UVs from the Gram matrix of the edges. Only hits with t in (0, t_max) count.
+inline bool NaiveLeafIntersection(Ray const& ray, Leaf const& leaf, float const t_max, Hit& hit) {
+
+    glm::vec3 edgeU = glm::vec3( leaf.up ) * leaf.size.x;
+    glm::vec3 edgeV = glm::vec3( leaf.direction ) * leaf.size.y;
+    glm::vec3 corner = glm::vec3( leaf.position ) - 0.5f * edgeU;
+
+    glm::vec3 n = glm::cross( edgeU, edgeV );
+    float area = glm::length( n );
+
+    // a leaf without area is never hit
+    if ( area == 0.0f )
+        return false;
+
+    n /= area;
+    float denom = glm::dot( n, ray.direction );
+
+    if ( std::abs( denom ) < 1e-8f )
+        return false;
+
+    float t = glm::dot( corner - ray.origin, n ) / denom;
+
+    if ( t <= 0.0f || t >= t_max )
+        return false;
+
+    glm::vec3 p = ray.origin + t * ray.direction;
+    glm::vec3 d = p - corner;
+
+    float uu = glm::dot( edgeU, edgeU ), uv = glm::dot( edgeU, edgeV ), vv = glm::dot( edgeV, edgeV );
+    float du = glm::dot( d, edgeU ), dv = glm::dot( d, edgeV );
+    float det = uu * vv - uv * uv;
+    float u = ( vv * du - uv * dv ) / det;
+    float v = ( uu * dv - uv * du ) / det;
+
+    if ( u < 0.0f || u > 1.0f || v < 0.0f || v > 1.0f )
+        return false;
+
+    hit.t = t;
+    hit.intersection = p;
+    hit.normal = denom > 0.0f ? -n : n;
+    hit.uv = glm::vec2( u, v );
+    hit.kind = Hit::Kind::Leaf;
+
+    return true;
+}
+
+/// Outcome of check_intersection_records().
+struct IntersectionCheck {
+    std::size_t rays = 0U;
+    std::size_t hits = 0U;              // rays both tests hit (and compared)
+    std::size_t grazing = 0U;           // rays along a surface or within rounding of an edge (not compared)
+    std::size_t mismatches = 0U;        // disagreements beyond the tolerances, degenerate leaves that were hit
+    std::size_t degenerate_leaves = 0U;
+
+    bool passed() const {
+
+        return mismatches == 0U;
+    }
+};
+
+/// Fires "ray_count" random rays at the primitives (each one aimed near a random branch or
+/// leaf from a random direction) and compares the record tests with the naive ones: the
+/// same hits, t within 1e-4 relative, normals within 1e-3 and UVs within 1e-4 (t and UVs
+/// divided by the cosine of the angle of incidence). Rays about parallel with the surface
+/// (cosine below 1e-3) only count as grazing, as does a ray that one test hits and the
+/// other misses when the naive result flips under a nudge of the origin by 1e-4 of the
+/// distance. Leaves without area (every fourth leaf is also tested collapsed) must never
+/// be hit and must give empty bounds.
+inline IntersectionCheck check_intersection_records(std::vector<Branch> const& branches, std::vector<Leaf> const& leaves,
+                                                    std::size_t const ray_count, std::uint64_t const seed = 1U) {
+
+    IntersectionCheck check;
+    if ( branches.empty() && leaves.empty() )
+        return check;
+
+    std::vector<Leaf> collapsed;
+    for ( std::size_t i = 0; i < leaves.size(); i += 4U )
+    {
+        Leaf leaf = leaves[i];
+        leaf.size = glm::vec4(0.0f);
+        collapsed.push_back( leaf );
+    }
+
+    PrimitiveRecords records;
+    records.build( branches, leaves );
+
+    PrimitiveRecords collapsedRecords;
+    collapsedRecords.build( {}, collapsed );
+
+    for ( std::size_t i = 0; i < collapsedRecords.leaves.size(); ++i )
+    {
+        ++check.degenerate_leaves;
+        if ( !leaf_bounds( collapsedRecords.leaves[i] ).empty() )
+            ++check.mismatches;
+    }
+
+    Random random( seed );
+    auto unit = [&]() {
+        glm::vec3 d( 2.0f * random.next() - 1.0f, 2.0f * random.next() - 1.0f, 2.0f * random.next() - 1.0f );
+        float length = glm::length( d );
+        return length > 1e-3f ? d / length : glm::vec3(0.0f, 1.0f, 0.0f);
+    };
+
+    std::size_t primitiveCount = branches.size() + leaves.size();
+
+    for ( std::size_t r = 0; r < ray_count; ++r )
+    {
+        std::size_t k = std::min( static_cast<std::size_t>( random.next() * primitiveCount ), primitiveCount - 1U );
+        bool branch = k < branches.size();
+
+        // a point near the primitive: around its axis, or in and somewhat beyond the leaf
+        glm::vec3 target;
+        float size;
+        if ( branch )
+        {
+            Branch const& b = branches[k];
+            float s = 1.2f * random.next() - 0.1f;
+            size = std::max( b.r1, b.r2 );
+            target = b.p1 + s * ( b.p2 - b.p1 ) + 1.5f * size * unit();
+        }
+        else
+        {
+            Leaf const& l = leaves[k - branches.size()];
+            float u = 1.4f * random.next() - 0.7f, v = 1.4f * random.next() - 0.2f;
+            size = std::max( l.size.x, l.size.y );
+            target = glm::vec3( l.position ) + u * l.size.x * glm::vec3( l.up ) + v * l.size.y * glm::vec3( l.direction );
+        }
+
+        // from a few to a few dozen sizes away: farther, the rounding of the quadratic
+        // (whose terms grow with the squared distance) hides the differences looked for
+        float distance = size * ( 2.0f + 30.0f * random.next() );
+        Ray ray;
+        ray.origin = target + distance * unit();
+        ray.direction = glm::normalize( target - ray.origin );
+
+        auto naive = [&](Ray const& r_, Hit& hit) {
+            return branch ? NaiveBranchIntersection( r_, branches[k], 1e20f, hit )
+                          : NaiveLeafIntersection( r_, leaves[k - branches.size()], 1e20f, hit );
+        };
+
+        Hit expected, actual;
+        bool expectedHit = naive( ray, expected );
+        bool actualHit = branch ? RayBranchIntersection( ray, records.branches[k], 1e20f, actual )
+                                : RayLeafIntersection( ray, records.leaves[k - branches.size()], 1e20f, actual );
+        ++check.rays;
+
+        // the same ray must pass through the collapsed copy of a leaf
+        if ( !branch && ( k - branches.size() ) % 4U == 0U )
+        {
+            Hit ignored;
+            if ( RayLeafIntersection( ray, collapsedRecords.leaves[( k - branches.size() ) / 4U], 1e20f, ignored ) )
+                ++check.mismatches;
+        }
+
+        if ( expectedHit != actualHit )
+        {
+            glm::vec3 t, b;
+            orthonormal_basis( ray.direction, t, b );
+            float nudge = 1e-4f * distance;
+
+            // a ray about parallel with the surface it hit decides nothing
+            Hit const& hit = expectedHit ? expected : actual;
+            bool flips = std::abs( glm::dot( hit.normal, ray.direction ) ) < 1e-3f;
+            for ( glm::vec3 offset : { t, -t, b, -b } )
+            {
+                Ray nudged = ray;
+                nudged.origin = ray.origin + nudge * offset;
+                Hit ignored;
+                flips = flips || naive( nudged, ignored ) != expectedHit;
+            }
+
+            ++( flips ? check.grazing : check.mismatches );
+            continue;
+        }
+
+        if ( !expectedHit )
+            continue;
+
+        float cos = std::abs( glm::dot( expected.normal, ray.direction ) );
+        if ( cos < 1e-3f )
+        {
+            ++check.grazing;
+            continue;
+        }
+
+        ++check.hits;
+
+        // a grazing hit moves by the rounding of the surface offset / cos (the plane of a leaf,
+        // the root of the quadratic near the silhouette of a branch)
+        float conditioning = 1.0f / cos;
+        float tolerance = 1e-4f * conditioning;
+
+        bool same = std::abs( expected.t - actual.t ) <= tolerance * std::max( 1.0f, expected.t )
+                 && glm::dot( expected.normal, actual.normal ) >= 1.0f - 1e-3f;
+        if ( !branch )
+            same = same && std::abs( expected.uv.x - actual.uv.x ) <= tolerance && std::abs( expected.uv.y - actual.uv.y ) <= tolerance;
+
+        if ( !same )
+            ++check.mismatches;
+    }
+
+    return check;
+}
@@ -0,0 +1,432 @@
+#pragma once
+
+#include "draw_primitives.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+/// The definition of a ray (mirrors "Ray" in ray_tracing.frag).
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float spread = 0.0f;    // widening of the ray per unit of distance (texture footprint)
+};
+
+/// The definition of an intersection (mirrors "Hit" in ray_tracing.frag).
+/// Instead of the material it remembers which primitive was hit and
+/// where on its surface, so the shading can be done afterwards.
+struct Hit {
+
+    /// Kind of the primitive that was hit.
+    enum class Kind : std::uint8_t { Miss, Ground, Branch, Leaf };
+
+    glm::vec3 intersection = glm::vec3(0.0f);
+    float t = 1e20f;
+    glm::vec3 normal = glm::vec3(0.0f);
+    glm::vec2 uv = glm::vec2(0.0f);
+    Kind kind = Kind::Miss;
+    std::uint32_t index = 0U;
+
+    bool is_miss() const {
+
+        return kind == Kind::Miss;
+    }
+
+    /// Identifier of the primitive that was hit (kind in the top 2 bits, index in the rest).
+    std::uint32_t id() const {
+
+        return make_id( kind, index );
+    }
+
+    static std::uint32_t make_id(Kind const kind, std::uint32_t const index) {
+
+        return ( static_cast<std::uint32_t>( kind ) << 30 ) | ( index & 0x3FFFFFFFU );
+    }
+};
+
+/// Intersection-ready form of a Branch (rounded cone).
+/// Everything the ray test derives from p1/p2/r1/r2 is computed once here.
+/// The layout equals "BranchRecord" in ray_tracing.frag (4 x vec4, std430),
+/// so a vector of records can be uploaded to the shader as is.
+struct BranchRecord {
+    glm::vec3 p1;
+    float r1;
+    glm::vec3 p2;
+    float r2;
+    glm::vec3 axis;         // normalized p2 - p1
+    float length;           // |p2 - p1|
+    float slope;            // (r1 - r2) / length
+    float cos2;             // 1 - slope^2
+    float inv_length;       // 1 / length (0 for degenerate branches)
+    float reserved;
+};
+static_assert( sizeof(BranchRecord) == 16 * sizeof(float), "BranchRecord must match the std430 layout of the shader" );
+
+/// Intersection-ready form of a Leaf (parallelogram).
+/// Each member is a plane (xyz, w) evaluated as dot(p, xyz) + w:
+/// "plane" is the leaf plane itself, "u_plane" and "v_plane" are the rows
+/// of the inverse edge basis, so they map a point on the leaf to its UVs.
+/// The layout equals "LeafRecord" in ray_tracing.frag (3 x vec4, std430).
+struct LeafRecord {
+    glm::vec4 plane;
+    glm::vec4 u_plane;
+    glm::vec4 v_plane;
+};
+static_assert( sizeof(LeafRecord) == 12 * sizeof(float), "LeafRecord must match the std430 layout of the shader" );
+
+/// Converts a branch generated by LTurtle to its intersection record.
+inline BranchRecord make_branch_record(Branch const& branch) {
+
+    BranchRecord record;
+    record.p1 = branch.p1;
+    record.r1 = branch.r1;
+    record.p2 = branch.p2;
+    record.r2 = branch.r2;
+
+    glm::vec3 ba = branch.p2 - branch.p1;
+    record.length = glm::length( ba );
+
+    if ( record.length > 0.0f )
+    {
+        record.inv_length = 1.0f / record.length;
+        record.axis = ba * record.inv_length;
+        record.slope = ( branch.r1 - branch.r2 ) * record.inv_length;
+    }
+    else
+    {
+        // degenerate branch -> only the end spheres are left
+        record.inv_length = 0.0f;
+        record.axis = glm::vec3(0.0f, 1.0f, 0.0f);
+        record.slope = 0.0f;
+    }
+
+    record.cos2 = 1.0f - record.slope * record.slope;
+    record.reserved = 0.0f;
+
+    return record;
+}
+
+/// Converts a leaf generated by LTurtle to its intersection record.
+/// The leaf spans "size.x" along its up vector (centered on the position)
+/// and "size.y" along its direction, U runs across and V along the leaf.
+inline LeafRecord make_leaf_record(Leaf const& leaf) {
+
+    glm::vec3 edgeU = glm::vec3( leaf.up ) * leaf.size.x;
+    glm::vec3 edgeV = glm::vec3( leaf.direction ) * leaf.size.y;
+    glm::vec3 corner = glm::vec3( leaf.position ) - 0.5f * edgeU;
+
+    glm::vec3 n = glm::cross( edgeU, edgeV );
+    float area = glm::length( n );
+
+    LeafRecord record;
+
+    if ( area > 0.0f )
+    {
+        n /= area;
+
+        // dual basis: dot(dualU, edgeU) = 1, dot(dualU, edgeV) = 0 (and vice versa)
+        glm::vec3 dualU = glm::cross( edgeV, n ) / area;
+        glm::vec3 dualV = glm::cross( n, edgeU ) / area;
+
+        record.plane = glm::vec4( n, -glm::dot( n, corner ) );
+        record.u_plane = glm::vec4( dualU, -glm::dot( dualU, corner ) );
+        record.v_plane = glm::vec4( dualV, -glm::dot( dualV, corner ) );
+    }
+    else
+    {
+        // degenerate leaf -> a plane no ray can hit
+        record.plane = glm::vec4(0.0f);
+        record.u_plane = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+        record.v_plane = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+    }
+
+    return record;
+}
+
+/// Tells whether the record is the one make_leaf_record() gives a leaf without area.
+inline bool leaf_degenerate(LeafRecord const& leaf) {
+
+    return leaf.plane.x == 0.0f && leaf.plane.y == 0.0f && leaf.plane.z == 0.0f;
+}
+
+/// Point of the leaf with the given UVs, recovered from the planes of its record.
+/// A degenerate leaf keeps no position (its planes are singular) -> the origin.
+inline glm::vec3 leaf_point(LeafRecord const& leaf, float const u, float const v) {
+
+    if ( leaf_degenerate( leaf ) )
+        return glm::vec3(0.0f);
+
+    // rows of the system are the three planes
+    glm::mat3 planes = glm::transpose( glm::mat3( glm::vec3( leaf.plane ), glm::vec3( leaf.u_plane ), glm::vec3( leaf.v_plane ) ) );
+
+    return glm::inverse( planes ) * glm::vec3( -leaf.plane.w, u - leaf.u_plane.w, v - leaf.v_plane.w );
+}
+
+/// Branch records stored as structure of arrays for the CPU tracer.
+struct BranchRecords {
+    std::vector<float> p1_x, p1_y, p1_z, r1;
+    std::vector<float> p2_x, p2_y, p2_z, r2;
+    std::vector<float> axis_x, axis_y, axis_z, length;
+    std::vector<float> slope, cos2, inv_length;
+    std::vector<float> ao;          // baked ambient occlusion (1 -> unoccluded), see ao_bake.hpp
+
+    std::size_t size() const {
+
+        return r1.size();
+    }
+
+    void clear() {
+
+        resize( 0U );
+    }
+
+    void resize(std::size_t const count) {
+
+        for ( std::vector<float>* array : arrays() )
+        {
+            array->resize( count );
+        }
+        ao.resize( count, 1.0f );
+    }
+
+    void set(std::size_t const i, BranchRecord const& record) {
+
+        p1_x[i] = record.p1.x; p1_y[i] = record.p1.y; p1_z[i] = record.p1.z; r1[i] = record.r1;
+        p2_x[i] = record.p2.x; p2_y[i] = record.p2.y; p2_z[i] = record.p2.z; r2[i] = record.r2;
+        axis_x[i] = record.axis.x; axis_y[i] = record.axis.y; axis_z[i] = record.axis.z;
+        length[i] = record.length;
+        slope[i] = record.slope;
+        cos2[i] = record.cos2;
+        inv_length[i] = record.inv_length;
+    }
+
+    BranchRecord operator[](std::size_t const i) const {
+
+        BranchRecord record;
+        record.p1 = glm::vec3( p1_x[i], p1_y[i], p1_z[i] );
+        record.r1 = r1[i];
+        record.p2 = glm::vec3( p2_x[i], p2_y[i], p2_z[i] );
+        record.r2 = r2[i];
+        record.axis = glm::vec3( axis_x[i], axis_y[i], axis_z[i] );
+        record.length = length[i];
+        record.slope = slope[i];
+        record.cos2 = cos2[i];
+        record.inv_length = inv_length[i];
+        record.reserved = 0.0f;
+
+        return record;
+    }
+
+private:
+    std::vector<std::vector<float>*> arrays() {
+
+        return { &p1_x, &p1_y, &p1_z, &r1, &p2_x, &p2_y, &p2_z, &r2,
+                 &axis_x, &axis_y, &axis_z, &length, &slope, &cos2, &inv_length };
+    }
+};
+
+/// Leaf records stored as structure of arrays for the CPU tracer.
+struct LeafRecords {
+    std::vector<float> n_x, n_y, n_z, n_w;
+    std::vector<float> u_x, u_y, u_z, u_w;
+    std::vector<float> v_x, v_y, v_z, v_w;
+    std::vector<float> ao;          // baked ambient occlusion (1 -> unoccluded), see ao_bake.hpp
+
+    std::size_t size() const {
+
+        return n_w.size();
+    }
+
+    void clear() {
+
+        resize( 0U );
+    }
+
+    void resize(std::size_t const count) {
+
+        for ( std::vector<float>* array : arrays() )
+        {
+            array->resize( count );
+        }
+        ao.resize( count, 1.0f );
+    }
+
+    void set(std::size_t const i, LeafRecord const& record) {
+
+        n_x[i] = record.plane.x; n_y[i] = record.plane.y; n_z[i] = record.plane.z; n_w[i] = record.plane.w;
+        u_x[i] = record.u_plane.x; u_y[i] = record.u_plane.y; u_z[i] = record.u_plane.z; u_w[i] = record.u_plane.w;
+        v_x[i] = record.v_plane.x; v_y[i] = record.v_plane.y; v_z[i] = record.v_plane.z; v_w[i] = record.v_plane.w;
+    }
+
+    LeafRecord operator[](std::size_t const i) const {
+
+        LeafRecord record;
+        record.plane = glm::vec4( n_x[i], n_y[i], n_z[i], n_w[i] );
+        record.u_plane = glm::vec4( u_x[i], u_y[i], u_z[i], u_w[i] );
+        record.v_plane = glm::vec4( v_x[i], v_y[i], v_z[i], v_w[i] );
+
+        return record;
+    }
+
+private:
+    std::vector<std::vector<float>*> arrays() {
+
+        return { &n_x, &n_y, &n_z, &n_w, &u_x, &u_y, &u_z, &u_w, &v_x, &v_y, &v_z, &v_w };
+    }
+};
+
+/// Intersection-ready records of everything a LTurtle generated.
+struct PrimitiveRecords {
+    BranchRecords branches;
+    LeafRecords leaves;
+
+    /// Preprocesses the output of LTurtle (the vectors passed to its constructor).
+    void build(std::vector<Branch> const& branches_in, std::vector<Leaf> const& leaves_in) {
+
+        branches.resize( branches_in.size() );
+        for ( std::size_t i = 0; i < branches_in.size(); ++i )
+        {
+            branches.set( i, make_branch_record( branches_in[i] ) );
+        }
+
+        leaves.resize( leaves_in.size() );
+        for ( std::size_t i = 0; i < leaves_in.size(); ++i )
+        {
+            leaves.set( i, make_leaf_record( leaves_in[i] ) );
+        }
+    }
+
+    /// Branch records in the buffer layout of ray_tracing.frag.
+    std::vector<BranchRecord> branch_buffer() const {
+
+        std::vector<BranchRecord> buffer( branches.size() );
+        for ( std::size_t i = 0; i < buffer.size(); ++i )
+        {
+            buffer[i] = branches[i];
+        }
+
+        return buffer;
+    }
+
+    /// Leaf records in the buffer layout of ray_tracing.frag.
+    std::vector<LeafRecord> leaf_buffer() const {
+
+        std::vector<LeafRecord> buffer( leaves.size() );
+        for ( std::size_t i = 0; i < buffer.size(); ++i )
+        {
+            buffer[i] = leaves[i];
+        }
+
+        return buffer;
+    }
+};
+
+/// Computes an intersection between a ray and a branch (rounded cone).
+/// The ray direction has to be normalized; only hits with t in (0, t_max) count.
+inline bool RayBranchIntersection(Ray const& ray, BranchRecord const& branch, float const t_max, Hit& hit) {
+
+    glm::vec3 oa = ray.origin - branch.p1;
+
+    float m1 = glm::dot( branch.axis, oa );
+    float m2 = glm::dot( branch.axis, ray.direction );
+    float m3 = glm::dot( ray.direction, oa );
+    float m5 = glm::dot( oa, oa );
+    float ra = branch.r1;
+
+    // body (cone between the two spheres)
+    float k2 = branch.cos2 - m2 * m2;
+    float k1 = branch.cos2 * m3 - m1 * m2 + m2 * branch.slope * ra;
+    float k0 = branch.cos2 * m5 - m1 * m1 + 2.0f * m1 * branch.slope * ra - ra * ra;
+    float h = k1 * k1 - k0 * k2;
+
+    if ( h < 0.0f )
+        return false;
+
+    float t = ( -std::sqrt( h ) - k1 ) / k2;
+    float y = m1 - ra * branch.slope + t * m2;
+
+    if ( y > 0.0f && y < branch.length * branch.cos2 )
+    {
+        if ( t <= 0.0f || t >= t_max )
+            return false;
+
+        hit.t = t;
+        hit.normal = glm::normalize( branch.cos2 * ( oa + t * ray.direction ) - branch.axis * y );
+    }
+    else
+    {
+        // caps (the two spheres)
+        glm::vec3 ob = ray.origin - branch.p2;
+        float m6 = glm::dot( ob, ray.direction );
+        float m7 = glm::dot( ob, ob );
+
+        float h1 = m3 * m3 - m5 + ra * ra;
+        float h2 = m6 * m6 - m7 + branch.r2 * branch.r2;
+
+        float best = t_max;
+        glm::vec3 normal;
+
+        if ( h1 > 0.0f )
+        {
+            float t1 = -m3 - std::sqrt( h1 );
+            if ( t1 > 0.0f && t1 < best )
+            {
+                best = t1;
+                normal = ( oa + t1 * ray.direction ) / ra;
+            }
+        }
+        if ( h2 > 0.0f )
+        {
+            float t2 = -m6 - std::sqrt( h2 );
+            if ( t2 > 0.0f && t2 < best )
+            {
+                best = t2;
+                normal = ( ob + t2 * ray.direction ) / branch.r2;
+            }
+        }
+
+        if ( best >= t_max )
+            return false;
+
+        hit.t = best;
+        hit.normal = glm::normalize( normal );
+    }
+
+    hit.intersection = ray.origin + hit.t * ray.direction;
+    hit.kind = Hit::Kind::Branch;
+
+    return true;
+}
+
+/// Computes an intersection between a ray and a leaf (parallelogram).
+/// Only the geometry is tested here, the texture coverage test is up to the caller.
+inline bool RayLeafIntersection(Ray const& ray, LeafRecord const& leaf, float const t_max, Hit& hit) {
+
+    glm::vec3 n = glm::vec3( leaf.plane );
+    float denom = glm::dot( n, ray.direction );
+
+    if ( std::abs( denom ) < 1e-8f )
+        return false;
+
+    float t = -( glm::dot( n, ray.origin ) + leaf.plane.w ) / denom;
+
+    if ( t <= 0.0f || t >= t_max )
+        return false;
+
+    glm::vec3 p = ray.origin + t * ray.direction;
+    float u = glm::dot( glm::vec3( leaf.u_plane ), p ) + leaf.u_plane.w;
+    float v = glm::dot( glm::vec3( leaf.v_plane ), p ) + leaf.v_plane.w;
+
+    if ( u < 0.0f || u > 1.0f || v < 0.0f || v > 1.0f )
+        return false;
+
+    hit.t = t;
+    hit.intersection = p;
+    // the normal always faces the ray (the leaf is two-sided)
+    hit.normal = denom > 0.0f ? -n : n;
+    hit.uv = glm::vec2( u, v );
+    hit.kind = Hit::Kind::Leaf;
+
+    return true;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "sampling.hpp"
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+/// Settings of the irradiance cache.
+struct IrradianceCacheSettings {
+    float cell_size = 0.25f;            // edge of a grid cell in world units
+    std::uint32_t capacity_log2 = 20U;  // the table has 2^capacity_log2 cells
+    std::uint32_t min_samples = 16U;    // paths traced into a cell before it only answers lookups
+};
+
+/// A sparse world-space irradiance cache for multi-bounce light inside canopies.
+/// Cells of a hashed grid over the scene (split by the dominant axis of the normal)
+/// accumulate the radiance of the paths traced from the shading points in them.
+/// A path ends at its second hit, where it reads the cache instead of tracing on,
+/// so light bounces more times the longer the cache warms up. A warm cell costs
+/// a single lookup. The table is lock-free: cells are claimed with a compare-and-swap
+/// of their key and samples are added atomically, so all render threads share it.
+struct IrradianceCache : public IndirectSource {
+
+    explicit IrradianceCache(IrradianceCacheSettings const& settings_ = IrradianceCacheSettings())
+        : settings(settings_)
+        , mask((std::size_t(1) << settings_.capacity_log2) - 1U)
+        , cells(new Cell[std::size_t(1) << settings_.capacity_log2])
+    {}
+
+    glm::vec3 irradiance(Scene const& scene, Hit const& hit, Random* random) const override {
+
+        std::uint64_t key = make_key( hit.intersection, hit.normal );
+        Cell* cell = find( key, true );
+
+        // table full -> no indirect light here
+        if ( cell == nullptr )
+            return glm::vec3(0.0f);
+
+        std::uint32_t count = cell->count.load( std::memory_order_acquire );
+        if ( count >= settings.min_samples )
+            return cell->mean();
+
+        // still warming up -> trace one more path
+        Random local( key ^ count );
+        Random& rng = random != nullptr ? *random : local;
+
+        glm::vec3 radiance = trace_path( scene, hit, rng );
+        cell->add( radiance );
+
+        return cell->mean();
+    }
+
+    /// Number of cells in use.
+    std::size_t used_cells() const {
+
+        std::size_t used = 0U;
+        for ( std::size_t i = 0; i <= mask; ++i )
+        {
+            if ( cells[i].key.load( std::memory_order_relaxed ) != 0U )
+                ++used;
+        }
+
+        return used;
+    }
+
+    /// Empties the cache (not thread-safe, call between frames).
+    void clear() {
+
+        for ( std::size_t i = 0; i <= mask; ++i )
+        {
+            cells[i].key.store( 0U );
+            cells[i].count.store( 0U );
+            for ( std::atomic<float>& channel : cells[i].sum )
+            {
+                channel.store( 0.0f );
+            }
+        }
+    }
+
+private:
+
+    struct Cell {
+        std::atomic<std::uint64_t> key{ 0U };
+        std::atomic<std::uint32_t> count{ 0U };
+        std::atomic<float> sum[3] = { { 0.0f }, { 0.0f }, { 0.0f } };
+
+        void add(glm::vec3 const& radiance) {
+
+            for ( int c = 0; c < 3; ++c )
+            {
+                float old = sum[c].load( std::memory_order_relaxed );
+                while ( !sum[c].compare_exchange_weak( old, old + radiance[c], std::memory_order_relaxed ) ) {}
+            }
+            count.fetch_add( 1U, std::memory_order_release );
+        }
+
+        glm::vec3 mean() const {
+
+            std::uint32_t n = count.load( std::memory_order_acquire );
+            if ( n == 0U )
+                return glm::vec3(0.0f);
+
+            return glm::vec3( sum[0].load( std::memory_order_relaxed ), sum[1].load( std::memory_order_relaxed ),
+                              sum[2].load( std::memory_order_relaxed ) ) / static_cast<float>( n );
+        }
+    };
+
+    /// Grid coordinates (19 bits each) and the normal bucket (3 bits); the top bit
+    /// is set so that 0 can mark empty cells.
+    std::uint64_t make_key(glm::vec3 const& p, glm::vec3 const& n) const {
+
+        glm::vec3 a = glm::abs( n );
+        std::uint64_t bucket = a.x >= a.y && a.x >= a.z ? ( n.x > 0.0f ? 0U : 1U )
+                             : a.y >= a.z ? ( n.y > 0.0f ? 2U : 3U ) : ( n.z > 0.0f ? 4U : 5U );
+
+        auto coordinate = [&](float const v) {
+            std::int64_t c = static_cast<std::int64_t>( std::floor( v / settings.cell_size ) ) + ( 1 << 18 );
+            return static_cast<std::uint64_t>( std::min<std::int64_t>( std::max<std::int64_t>( c, 0 ), ( 1 << 19 ) - 1 ) );
+        };
+
+        return ( 1ULL << 63 ) | ( coordinate( p.x ) << 41 ) | ( coordinate( p.y ) << 22 ) | ( coordinate( p.z ) << 3 ) | bucket;
+    }
+
+    /// Finds the cell of the key with linear probing, optionally claiming an empty one.
+    Cell* find(std::uint64_t const key, bool const insert) const {
+
+        // splitmix64 finalizer
+        std::uint64_t h = key;
+        h = ( h ^ ( h >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+        h = ( h ^ ( h >> 27 ) ) * 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+
+        for ( std::size_t probe = 0; probe < 32U; ++probe )
+        {
+            Cell& cell = cells[( h + probe ) & mask];
+            std::uint64_t current = cell.key.load( std::memory_order_acquire );
+
+            if ( current == key )
+                return &cell;
+
+            if ( current == 0U )
+            {
+                if ( !insert )
+                    return nullptr;
+
+                if ( cell.key.compare_exchange_strong( current, key, std::memory_order_acq_rel ) || current == key )
+                    return &cell;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /// Radiance arriving at the hit from one cosine distributed direction:
+    /// direct light at the next hit plus the cached bounces from there.
+    glm::vec3 trace_path(Scene const& scene, Hit const& hit, Random& random) const {
+
+        const float epsilon = 0.01f;
+
+        glm::vec3 direction = sample_cosine_hemisphere( hit.normal, random.next(), random.next() );
+        Ray ray{ hit.intersection + epsilon * hit.normal, direction };
+        Hit next = Evaluate( scene, ray );
+
+        if ( next.is_miss() )
+            return Sky( scene, direction );
+
+        glm::vec3 material = Material( scene, next );
+        glm::vec3 L = scene.light.direction;
+        float cosine = std::max( glm::dot( next.normal, L ), 0.0f );
+
+        glm::vec3 radiance( 0.0f );
+        if ( cosine > 0.0f && !Occluded( scene, Ray{ next.intersection + epsilon * next.normal, L } ) )
+            radiance = 0.8f * material * scene.light.diffuse * cosine;
+
+        // the bounces beyond come from the cache
+        Cell* cell = find( make_key( next.intersection, next.normal ), false );
+        if ( cell != nullptr )
+            radiance += material * cell->mean();
+
+        return radiance;
+    }
+
+    IrradianceCacheSettings settings;
+    std::size_t mask;
+    std::unique_ptr<Cell[]> cells;
+};
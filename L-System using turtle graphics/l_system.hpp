@@ -1,11 +1,17 @@
 #pragma once
 
 #include "draw_primitives.hpp"
+#include "skeleton.hpp"
+#include "spatial_hash.hpp"
+#include "alloc_profile.hpp"
+#include "determinism.hpp"
+#include "symbols.hpp"
 #include "glm_headers.hpp"
 #include <vector>
 #include <unordered_map>
 #include <string>
 #include <stack>
+#include <algorithm>
 
 /// Representation of the turtle (from the turtle geometry)
 struct TurtleBase {
@@ -65,6 +71,29 @@ struct TurtleBase {
         currentState.up = glm::normalize(newUp);
     }
 
+    /// Turns forward a little towards "step" (a direction scaled by the amount)
+    /// and keeps the frame orthonormal. Cheaper than rotate() for small steps:
+    /// it turns by about |forward x step| radians without building a rotation.
+    void bend(glm::vec3 const& step) {
+
+        glm::vec3 newForward = currentState.forward + step;
+        glm::vec3 newUp = glm::cross( newForward, currentState.left );
+        float upLength = glm::length( newUp );
+
+        // forward would become parallel with left -> leave the frame as it is
+        if ( upLength < 1e-6f )
+            return;
+
+        currentState.forward = glm::normalize( newForward );
+        currentState.up = newUp / upLength;
+        currentState.left = glm::cross( currentState.up, currentState.forward );
+    }
+
+    void set_position(glm::vec3 const& position) {
+
+        currentState.position = position;
+    }
+
     void set_brush_width(float const width) {
         
         if ( width > 0.0 ) 
@@ -128,6 +157,14 @@ struct LTurtle : public TurtleBase {
         float brush_decay_coef;         
                                         
         unsigned int max_depth;         
+
+        // tropism: after every move forward bends towards "tropism" by "susceptibility"
+        // (0 -> off); e.g. gravity is (0, -1, 0)
+        glm::vec3 tropism = glm::vec3(0.0f, -1.0f, 0.0f);
+        float susceptibility = 0.0f;
+
+        // stochastic rules: seed of the choices between the alternatives of a symbol
+        std::uint64_t seed = 0U;
     };
 
     /// A type for rules of a L-system.
@@ -142,84 +179,189 @@ struct LTurtle : public TurtleBase {
         )
         : TurtleBase()
         , cfg(cfg_)
-        , rules(rules_)
+        , rules(compile_rules(rules_))
+        , commands(char_commands())
+        , branches(branches_ref)
+        , leaves(leaves_ref)
+        , tropismStep(cfg_.susceptibility * cfg_.tropism)
+        , tropismEnabled(cfg_.susceptibility != 0.0f && glm::length(cfg_.tropism) > 0.0f)
+    {
+        cover( rules.symbols.data(), rules.symbols.size() );
+        check_balance();
+    }
+
+    /// Construct a turtle for rules over interned symbols; "symbols" tells the turtle
+    /// command of each of them (named tokens without one are skipped like unknown characters).
+    LTurtle(
+        Config const& cfg_,
+        SymbolTable const& symbols,
+        SymbolRules const& rules_,
+        std::vector<Branch>& branches_ref,
+        std::vector<Leaf>& leaves_ref
+        )
+        : TurtleBase()
+        , cfg(cfg_)
+        , rules(compile_rules(rules_))
+        , commands(symbols.command_table())
         , branches(branches_ref)
         , leaves(leaves_ref)
-    {}
+        , tropismStep(cfg_.susceptibility * cfg_.tropism)
+        , tropismEnabled(cfg_.susceptibility != 0.0f && glm::length(cfg_.tropism) > 0.0f)
+    {
+        cover( rules.symbols.data(), rules.symbols.size() );
+        check_balance();
+    }
 
     /// Getter of the config data.
     Config const& config() const { return cfg; }
 
+    /// Records the bracket hierarchy into "skeleton_ptr" while running (nullptr -> off).
+    /// The skeleton is cleared and its root bone rests at the current turtle state (call
+    /// it after set_position()), run() should start from the axiom afterwards.
+    void set_skeleton(Skeleton* skeleton_ptr) {
+
+        skeleton = skeleton_ptr;
+        if ( skeleton != nullptr )
+            skeleton->clear( position(), forward() );
+    }
+
+    /// How a turtle with an environment records the space it grows into.
+    enum class Growth {
+        Insert,     // inserts its branches into the environment
+        Claim,      // leaves the environment alone, claims its branches in "claims" (SpatialHash::claim)
+        Yield,      // records nothing, also treats the cells of "claims" held by a lower owner as occupied
+    };
+
+    /// Makes the turtle sensitive to its environment (nullptr -> off): a branch growing
+    /// into space of "environment" occupied by obstacles or other owners is pruned
+    /// together with the rest of its bracketed subtree, leaves in such space are dropped.
+    /// Emitted branches are inserted into the environment under "owner", or go to "claims"
+    /// as "growth" says (the passes of the deterministic generate_forest()).
+    void set_environment(SpatialHash* environment_ptr, std::uint32_t const owner_id,
+                         Growth const growth_mode = Growth::Insert, SpatialHash* claims_ptr = nullptr) {
+
+        environment = environment_ptr;
+        owner = owner_id;
+        growth = growth_mode;
+        claims = claims_ptr;
+        pruneLevel = 0;
+    }
+
     /// Applies L-system's rules to the passed sentence (axiom) and
     /// generates and saves corresponding geometrical objects by
     /// calling the "process" method.
     void run(std::string const& sentence, unsigned int depth = 0U) {
         
-        if ( depth < config().max_depth )
-        {
-            // apply rules according to unordered_map Rules
-            for ( char c : sentence )
-            {
-                std::unordered_map<char, std::string>::const_iterator foundRule = rules.find(c);
+        AllocPhaseScope phase( AllocPhase::Expansion );
 
-                // if character not found -> process() will discard it
-                if ( foundRule == rules.end() )
-                {
-                    process( c );
-                }
-                else
-                {
-					// recursively lower higher depth
-                    run( foundRule->second, depth + 1 );   
-                }
-            }
-        }
-        else
+        std::vector<Symbol> symbols;
+        symbols.reserve( sentence.size() );
+        for ( char c : sentence )
         {
-            for ( char c : sentence )
-            {
-                process( c );
-            }
+            symbols.push_back( static_cast<unsigned char>( c ) );
         }
+
+        cover( symbols.data(), symbols.size() );
+        expand( symbols.data(), symbols.size(), depth, derive( cfg.seed, runCount++ ) );
+    }
+
+    /// Same as above for a sentence of interned symbols.
+    void run(std::vector<Symbol> const& sentence, unsigned int depth = 0U) {
+
+        cover( sentence.data(), sentence.size() );
+        expand( sentence.data(), sentence.size(), depth, derive( cfg.seed, runCount++ ) );
     }
 
     /// Commands the turtle based on the passed symbol.
     void process(char const symbol) {
+
+        // skip the rest of a pruned subtree, its closing bracket is processed as usual
+        if ( pruneLevel > 0 )
+        {
+            if ( symbol == '[' )
+                ++pruneLevel;
+            else if ( symbol == ']' )
+                --pruneLevel;
+
+            if ( pruneLevel > 0 || symbol != ']' )
+                return;
+        }
+
         switch (symbol)
         {
         case 'L':
-			// create an instance of Leaf and store it in leaves
-            leaves.push_back( Leaf( position(), forward(), left(), 
-                                 glm::vec2( config().leaf_size * brush_width(), config().leaf_size * brush_width() * 2 ) )
-                            );
+			// create an instance of Leaf and store it in leaves (unless it grows into occupied space)
+            if ( !occupied( position() ) )
+            {
+                AllocPhaseScope phase( AllocPhase::OutputGrowth );
+                leaves.push_back( Leaf( position(), forward(), left(), 
+                                     glm::vec2( config().leaf_size * brush_width(), config().leaf_size * brush_width() * 2 ) )
+                                );
+
+                if ( skeleton != nullptr )
+                    skeleton->leaf_bones.push_back( skeleton->current_bone() );
+            }
 
 			// move turtle forward
             move( config().distance * brush_width() );
+            apply_tropism();
 
             break;
         case 'l':
-			// create an instance of Leaf and store it in leaves
-            leaves.push_back( Leaf( position(), forward(), left(), 
-                                 glm::vec2( config().leaf_size * brush_width(), config().leaf_size * brush_width() * 2 ) )
-                            );
+			// create an instance of Leaf and store it in leaves (unless it grows into occupied space)
+            if ( !occupied( position() ) )
+            {
+                AllocPhaseScope phase( AllocPhase::OutputGrowth );
+                leaves.push_back( Leaf( position(), forward(), left(), 
+                                     glm::vec2( config().leaf_size * brush_width(), config().leaf_size * brush_width() * 2 ) )
+                                );
+
+                if ( skeleton != nullptr )
+                    skeleton->leaf_bones.push_back( skeleton->current_bone() );
+            }
 
 			// move turtle forward
             move( config().distance * brush_width() );
+            apply_tropism();
 
             break;
         case 'B':
+            // a branch growing into occupied space prunes its subtree
+            if ( environment != nullptr )
+            {
+                glm::vec3 end = position() + ( config().distance * brush_width() * forward() );
+                if ( occupied_segment( position(), end ) )
+                {
+                    pruneLevel = 1;
+                    break;
+                }
+
+                if ( growth == Growth::Insert )
+                    environment->insert_segment( position(), end, owner );
+                else if ( growth == Growth::Claim )
+                    claims->claim_segment( position(), end, owner );
+            }
+
             // create an instance of Branch and store it in branches
-            branches.push_back( Branch( position(), config().radius * brush_width(), 
-                                       position() + ( config().distance * brush_width() * forward() ), config().brush_decay_coef * config().radius * brush_width() )
-                              );
+            {
+                AllocPhaseScope phase( AllocPhase::OutputGrowth );
+                branches.push_back( Branch( position(), config().radius * brush_width(), 
+                                           position() + ( config().distance * brush_width() * forward() ), config().brush_decay_coef * config().radius * brush_width() )
+                                  );
+
+                if ( skeleton != nullptr )
+                    skeleton->branch_bones.push_back( skeleton->current_bone() );
+            }
 
 			// move turtle forward
             move( config().distance * brush_width() );
+            apply_tropism();
 
             break;
         case 'M':
 			// move turtle forward
             move( config().distance * brush_width() );
+            apply_tropism();
 
             break;
         case '+':
@@ -248,14 +390,24 @@ struct LTurtle : public TurtleBase {
 
             break;
         case '[':
+        {
+            AllocPhaseScope phase( AllocPhase::PushPop );
+
 			// store current turtle state
             push();
 
+            if ( skeleton != nullptr )
+                skeleton->push_bone( position(), forward() );
+
             break;
+        }
         case ']':
 			// retrieve last turtle state
             pop();
 
+            if ( skeleton != nullptr )
+                skeleton->pop_bone();
+
             break;
         default:
             break;
@@ -263,8 +415,150 @@ struct LTurtle : public TurtleBase {
     }
 
 private:
+
+    /// Applies the rules to "length" symbols from "sentence" (a dense table lookup per symbol).
+    /// "position" identifies the sentence in the derivation; the stochastic choice of a symbol
+    /// hashes it with the index of the symbol, so skipping a pruned subtree changes no other choice.
+    void expand(Symbol const* sentence, std::size_t const length, unsigned int const depth, std::uint64_t const position) {
+
+        AllocPhaseScope phase( AllocPhase::Expansion );
+
+        if ( depth < config().max_depth )
+        {
+            for ( std::size_t i = 0; i < length; ++i )
+            {
+                Symbol symbol = sentence[i];
+
+                // if symbol has no rule -> process() will discard it unless it is a command
+                if ( !rules.has( symbol ) )
+                {
+                    process( commands[symbol] );
+                }
+                else if ( pruneLevel > 0 && balancedRules )
+                {
+                    // a balanced expansion cannot close the pruned subtree -> skip it whole
+                }
+                else
+                {
+                    std::uint64_t child = derive( position, i );
+                    std::uint32_t alternative = rules.firsts[symbol];
+                    if ( rules.counts[symbol] > 1U )
+                        alternative = rules.choose( symbol, static_cast<float>( child >> 40 ) * ( 1.0f / 16777216.0f ) );
+
+					// recursively lower higher depth
+                    expand( rules.body( alternative ), rules.length( alternative ), depth + 1, child );
+                }
+            }
+        }
+        else
+        {
+            for ( std::size_t i = 0; i < length; ++i )
+            {
+                process( commands[sentence[i]] );
+            }
+        }
+    }
+
+    /// Compiles the rules to dense tables (attributed to the rule compile phase when profiling allocations).
+    static SymbolRules compile_rules(Rules const& rules_) {
+
+        AllocPhaseScope phase( AllocPhase::RuleCompile );
+        return SymbolRules( rules_ );
+    }
+
+    static SymbolRules compile_rules(SymbolRules const& rules_) {
+
+        AllocPhaseScope phase( AllocPhase::RuleCompile );
+        return rules_;
+    }
+
+    /// Every character is its own command.
+    static std::vector<char> char_commands() {
+
+        std::vector<char> table( 256U );
+        for ( std::size_t c = 0; c < table.size(); ++c )
+        {
+            table[c] = static_cast<char>( c );
+        }
+        return table;
+    }
+
+    /// Grows the command table over every id in "symbols", so expand() can index it unchecked;
+    /// ids the table did not know (e.g. interned after it was copied) are no-ops.
+    void cover(Symbol const* symbols, std::size_t const count) {
+
+        std::size_t size = commands.size();
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            size = std::max( size, static_cast<std::size_t>( symbols[i] ) + 1U );
+        }
+        commands.resize( size, '\0' );
+    }
+
+    /// Rules whose brackets are balanced expand to balanced strings at any depth.
+    void check_balance() {
+
+        balancedRules = true;
+        for ( Symbol head : rules.heads() )
+        {
+            for ( std::uint32_t a = rules.firsts[head]; a < rules.firsts[head] + rules.counts[head]; ++a )
+            {
+                int level = 0;
+                for ( std::uint32_t i = 0; i < rules.length( a ) && level >= 0; ++i )
+                {
+                    char command = commands[rules.body( a )[i]];
+                    level += ( command == '[' ) - ( command == ']' );
+                }
+                balancedRules = balancedRules && level == 0;
+            }
+        }
+    }
+
+    /// Position of the "index"-th symbol of the sentence at "parent" in the derivation
+    /// (splitmix64 over both); its top 24 bits make the stochastic choice of the symbol.
+    static std::uint64_t derive(std::uint64_t const parent, std::uint64_t const index) {
+
+        std::uint64_t z = parent + ( index + 1U ) * 0x9E3779B97F4A7C15ULL;
+        z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+        z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+
+        return z;
+    }
+
+    /// Is the point taken by an obstacle or another owner (false without an environment)?
+    bool occupied(glm::vec3 const& p) const {
+
+        if ( environment == nullptr )
+            return false;
+
+        return environment->occupied( p, owner ) || ( growth == Growth::Yield && claims->claimed_below( p, owner ) );
+    }
+
+    bool occupied_segment(glm::vec3 const& a, glm::vec3 const& b) const {
+
+        return environment->occupied_segment( a, b, owner ) || ( growth == Growth::Yield && claims->claimed_below_segment( a, b, owner ) );
+    }
+
+    void apply_tropism() {
+
+        if ( tropismEnabled )
+            bend( tropismStep );
+    }
+
     Config cfg;                         
-    Rules rules;                        
+    SymbolRules rules;                  
+    std::vector<char> commands;         // turtle command of every symbol id
     std::vector<Branch>& branches;      
     std::vector<Leaf>& leaves;         
+    Skeleton* skeleton = nullptr;
+    glm::vec3 tropismStep;              // precomputed susceptibility * tropism
+    bool tropismEnabled;
+    SpatialHash* environment = nullptr;
+    SpatialHash* claims = nullptr;
+    Growth growth = Growth::Insert;
+    std::uint32_t owner = 0U;
+    int pruneLevel = 0;                 // > 0 while skipping a pruned subtree (bracket nesting inside it)
+    bool balancedRules;
+    std::uint64_t runCount = 0U;        // runs so far, every run derives from its own position
 };
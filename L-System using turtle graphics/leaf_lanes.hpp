@@ -0,0 +1,246 @@
+#pragma once
+
+#include "intersection_records.hpp"
+#include "glm_headers.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+// Tests one ray against several leaves at once: one leaf per lane, the planes of the
+// leaves read from the structure of arrays of LeafRecords. The lane loop has no branches
+// and a fixed width, so the compiler turns it into SIMD code (8 lanes fill an AVX register,
+// 16 an AVX-512 one; build with e.g. -O3 -mavx2). Define LSYSTEM_LEAF_LANES to change the width.
+
+#ifndef LSYSTEM_LEAF_LANES
+#define LSYSTEM_LEAF_LANES 8
+#endif
+
+constexpr std::size_t leaf_lane_count = LSYSTEM_LEAF_LANES;
+static_assert( leaf_lane_count >= 1U && leaf_lane_count <= 32U, "the hit mask has 32 bits" );
+
+/// The planes (see LeafRecord) of consecutive leaves, one pointer per component.
+struct LeafPlanes {
+    float const* n_x; float const* n_y; float const* n_z; float const* n_w;
+    float const* u_x; float const* u_y; float const* u_z; float const* u_w;
+    float const* v_x; float const* v_y; float const* v_z; float const* v_w;
+};
+
+/// The planes of the leaves from "first" on, read in place.
+inline LeafPlanes leaf_planes(LeafRecords const& records, std::size_t const first) {
+
+    return { records.n_x.data() + first, records.n_y.data() + first, records.n_z.data() + first, records.n_w.data() + first,
+             records.u_x.data() + first, records.u_y.data() + first, records.u_z.data() + first, records.u_w.data() + first,
+             records.v_x.data() + first, records.v_y.data() + first, records.v_z.data() + first, records.v_w.data() + first };
+}
+
+/// Planes of up to leaf_lane_count leaves gathered from anywhere in the records (e.g. the
+/// leaves of several BVH nodes); "index" remembers which leaf each lane holds. Lanes past
+/// "count" hold a degenerate leaf no ray hits, so the kernel always runs all lanes.
+struct alignas(64) LeafLanes {
+    float n_x[leaf_lane_count], n_y[leaf_lane_count], n_z[leaf_lane_count], n_w[leaf_lane_count];
+    float u_x[leaf_lane_count], u_y[leaf_lane_count], u_z[leaf_lane_count], u_w[leaf_lane_count];
+    float v_x[leaf_lane_count], v_y[leaf_lane_count], v_z[leaf_lane_count], v_w[leaf_lane_count];
+    std::uint32_t index[leaf_lane_count];
+    std::uint32_t count = 0U;
+
+    /// Gathers the leaves "indices[0 .. count_)" (at most leaf_lane_count).
+    void load(LeafRecords const& records, std::uint32_t const* indices, std::uint32_t const count_) {
+
+        count = count_;
+        for ( std::uint32_t l = 0; l < count; ++l )
+        {
+            std::uint32_t i = indices[l];
+            index[l] = i;
+            n_x[l] = records.n_x[i]; n_y[l] = records.n_y[i]; n_z[l] = records.n_z[i]; n_w[l] = records.n_w[i];
+            u_x[l] = records.u_x[i]; u_y[l] = records.u_y[i]; u_z[l] = records.u_z[i]; u_w[l] = records.u_w[i];
+            v_x[l] = records.v_x[i]; v_y[l] = records.v_y[i]; v_z[l] = records.v_z[i]; v_w[l] = records.v_w[i];
+        }
+        pad();
+    }
+
+    /// Copies the consecutive leaves [first, first + count_) (at most leaf_lane_count).
+    void load_range(LeafRecords const& records, std::size_t const first, std::uint32_t const count_) {
+
+        count = count_;
+        for ( std::uint32_t l = 0; l < count; ++l )
+        {
+            std::size_t i = first + l;
+            index[l] = static_cast<std::uint32_t>( i );
+            n_x[l] = records.n_x[i]; n_y[l] = records.n_y[i]; n_z[l] = records.n_z[i]; n_w[l] = records.n_w[i];
+            u_x[l] = records.u_x[i]; u_y[l] = records.u_y[i]; u_z[l] = records.u_z[i]; u_w[l] = records.u_w[i];
+            v_x[l] = records.v_x[i]; v_y[l] = records.v_y[i]; v_z[l] = records.v_z[i]; v_w[l] = records.v_w[i];
+        }
+        pad();
+    }
+
+    LeafPlanes planes() const {
+
+        return { n_x, n_y, n_z, n_w, u_x, u_y, u_z, u_w, v_x, v_y, v_z, v_w };
+    }
+
+private:
+
+    // the same planes as make_leaf_record() gives a degenerate leaf
+    void pad() {
+
+        for ( std::size_t l = count; l < leaf_lane_count; ++l )
+        {
+            index[l] = 0U;
+            n_x[l] = 0.0f; n_y[l] = 0.0f; n_z[l] = 0.0f; n_w[l] = 0.0f;
+            u_x[l] = 0.0f; u_y[l] = 0.0f; u_z[l] = 0.0f; u_w[l] = -1.0f;
+            v_x[l] = 0.0f; v_y[l] = 0.0f; v_z[l] = 0.0f; v_w[l] = -1.0f;
+        }
+    }
+};
+
+/// Per-lane results of IntersectLeafLanes; lane l hit its leaf when bit l of "mask" is set.
+struct alignas(64) LeafLaneHits {
+    float t[leaf_lane_count];
+    float u[leaf_lane_count];
+    float v[leaf_lane_count];
+    float denom[leaf_lane_count];       // dot(normal, ray direction), tells the side that was hit
+    std::uint32_t mask = 0U;
+};
+
+/// Intersects the ray with leaf_lane_count leaves. A lane hits under the same conditions
+/// as RayLeafIntersection: t in (0, t_max) and the UVs inside [0, 1]. Returns the mask of
+/// the lanes that hit.
+inline std::uint32_t IntersectLeafLanes(Ray const& ray, LeafPlanes const& planes, float const t_max, LeafLaneHits& hits) {
+
+    float const ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+    float const dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+
+    std::int32_t hit[leaf_lane_count];
+
+    for ( std::size_t l = 0; l < leaf_lane_count; ++l )
+    {
+        float denom = planes.n_x[l] * dx + planes.n_y[l] * dy + planes.n_z[l] * dz;
+        float distance = planes.n_x[l] * ox + planes.n_y[l] * oy + planes.n_z[l] * oz + planes.n_w[l];
+
+        // a ray parallel with the leaf may divide by 0, "facing" rejects it (a select
+        // of the divisor instead would keep the compiler from vectorizing the loop)
+        float t = -distance / denom;
+
+        float px = ox + t * dx, py = oy + t * dy, pz = oz + t * dz;
+        float u = planes.u_x[l] * px + planes.u_y[l] * py + planes.u_z[l] * pz + planes.u_w[l];
+        float v = planes.v_x[l] * px + planes.v_y[l] * py + planes.v_z[l] * pz + planes.v_w[l];
+
+        hits.t[l] = t;
+        hits.u[l] = u;
+        hits.v[l] = v;
+        hits.denom[l] = denom;
+
+        std::int32_t facing = std::abs( denom ) >= 1e-8f;
+        std::int32_t inside = ( t > 0.0f ) & ( t < t_max );
+        std::int32_t onLeaf = ( u >= 0.0f ) & ( u <= 1.0f ) & ( v >= 0.0f ) & ( v <= 1.0f );
+        hit[l] = facing & inside & onLeaf;
+    }
+
+    std::uint32_t mask = 0U;
+    for ( std::size_t l = 0; l < leaf_lane_count; ++l )
+    {
+        mask |= static_cast<std::uint32_t>( hit[l] ) << l;
+    }
+
+    hits.mask = mask;
+    return mask;
+}
+
+namespace leaf_lanes_detail {
+
+    /// Replaces "hit" by the closest lane of "hits" that "covered(uv)" accepts; "t_max" follows it.
+    template <typename Covered>
+    bool take_closest(Ray const& ray, LeafPlanes const& planes, LeafLaneHits const& hits, std::uint32_t const* indices,
+                      float& t_max, Hit& hit, Covered& covered) {
+
+        bool found = false;
+
+        for ( std::uint32_t mask = hits.mask; mask != 0U; mask &= mask - 1U )
+        {
+            std::uint32_t l = 0U;
+            while ( ( ( mask >> l ) & 1U ) == 0U )
+            {
+                ++l;
+            }
+
+            glm::vec2 uv( hits.u[l], hits.v[l] );
+            if ( hits.t[l] >= t_max || !covered( uv ) )
+                continue;
+
+            glm::vec3 n( planes.n_x[l], planes.n_y[l], planes.n_z[l] );
+
+            t_max = hits.t[l];
+            hit.t = hits.t[l];
+            hit.intersection = ray.origin + hits.t[l] * ray.direction;
+            // the normal always faces the ray (the leaf is two-sided)
+            hit.normal = hits.denom[l] > 0.0f ? -n : n;
+            hit.uv = uv;
+            hit.kind = Hit::Kind::Leaf;
+            hit.index = indices[l];
+            found = true;
+        }
+
+        return found;
+    }
+
+} // namespace leaf_lanes_detail
+
+/// Closest hit with t in (0, hit.t) among the leaves "indices[0 .. count)" that "covered(uv)"
+/// accepts (e.g. LeafCovered), tested leaf_lane_count at a time. Replaces "hit" when found.
+template <typename Covered>
+bool RayLeavesIntersection(Ray const& ray, LeafRecords const& records, std::uint32_t const* indices, std::size_t const count,
+                           Hit& hit, Covered&& covered) {
+
+    LeafLanes lanes;
+    LeafLaneHits hits;
+    float t_max = hit.t;
+    bool found = false;
+
+    for ( std::size_t first = 0; first < count; first += leaf_lane_count )
+    {
+        std::uint32_t n = static_cast<std::uint32_t>( std::min( leaf_lane_count, count - first ) );
+        lanes.load( records, indices + first, n );
+
+        if ( IntersectLeafLanes( ray, lanes.planes(), t_max, hits ) != 0U )
+            found = leaf_lanes_detail::take_closest( ray, lanes.planes(), hits, lanes.index, t_max, hit, covered ) || found;
+    }
+
+    return found;
+}
+
+/// Same as above for the consecutive leaves [first, first + count), read in place from the records.
+template <typename Covered>
+bool RayLeafRangeIntersection(Ray const& ray, LeafRecords const& records, std::size_t const first, std::size_t const count,
+                              Hit& hit, Covered&& covered) {
+
+    LeafLanes tail;
+    LeafLaneHits hits;
+    std::uint32_t indices[leaf_lane_count];
+    float t_max = hit.t;
+    bool found = false;
+
+    for ( std::size_t begin = first; begin < first + count; begin += leaf_lane_count )
+    {
+        std::size_t n = std::min( leaf_lane_count, first + count - begin );
+        LeafPlanes planes = leaf_planes( records, begin );
+
+        // a partial group is copied out and padded, the kernel reads all lanes
+        if ( n < leaf_lane_count )
+        {
+            tail.load_range( records, begin, static_cast<std::uint32_t>( n ) );
+            planes = tail.planes();
+        }
+
+        if ( IntersectLeafLanes( ray, planes, t_max, hits ) != 0U )
+        {
+            for ( std::size_t l = 0; l < leaf_lane_count; ++l )
+            {
+                indices[l] = static_cast<std::uint32_t>( begin + l );
+            }
+            found = leaf_lanes_detail::take_closest( ray, planes, hits, indices, t_max, hit, covered ) || found;
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,579 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "bvh.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <list>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Treelet files store a forest as self-contained pieces: every treelet has its own
+// records and BVH (primitive ids index its own records), so a treelet is usable as
+// soon as its bytes are mapped. Layout (little endian, as in memory):
+//
+//   TreeletFileHeader, TreeletEntry[treelet_count]      padded to treelet_alignment
+//   treelet 0: BranchRecord[] LeafRecord[] BVH::Node[] uint32 primitives[]
+//                                                       padded to treelet_alignment
+//   treelet 1: ...
+//
+// The alignment is the Windows allocation granularity (a multiple of the page size
+// everywhere), so every treelet can be mapped on its own.
+
+constexpr std::uint64_t treelet_alignment = 65536U;
+
+struct TreeletFileHeader {
+    char magic[8] = { 'L', 'S', 'Y', 'S', 'T', 'R', 'L', '1' };
+    std::uint32_t treelet_count = 0U;
+    std::uint32_t reserved = 0U;
+};
+
+struct TreeletEntry {
+    glm::vec3 minimum;
+    std::uint32_t branch_count;
+    glm::vec3 maximum;
+    std::uint32_t leaf_count;
+    std::uint64_t offset;               // from the start of the file
+    std::uint64_t size;                 // bytes of the records, nodes and primitives
+    std::uint32_t node_count;
+    std::uint32_t primitive_count;
+};
+
+/// Splits the geometry into treelets of at most "max_primitives" primitives (subtrees
+/// of a BVH over everything) and writes them to "path". Throws std::runtime_error when
+/// the file cannot be written.
+inline void write_treelets(std::string const& path, std::vector<Branch> const& branches, std::vector<Leaf> const& leaves,
+                           std::uint32_t const max_primitives = 65536U) {
+
+    PrimitiveRecords all;
+    all.build( branches, leaves );
+    BVH top;
+    top.build( all );
+
+    // primitives below every node, then the largest subtrees that fit
+    std::vector<std::uint32_t> counts( top.nodes.size(), 0U );
+    for ( std::size_t n = top.nodes.size(); n-- > 0; )
+    {
+        BVH::Node const& node = top.nodes[n];
+        counts[n] = node.is_leaf() ? node.count : counts[n + 1] + counts[node.first];
+    }
+
+    std::vector<std::uint32_t> roots, pending;
+    if ( !top.empty() )
+        pending.push_back( 0U );
+
+    while ( !pending.empty() )
+    {
+        std::uint32_t n = pending.back();
+        pending.pop_back();
+
+        if ( counts[n] <= max_primitives || top.nodes[n].is_leaf() )
+        {
+            roots.push_back( n );
+        }
+        else
+        {
+            pending.push_back( top.nodes[n].first );
+            pending.push_back( n + 1U );
+        }
+    }
+
+    std::ofstream file( path, std::ios::binary | std::ios::trunc );
+    if ( !file )
+        throw std::runtime_error( "cannot write " + path );
+
+    auto pad = [&](std::uint64_t const position) {
+        std::uint64_t aligned = ( position + treelet_alignment - 1U ) / treelet_alignment * treelet_alignment;
+        std::vector<char> zeros( static_cast<std::size_t>( aligned - position ), 0 );
+        file.write( zeros.data(), static_cast<std::streamsize>( zeros.size() ) );
+        return aligned;
+    };
+
+    TreeletFileHeader header;
+    header.treelet_count = static_cast<std::uint32_t>( roots.size() );
+    std::vector<TreeletEntry> entries( roots.size() );
+
+    // the directory is written again once the offsets are known
+    file.write( reinterpret_cast<char const*>( &header ), sizeof(header) );
+    file.write( reinterpret_cast<char const*>( entries.data() ), static_cast<std::streamsize>( entries.size() * sizeof(TreeletEntry) ) );
+    std::uint64_t position = pad( sizeof(header) + entries.size() * sizeof(TreeletEntry) );
+
+    for ( std::size_t t = 0; t < roots.size(); ++t )
+    {
+        // gather the primitives of the subtree (contiguous in "top.primitives")
+        std::vector<Branch> localBranches;
+        std::vector<Leaf> localLeaves;
+        std::vector<std::uint32_t> stack( 1U, roots[t] );
+
+        while ( !stack.empty() )
+        {
+            BVH::Node const& node = top.nodes[stack.back()];
+            std::uint32_t n = stack.back();
+            stack.pop_back();
+
+            if ( !node.is_leaf() )
+            {
+                stack.push_back( node.first );
+                stack.push_back( n + 1U );
+                continue;
+            }
+
+            for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+            {
+                std::uint32_t id = top.primitives[i];
+                std::uint32_t index = id & 0x3FFFFFFFU;
+
+                if ( ( id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+                    localBranches.push_back( branches[index] );
+                else
+                    localLeaves.push_back( leaves[index] );
+            }
+        }
+
+        PrimitiveRecords records;
+        records.build( localBranches, localLeaves );
+        BVH bvh;
+        bvh.build( records );
+
+        for ( std::size_t i = 0; i < records.branches.size(); ++i )
+        {
+            BranchRecord record = records.branches[i];
+            file.write( reinterpret_cast<char const*>( &record ), sizeof(record) );
+        }
+        for ( std::size_t i = 0; i < records.leaves.size(); ++i )
+        {
+            LeafRecord record = records.leaves[i];
+            file.write( reinterpret_cast<char const*>( &record ), sizeof(record) );
+        }
+        file.write( reinterpret_cast<char const*>( bvh.nodes.data() ), static_cast<std::streamsize>( bvh.nodes.size() * sizeof(BVH::Node) ) );
+        file.write( reinterpret_cast<char const*>( bvh.primitives.data() ), static_cast<std::streamsize>( bvh.primitives.size() * sizeof(std::uint32_t) ) );
+
+        TreeletEntry& entry = entries[t];
+        entry.minimum = bvh.nodes[0].minimum;
+        entry.maximum = bvh.nodes[0].maximum;
+        entry.branch_count = static_cast<std::uint32_t>( records.branches.size() );
+        entry.leaf_count = static_cast<std::uint32_t>( records.leaves.size() );
+        entry.node_count = static_cast<std::uint32_t>( bvh.nodes.size() );
+        entry.primitive_count = static_cast<std::uint32_t>( bvh.primitives.size() );
+        entry.offset = position;
+        entry.size = entry.branch_count * sizeof(BranchRecord) + entry.leaf_count * sizeof(LeafRecord)
+                   + entry.node_count * sizeof(BVH::Node) + entry.primitive_count * sizeof(std::uint32_t);
+
+        position = pad( position + entry.size );
+    }
+
+    file.seekp( 0 );
+    file.write( reinterpret_cast<char const*>( &header ), sizeof(header) );
+    file.write( reinterpret_cast<char const*>( entries.data() ), static_cast<std::streamsize>( entries.size() * sizeof(TreeletEntry) ) );
+
+    if ( !file )
+        throw std::runtime_error( "cannot write " + path );
+}
+
+/// A mapped treelet: pointers into the file.
+struct TreeletView {
+    BranchRecord const* branches = nullptr;
+    LeafRecord const* leaves = nullptr;
+    BVH::Node const* nodes = nullptr;
+    std::uint32_t const* primitives = nullptr;
+};
+
+/// Maps treelets on demand and keeps at most "budget" bytes of them resident,
+/// unmapping the least recently used ones. acquire() is not thread-safe: call it
+/// from one thread, the returned view may be read by any number of threads until
+/// the next acquire().
+struct TreeletCache {
+
+    TreeletCache(std::string const& path, std::uint64_t const budget_)
+        : budget(budget_)
+    {
+#ifdef _WIN32
+        file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr );
+        if ( file == INVALID_HANDLE_VALUE )
+            throw std::runtime_error( "cannot open " + path );
+        mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+        if ( mapping == nullptr )
+        {
+            CloseHandle( file );
+            throw std::runtime_error( "cannot map " + path );
+        }
+#else
+        file = open( path.c_str(), O_RDONLY );
+        if ( file < 0 )
+            throw std::runtime_error( "cannot open " + path );
+#endif
+
+        // the directory is small -> read it
+        std::ifstream in( path, std::ios::binary );
+        TreeletFileHeader header;
+        in.read( reinterpret_cast<char*>( &header ), sizeof(header) );
+        if ( !in || std::memcmp( header.magic, TreeletFileHeader().magic, sizeof(header.magic) ) != 0 )
+        {
+            close_file();
+            throw std::runtime_error( path + " is not a treelet file" );
+        }
+
+        entries.resize( header.treelet_count );
+        in.read( reinterpret_cast<char*>( entries.data() ), static_cast<std::streamsize>( entries.size() * sizeof(TreeletEntry) ) );
+        if ( !in )
+        {
+            close_file();
+            throw std::runtime_error( "truncated treelet file " + path );
+        }
+
+        slots.resize( entries.size() );
+    }
+
+    ~TreeletCache() {
+
+        for ( std::uint32_t t = 0; t < slots.size(); ++t )
+        {
+            if ( slots[t].base != nullptr )
+                unmap( t );
+        }
+        close_file();
+    }
+
+    TreeletCache(TreeletCache const&) = delete;
+    TreeletCache& operator=(TreeletCache const&) = delete;
+
+    std::size_t size() const {
+
+        return entries.size();
+    }
+
+    TreeletEntry const& entry(std::size_t const t) const {
+
+        return entries[t];
+    }
+
+    /// Maps the treelet (if it is not resident) and marks it as the most recently used.
+    TreeletView acquire(std::uint32_t const t) {
+
+        Slot& slot = slots[t];
+
+        if ( slot.base != nullptr )
+        {
+            lru.splice( lru.begin(), lru, slot.position );
+            return slot.view;
+        }
+
+        // make room, the treelet itself is mapped even when it alone exceeds the budget
+        while ( !lru.empty() && resident + entries[t].size > budget )
+        {
+            unmap( lru.back() );
+        }
+
+        map( t );
+        lru.push_front( t );
+        slot.position = lru.begin();
+        ++loadCount;
+        mappedBytes += entries[t].size;
+
+        return slot.view;
+    }
+
+    /// Number of times a treelet was mapped.
+    std::uint64_t loads() const {
+
+        return loadCount;
+    }
+
+    /// Bytes mapped over all loads.
+    std::uint64_t mapped_bytes() const {
+
+        return mappedBytes;
+    }
+
+    /// Bytes of the treelets mapped now.
+    std::uint64_t resident_bytes() const {
+
+        return resident;
+    }
+
+private:
+
+    struct Slot {
+        void* base = nullptr;           // start of the mapping (the treelet offset is aligned)
+        TreeletView view;
+        std::list<std::uint32_t>::iterator position;
+    };
+
+    void map(std::uint32_t const t) {
+
+        TreeletEntry const& entry = entries[t];
+        Slot& slot = slots[t];
+
+#ifdef _WIN32
+        slot.base = MapViewOfFile( mapping, FILE_MAP_READ, static_cast<DWORD>( entry.offset >> 32 ),
+                                   static_cast<DWORD>( entry.offset & 0xFFFFFFFFU ), static_cast<SIZE_T>( entry.size ) );
+        if ( slot.base == nullptr )
+            throw std::runtime_error( "cannot map a treelet" );
+#else
+        void* base = mmap( nullptr, static_cast<std::size_t>( entry.size ), PROT_READ, MAP_SHARED, file, static_cast<off_t>( entry.offset ) );
+        if ( base == MAP_FAILED )
+            throw std::runtime_error( "cannot map a treelet" );
+        slot.base = base;
+#endif
+
+        char const* bytes = static_cast<char const*>( slot.base );
+        slot.view.branches = reinterpret_cast<BranchRecord const*>( bytes );
+        bytes += entry.branch_count * sizeof(BranchRecord);
+        slot.view.leaves = reinterpret_cast<LeafRecord const*>( bytes );
+        bytes += entry.leaf_count * sizeof(LeafRecord);
+        slot.view.nodes = reinterpret_cast<BVH::Node const*>( bytes );
+        bytes += entry.node_count * sizeof(BVH::Node);
+        slot.view.primitives = reinterpret_cast<std::uint32_t const*>( bytes );
+
+        resident += entry.size;
+    }
+
+    void unmap(std::uint32_t const t) {
+
+        Slot& slot = slots[t];
+
+#ifdef _WIN32
+        UnmapViewOfFile( slot.base );
+#else
+        munmap( slot.base, static_cast<std::size_t>( entries[t].size ) );
+#endif
+
+        lru.erase( slot.position );
+        slot.base = nullptr;
+        slot.view = TreeletView();
+        resident -= entries[t].size;
+    }
+
+    void close_file() {
+
+#ifdef _WIN32
+        if ( mapping != nullptr )
+            CloseHandle( mapping );
+        if ( file != INVALID_HANDLE_VALUE )
+            CloseHandle( file );
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if ( file >= 0 )
+            close( file );
+        file = -1;
+#endif
+    }
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int file = -1;
+#endif
+
+    std::uint64_t budget;
+    std::uint64_t resident = 0U;
+    std::uint64_t loadCount = 0U;
+    std::uint64_t mappedBytes = 0U;
+    std::vector<TreeletEntry> entries;
+    std::vector<Slot> slots;
+    std::list<std::uint32_t> lru;       // most recently used first
+};
+
+/// Renders a treelet file with one ray per pixel. Rays are traced in waves (primary rays,
+/// then shadow rays): each wave queues the rays at every treelet whose bounds they enter,
+/// and the treelets are then visited one after another (closest to the camera first) with
+/// all their queued rays traced in parallel, so a treelet is mapped once per wave no matter
+/// how many rays need it. Rays stopped by a closer treelet are dropped from the queues of the
+/// ones behind it before those are mapped. "look" provides the light, colors and textures (its geometry is unused).
+inline void render_out_of_core(TreeletCache& cache, Scene const& look, Camera const& camera, Image& image,
+                               unsigned int const threads = 0U) {
+
+    const float epsilon = 0.01f;
+
+    struct RayState {
+        Ray ray;
+        float t_max;
+        Hit hit;
+        glm::vec3 material;
+        bool occluded;
+    };
+
+    std::size_t pixelCount = static_cast<std::size_t>( image.width ) * image.height;
+    std::vector<RayState> states( pixelCount );
+
+    parallel_for( pixelCount, threads, [&](std::size_t const i) {
+        int x = static_cast<int>( i % image.width ), y = static_cast<int>( i / image.width );
+        RayState& state = states[i];
+
+        state.ray = camera.generate_ray( x + 0.5f, y + 0.5f, image.width, image.height );
+        state.hit = Hit();
+        RayPlaneIntersection( state.ray, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f), state.hit.t, state.hit );
+        state.t_max = state.hit.t;
+        state.material = look.ground_color;
+        state.occluded = false;
+    } );
+
+    // treelets front to back
+    std::vector<std::uint32_t> order( cache.size() );
+    for ( std::uint32_t t = 0; t < order.size(); ++t )
+    {
+        order[t] = t;
+    }
+    std::sort( order.begin(), order.end(), [&](std::uint32_t const a, std::uint32_t const b) {
+        glm::vec3 ca = 0.5f * ( cache.entry( a ).minimum + cache.entry( a ).maximum );
+        glm::vec3 cb = 0.5f * ( cache.entry( b ).minimum + cache.entry( b ).maximum );
+        return glm::length( ca - camera.position ) < glm::length( cb - camera.position );
+    } );
+
+    std::vector<std::vector<std::uint32_t>> queues( cache.size() );
+
+    // whether the ray enters the treelet before its current t_max
+    auto reaches = [&](std::size_t const t, RayState const& state) {
+        BVH::Node bounds;
+        bounds.minimum = cache.entry( t ).minimum;
+        bounds.maximum = cache.entry( t ).maximum;
+
+        return BVH::enter( bounds, state.ray.origin, 1.0f / state.ray.direction, state.t_max ) != std::numeric_limits<float>::infinity();
+    };
+
+    // queues the rays that reach every treelet
+    auto enqueue = [&](std::vector<std::uint32_t> const& active) {
+        parallel_for( cache.size(), threads, [&](std::size_t const t) {
+            queues[t].clear();
+            for ( std::uint32_t i : active )
+            {
+                if ( reaches( t, states[i] ) )
+                    queues[t].push_back( i );
+            }
+        } );
+    };
+
+    // drops the queued rays that a closer treelet has stopped short of "t" (or occluded),
+    // a treelet no ray reaches any more is not mapped
+    auto prune = [&](std::uint32_t const t) {
+        std::vector<std::uint32_t>& queue = queues[t];
+        queue.erase( std::remove_if( queue.begin(), queue.end(), [&](std::uint32_t const i) {
+            return states[i].occluded || !reaches( t, states[i] );
+        } ), queue.end() );
+
+        return !queue.empty();
+    };
+
+    // wave 1: closest hits
+    std::vector<std::uint32_t> active( pixelCount );
+    for ( std::uint32_t i = 0; i < active.size(); ++i )
+    {
+        active[i] = i;
+    }
+    enqueue( active );
+
+    for ( std::uint32_t t : order )
+    {
+        if ( !prune( t ) )
+            continue;
+
+        TreeletView view = cache.acquire( t );
+        std::vector<std::uint32_t> const& queue = queues[t];
+
+        parallel_for( queue.size(), threads, [&](std::size_t const q) {
+            RayState& state = states[queue[q]];
+            Ray const& ray = state.ray;
+
+            BVH::traverse( view.nodes, view.primitives, ray, state.t_max, [&](std::uint32_t const id) {
+                std::uint32_t index = id & 0x3FFFFFFFU;
+                Hit candidate;
+
+                if ( ( id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+                {
+                    if ( RayBranchIntersection( ray, view.branches[index], state.t_max, candidate ) )
+                    {
+                        state.hit = candidate;
+                        state.t_max = candidate.t;
+                        state.material = BranchMaterial( look, view.branches[index], candidate.intersection,
+                                                         candidate.t * ray.spread );
+                    }
+                }
+                else if ( RayLeafIntersection( ray, view.leaves[index], state.t_max, candidate ) && LeafCovered( look, candidate.uv ) )
+                {
+                    state.hit = candidate;
+                    state.t_max = candidate.t;
+                    state.material = LeafMaterial( look, view.leaves[index], candidate.uv, candidate.t * ray.spread );
+                }
+
+                return false;
+            } );
+        } );
+    }
+
+    // wave 2: shadow rays from the lit points
+    glm::vec3 L = look.light.direction;
+    active.clear();
+    for ( std::uint32_t i = 0; i < pixelCount; ++i )
+    {
+        RayState& state = states[i];
+        if ( state.hit.is_miss() || glm::dot( state.hit.normal, L ) <= 0.0f )
+            continue;
+
+        state.ray = Ray{ state.hit.intersection + epsilon * state.hit.normal, L };
+        state.t_max = 1e20f;
+        active.push_back( i );
+    }
+    enqueue( active );
+
+    for ( std::uint32_t t : order )
+    {
+        if ( !prune( t ) )
+            continue;
+
+        TreeletView view = cache.acquire( t );
+        std::vector<std::uint32_t> const& queue = queues[t];
+
+        parallel_for( queue.size(), threads, [&](std::size_t const q) {
+            RayState& state = states[queue[q]];
+            Ray const& ray = state.ray;
+            BVH::traverse( view.nodes, view.primitives, ray, state.t_max, [&](std::uint32_t const id) {
+                std::uint32_t index = id & 0x3FFFFFFFU;
+                Hit candidate;
+
+                if ( ( id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+                    state.occluded = RayBranchIntersection( ray, view.branches[index], state.t_max, candidate );
+                else
+                    state.occluded = RayLeafIntersection( ray, view.leaves[index], state.t_max, candidate ) && LeafCovered( look, candidate.uv );
+
+                return state.occluded;
+            } );
+        } );
+    }
+
+    // shading as in Trace(): ambient, Lambert and 20 % of it in shadow
+    parallel_for( pixelCount, threads, [&](std::size_t const i) {
+        RayState const& state = states[i];
+        int x = static_cast<int>( i % image.width ), y = static_cast<int>( i / image.width );
+
+        if ( state.hit.is_miss() )
+        {
+            image.at( x, y ) = Sky( look, camera.generate_ray( x + 0.5f, y + 0.5f, image.width, image.height ).direction );
+            return;
+        }
+
+        glm::vec3 color = 0.2f * state.material + 0.8f * state.material * look.light.diffuse * std::max( glm::dot( state.hit.normal, L ), 0.0f );
+        if ( state.occluded )
+            color = 0.2f * color;
+
+        image.at( x, y ) = color;
+    } );
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+
+/// Number of worker threads to use for "requested" (0 -> all hardware threads).
+inline unsigned int thread_count(unsigned int const requested = 0U) {
+
+    if ( requested > 0U )
+        return requested;
+
+    return std::max( std::thread::hardware_concurrency(), 1U );
+}
+
+/// Calls "task(i)" for every i in [0, count) on a pool of threads.
+/// The items are handed out one by one, so uneven items (tiles, trees) balance themselves.
+template <typename Task>
+void parallel_for(std::size_t const count, unsigned int const threads, Task&& task) {
+
+    unsigned int workers = static_cast<unsigned int>( std::min<std::size_t>( thread_count( threads ), count ) );
+
+    if ( workers <= 1U )
+    {
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            task( i );
+        }
+        return;
+    }
+
+    std::atomic<std::size_t> next( 0U );
+    auto worker = [&]() {
+        for ( std::size_t i = next++; i < count; i = next++ )
+        {
+            task( i );
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve( workers - 1U );
+    for ( unsigned int t = 1U; t < workers; ++t )
+    {
+        pool.emplace_back( worker );
+    }
+
+    // the calling thread works too
+    worker();
+
+    for ( std::thread& thread : pool )
+    {
+        thread.join();
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// Hardware events read around a benchmark.
+enum class PerfEvent {
+    Cycles,
+    Instructions,
+    CacheMisses,        // last level cache
+    BranchMisses,
+    TLBMisses,          // data TLB read misses
+};
+
+constexpr std::size_t perf_event_count = 5U;
+
+/// Counts of one measurement; an event that could not be counted is not "valid".
+struct PerfReading {
+    std::array<std::uint64_t, perf_event_count> values{};
+    std::array<bool, perf_event_count> valid{};
+
+    bool has(PerfEvent const event) const {
+
+        return valid[static_cast<std::size_t>( event )];
+    }
+
+    std::uint64_t operator[](PerfEvent const event) const {
+
+        return values[static_cast<std::size_t>( event )];
+    }
+
+    /// Instructions per cycle (0 when either is missing).
+    double ipc() const {
+
+        if ( !has( PerfEvent::Cycles ) || !has( PerfEvent::Instructions ) || values[0] == 0U )
+            return 0.0;
+
+        return static_cast<double>( ( *this )[PerfEvent::Instructions] ) / static_cast<double>( ( *this )[PerfEvent::Cycles] );
+    }
+};
+
+/// Linux perf_event counters of the calling process (user space only) including the
+/// threads it starts after construction. Every event is opened on its own, so the
+/// ones the kernel, the hardware or the container (perf_event_paranoid, seccomp) refuse
+/// are just missing from the readings; elsewhere than on Linux nothing is counted.
+struct PerfCounters {
+
+    PerfCounters() {
+
+        descriptors.fill( -1 );
+
+#ifdef __linux__
+        const std::uint32_t types[perf_event_count] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+        };
+        const std::uint64_t configs[perf_event_count] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_DTLB | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 )
+        };
+
+        for ( std::size_t e = 0; e < perf_event_count; ++e )
+        {
+            perf_event_attr attr;
+            std::memset( &attr, 0, sizeof(attr) );
+            attr.size = sizeof(attr);
+            attr.type = types[e];
+            attr.config = configs[e];
+            attr.disabled = 1;
+            attr.inherit = 1;               // count the worker threads of parallel_for
+            attr.exclude_kernel = 1;        // allowed with perf_event_paranoid <= 2
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            descriptors[e] = static_cast<int>( syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 ) );
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+
+#ifdef __linux__
+        for ( int fd : descriptors )
+        {
+            if ( fd >= 0 )
+                close( fd );
+        }
+#endif
+    }
+
+    PerfCounters(PerfCounters const&) = delete;
+    PerfCounters& operator=(PerfCounters const&) = delete;
+
+    /// Tells whether at least one event can be counted.
+    bool available() const {
+
+        for ( int fd : descriptors )
+        {
+            if ( fd >= 0 )
+                return true;
+        }
+        return false;
+    }
+
+    /// Resets and starts all events.
+    void start() {
+
+#ifdef __linux__
+        for ( int fd : descriptors )
+        {
+            if ( fd < 0 )
+                continue;
+
+            ioctl( fd, PERF_EVENT_IOC_RESET, 0 );
+            ioctl( fd, PERF_EVENT_IOC_ENABLE, 0 );
+        }
+#endif
+    }
+
+    /// Stops all events and reads them (scaled up when the kernel multiplexed them).
+    PerfReading stop() {
+
+        PerfReading reading;
+
+#ifdef __linux__
+        for ( std::size_t e = 0; e < perf_event_count; ++e )
+        {
+            int fd = descriptors[e];
+            if ( fd < 0 )
+                continue;
+
+            ioctl( fd, PERF_EVENT_IOC_DISABLE, 0 );
+
+            // value, time enabled, time running
+            std::uint64_t data[3] = { 0U, 0U, 0U };
+            if ( read( fd, data, sizeof(data) ) != static_cast<ssize_t>( sizeof(data) ) || data[2] == 0U )
+                continue;
+
+            reading.values[e] = data[2] < data[1]
+                              ? static_cast<std::uint64_t>( static_cast<double>( data[0] ) * data[1] / data[2] )
+                              : data[0];
+            reading.valid[e] = true;
+        }
+#endif
+
+        return reading;
+    }
+
+private:
+    std::array<int, perf_event_count> descriptors;
+};
@@ -0,0 +1,330 @@
+// Performance regression gate: runs the benchmarks and compares them with a stored baseline.
+//
+//   perf_gate [--baseline <file>] [--update] [--repetitions <n>] [--alpha <p>] [--threshold <fraction>]
+//
+// --update writes the times of this run as the new baseline. The exit code is 1 when
+// a benchmark got significantly slower, the output changed with the thread count
+// (generation and rendering are hashed at 1, 2, 8 and 64 threads), a grammar loaded from a
+// grammar pack generates other geometry than the parsed grammar it was written from, the
+// intersection records disagree with the naive tests (intersection_check.hpp), the leaf
+// lanes find other closest hits than the scalar leaf test, the denoised frame is not closer
+// to the reference than the noisy one, the temporal reuse over a camera path traces more
+// than half of the pixels per frame or drops below 33 dB against tracing them all, the
+// bounced light of the irradiance cache drops below 30 dB against tracing the bounces, the
+// frame rendered out of core drops below 40 dB against render(), or the rasterized preview
+// shows what the primary rays hit in less than 90% of the tree pixels, 0 otherwise.
+// Build it with optimizations, e.g.
+//   g++ -O2 -std=c++17 perf_gate.cpp -o perf_gate -pthread
+// (add -O3 -mavx2 or -march=native to vectorize the leaf lanes of leaf_lanes.hpp).
+// With -DLSYSTEM_ALLOC_PROFILE it also prints the heap traffic of one generation per phase.
+
+#ifdef LSYSTEM_ALLOC_PROFILE
+#define LSYSTEM_ALLOC_PROFILE_IMPLEMENTATION
+#include "alloc_profile.hpp"
+#endif
+
+#include "perf_gate.hpp"
+#include "determinism.hpp"
+#include "forest_generation.hpp"
+#include "intersection_check.hpp"
+#include "tree_query.hpp"
+#include "benchmark.hpp"
+#include "l_system.hpp"
+#include "grammar.hpp"
+#include "ray_tracing.hpp"
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+
+    std::string baselinePath = "perf_baseline.txt";
+    bool update = false;
+    int repetitions = 15;
+    GateSettings settings;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if ( arg == "--baseline" && hasValue )
+            baselinePath = argv[++i];
+        else if ( arg == "--update" )
+            update = true;
+        else if ( arg == "--repetitions" && hasValue )
+            repetitions = std::max( std::atoi( argv[++i] ), 2 );
+        else if ( arg == "--alpha" && hasValue )
+            settings.alpha = std::atof( argv[++i] );
+        else if ( arg == "--threshold" && hasValue )
+            settings.threshold = std::atof( argv[++i] );
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--baseline <file>] [--update] [--repetitions <n>] [--alpha <p>] [--threshold <fraction>]\n";
+            return 2;
+        }
+    }
+
+    // a bushy test tree
+    LTurtle::Config config{ 0.1f, 1.0f, 0.3f, glm::radians( 35.0f ), glm::radians( 25.0f ), 0.75f, 6U };
+    LTurtle::Rules rules = { { 'X', "B[&+*X][&-*X][^*X]*L" } };
+    std::string axiom = "BBX";
+
+    std::vector<BenchmarkResult> results;
+    results.push_back( benchmark_generation( "generation", config, rules, axiom, repetitions ) );
+
+    // the same tree bending towards gravity after every move (the overhead of tropism)
+    LTurtle::Config bent = config;
+    bent.susceptibility = 0.2f;
+    results.push_back( benchmark_generation( "generation_tropism", bent, rules, axiom, repetitions ) );
+
+    // the same kind of tree from a text grammar (a named token and a stochastic rule),
+    // round-tripped through a grammar pack and loaded from it
+    std::vector<Grammar> grammars( 2 );
+    std::string grammarText = "name = oak\naxiom = BBX\nmax_depth = 6\n{Internode} = B\n"
+                              "X -> B[&+*X][&-*X][^*X]*{Internode}L\nX (0.25) -> B[^*X]*L\n";
+    bool grammarsParsed = parse_grammar( grammarText, grammars[0] ) && parse_grammar( grammarText + "name = bent oak\nsusceptibility = 0.2\nseed = 7\n", grammars[1] );
+
+    std::string packPath = "perf_gate_grammars.pack";
+    write_grammar_pack( packPath, grammars );
+    bool packSame = false;
+    results.push_back( benchmark_grammar_pack( "grammar_pack_load", packPath, grammars, 5000, packSame, repetitions ) );
+    std::remove( packPath.c_str() );
+    packSame = packSame && grammarsParsed;
+
+    std::vector<Branch> branches;
+    std::vector<Leaf> leaves;
+
+#ifdef LSYSTEM_ALLOC_PROFILE
+    reset_alloc_stats();
+#endif
+
+    LTurtle turtle( config, rules, branches, leaves );
+    turtle.run( axiom );
+
+#ifdef LSYSTEM_ALLOC_PROFILE
+    std::cout << "heap traffic of one generation\n";
+    print_alloc_stats( std::cout );
+    std::cout << '\n';
+#endif
+
+    // the same tree swaying in the wind (posing the bones and the primitives)
+    Skeleton skeleton;
+    std::vector<Branch> restBranches;
+    std::vector<Leaf> restLeaves;
+    LTurtle skinned( config, rules, restBranches, restLeaves );
+    skinned.set_skeleton( &skeleton );
+    skinned.run( axiom );
+    results.push_back( benchmark_wind( "wind_deform", skeleton, restBranches, restLeaves, 100, repetitions ) );
+
+    Scene scene;
+    scene.build( branches, leaves );
+
+    Camera camera;
+    camera.position = glm::vec3(0.0f, 4.0f, 12.0f);
+    camera.target = glm::vec3(0.0f, 3.0f, 0.0f);
+
+    RenderSettings single;
+    single.threads = 1U;
+    results.push_back( benchmark_render( "render_1_thread", scene, camera, 160, 120, single, repetitions ) );
+
+    RenderSettings parallel;
+    results.push_back( benchmark_render( "render_all_threads", scene, camera, 320, 240, parallel, repetitions ) );
+
+    // the same frame from a treelet file mapped on demand, at most a quarter of its treelets at a time
+    std::string treeletPath = "perf_gate_treelets.bin";
+    write_treelets( treeletPath, branches, leaves, 128U );
+    std::uint64_t treeletFileBytes = static_cast<std::uint64_t>( std::ifstream( treeletPath, std::ios::binary | std::ios::ate ).tellg() );
+    std::uint64_t treeletBytes = 0U;
+    std::size_t treeletCount = 0U;
+    {
+        TreeletCache directory( treeletPath, 0U );
+        treeletCount = directory.size();
+        for ( std::size_t t = 0; t < treeletCount; ++t )
+        {
+            treeletBytes += directory.entry( t ).size;
+        }
+    }
+    std::uint64_t treeletBudget = treeletBytes / 4U;
+    std::uint64_t treeletLoads = 0U, treeletMapped = 0U;
+    float outOfCorePsnr = 0.0f;
+    results.push_back( benchmark_out_of_core( "render_out_of_core", treeletPath, treeletBudget, scene, camera, 320, 240,
+                                              treeletLoads, treeletMapped, outOfCorePsnr, repetitions ) );
+    std::remove( treeletPath.c_str() );
+
+    // the same frame lit by bounced light from an irradiance cache, and its error against tracing the bounces
+    float cachePsnr = 0.0f, ambientPsnr = 0.0f;
+    results.push_back( benchmark_irradiance_cache( "render_irradiance_cache", scene, camera, 160, 120, IrradianceCacheSettings(),
+                                                   parallel, cachePsnr, ambientPsnr, repetitions ) );
+
+    // the same frame as a rasterized preview, and how often it shows what the primary rays hit
+    double rasterAgreement = 0.0;
+    results.push_back( benchmark_raster( "raster_preview", scene, branches, leaves, camera, 320, 240, RasterSettings(),
+                                         rasterAgreement, repetitions ) );
+
+    // the same frame with the shadow rays of every tile traced in pixel order and sorted
+    SortedRenderSettings unsorted;
+    results.push_back( benchmark_render_sorted( "render_unsorted_shadows", scene, camera, 320, 240, unsorted, repetitions ) );
+
+    SortedRenderSettings sorted;
+    sorted.sort = true;
+    results.push_back( benchmark_render_sorted( "render_sorted_shadows", scene, camera, 320, 240, sorted, repetitions ) );
+
+    // the same frame with the shadows looked up in cascaded shadow maps instead of traced
+    ShadowMapSettings mapSettings;
+    mapSettings.resolution = 1024;
+    mapSettings.cascades = 3;
+    ShadowMap shadowMap;
+    results.push_back( benchmark_shadow_map( "shadow_map_build", shadowMap, mapSettings, scene, branches, leaves, camera, 320, 240, repetitions ) );
+
+    scene.shadows = &shadowMap;
+    results.push_back( benchmark_render( "render_shadow_map", scene, camera, 320, 240, parallel, repetitions ) );
+
+    // the error of the map against the shadow rays (everything else is shaded the same way)
+    Image mapped( 320, 240 ), traced( 320, 240 );
+    render( scene, camera, mapped, parallel );
+    scene.shadows = nullptr;
+    render( scene, camera, traced, parallel );
+    float shadowPsnr = psnr( mapped, traced );
+
+    // a noisy frame (2 samples under a soft light) denoised, and its error against 64 samples
+    scene.light.angular_radius = 0.05f;
+    RenderSettings noisySettings;
+    noisySettings.samples = 2;
+    RenderSettings referenceSettings;
+    referenceSettings.samples = 64;
+
+    Image noisy( 320, 240 ), denoised, reference( 320, 240 );
+    GBuffer gbuffer;
+    render( scene, camera, noisy, noisySettings, &gbuffer );
+    render( scene, camera, reference, referenceSettings );
+    scene.light.angular_radius = 0.0f;
+
+    BenchmarkResult denoiser = benchmark_denoiser( "denoise", noisy, gbuffer, denoised, DenoiserSettings(), repetitions );
+    results.push_back( denoiser );
+    float noisyPsnr = psnr( noisy, reference );
+    float denoisedPsnr = psnr( denoised, reference );
+
+    // a fly-through reusing the previous frame: its rays per frame and its error against tracing every frame
+    double temporalRays = 0.0;
+    float temporalPsnr = 0.0f;
+    results.push_back( benchmark_temporal( "temporal_path", scene, camera_path( camera, 30, 0.01f, 0.1f ), 160, 120,
+                                           TemporalSettings(), temporalRays, temporalPsnr, repetitions ) );
+
+    // a noisy 1024 x 1024 texture, 4 MB at the finest level, looked up at random and in scanline order
+    std::vector<unsigned char> texels( 1024U * 1024U * 4U );
+    Random noise( 7U );
+    for ( unsigned char& texel : texels )
+    {
+        texel = static_cast<unsigned char>( noise.next_uint() );
+    }
+    Texture2D texture( 1024, 1024, texels.data() );
+
+    results.push_back( benchmark_texture( "texture_incoherent", texture, benchmark_uvs( 1U << 18, false ), 0.0f, repetitions ) );
+    results.push_back( benchmark_texture( "texture_coherent", texture, benchmark_uvs( 1U << 18, true ), 0.0f, repetitions ) );
+
+    // physics style queries at random points in the box of the tree: the nearest branch,
+    // and segments across the box (most of them pass through the crown)
+    TreeQuery query;
+    query.build( branches, leaves );
+    BVH::Node const& root = query.bvh.nodes[0];
+    Random places( 5U );
+    auto place = [&]() {
+        return root.minimum + glm::vec3( places.next(), places.next(), places.next() ) * ( root.maximum - root.minimum );
+    };
+
+    std::vector<glm::vec3> from, to;
+    for ( int i = 0; i < 1 << 16; ++i )
+    {
+        from.push_back( place() );
+        to.push_back( place() );
+    }
+
+    results.push_back( benchmark_nearest_branches( "nearest_branches", query, from, 0U, repetitions ) );
+    results.push_back( benchmark_segment_casts( "segment_casts", query, from, to, 0U, repetitions ) );
+
+    std::size_t scalarMismatches = 0U, laneMismatches = 0U;
+    results.push_back( benchmark_leaf_tests( "leaf_tests_scalar", scene, camera, 64, 48, false, scalarMismatches, repetitions ) );
+    results.push_back( benchmark_leaf_tests( "leaf_tests_lanes", scene, camera, 64, 48, true, laneMismatches, repetitions ) );
+
+    for ( BenchmarkResult const& result : results )
+    {
+        print_result( std::cout, result );
+    }
+    std::cout << "raster preview: same primitive as the primary ray in " << 100.0 * rasterAgreement << "% of the tree pixels\n"
+              << "irradiance cache against path traced bounces: PSNR " << cachePsnr << " dB (ambient term "
+              << ambientPsnr << " dB)\n"
+              << "out of core: " << treeletLoads << " loads of " << treeletCount << " treelets, " << treeletMapped / 1024U
+              << " KB mapped under a budget of " << treeletBudget / 1024U << " KB (treelets "
+              << treeletBytes / 1024U << " KB, file " << treeletFileBytes / 1024U << " KB), PSNR against render() " << outOfCorePsnr << " dB\n"
+              << "shadow map against shadow rays: PSNR " << shadowPsnr << " dB\n"
+              << "denoiser: " << 1e3 / denoiser.throughput() << " ms per megapixel, PSNR against 64 samples "
+              << noisyPsnr << " dB noisy, " << denoisedPsnr << " dB denoised\n"
+              << "temporal reuse: " << temporalRays << " rays per frame of " << 160 * 120 << " pixels, worst frame "
+              << temporalPsnr << " dB against tracing every pixel\n\n";
+
+    // the output must not depend on the thread count: competing trees and a rendered frame
+    std::vector<unsigned int> threadCounts = { 1U, 2U, 8U, 64U };
+
+    std::vector<TreeSpec> trees;
+    for ( int i = 0; i < 8; ++i )
+    {
+        trees.push_back( TreeSpec{ config, rules, axiom, glm::vec3( 1.5f * ( i % 4 ), 0.0f, 1.5f * ( i / 4 ) ) } );
+    }
+    SpatialHash environment;
+
+    bool forestSame = same_across_threads( threadCounts, [&](unsigned int const threads) {
+        environment.clear();
+        GeneratedForest forest = generate_forest( trees, &environment, threads, true );
+        return hash_geometry( forest.branches, forest.leaves );
+    } );
+
+    bool renderSame = same_across_threads( threadCounts, [&](unsigned int const threads) {
+        RenderSettings settings;
+        settings.samples = 2;
+        settings.threads = threads;
+        Image image( 160, 120 );
+        render( scene, camera, image, settings );
+        return hash_image( image );
+    } );
+
+    std::cout << "deterministic generation: " << ( forestSame ? "yes" : "NO" ) << '\n'
+              << "deterministic rendering:  " << ( renderSame ? "yes" : "NO" ) << '\n'
+              << "grammar pack round trip:  " << ( packSame ? "yes" : "NO" ) << "\n\n";
+
+    // random rays at the test tree, the records have to give what the naive tests give
+    IntersectionCheck check = check_intersection_records( branches, leaves, 100000U );
+
+    std::cout << "intersection records: " << check.rays << " rays, " << check.hits << " hits compared, "
+              << check.grazing << " grazing, " << check.degenerate_leaves << " degenerate leaves, "
+              << check.mismatches << " mismatches\n"
+              << "leaf lanes against scalar leaf tests: " << scalarMismatches + laneMismatches << " closest hits differ\n\n";
+
+    if ( !forestSame || !renderSame || !packSame || !check.passed() || scalarMismatches + laneMismatches > 0U
+         || denoisedPsnr <= noisyPsnr || temporalRays > 0.5 * 160 * 120 || temporalPsnr < 33.0f
+         || cachePsnr < 30.0f || outOfCorePsnr < 40.0f || rasterAgreement < 0.9 )
+        return 1;
+
+    if ( update )
+    {
+        if ( !write_baseline( baselinePath, results ) )
+        {
+            std::cerr << "cannot write " << baselinePath << '\n';
+            return 2;
+        }
+        std::cout << "baseline written to " << baselinePath << '\n';
+        return 0;
+    }
+
+    std::map<std::string, std::vector<double>> baseline = read_baseline( baselinePath );
+    if ( baseline.empty() )
+    {
+        std::cout << "no baseline in " << baselinePath << ", run with --update first\n";
+        return 0;
+    }
+
+    return gate( results, baseline, std::cout, settings ) ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "benchmark.hpp"
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+
+/// Thresholds of the regression gate.
+struct GateSettings {
+    double alpha = 0.01;            // significance of the Mann-Whitney test
+    double threshold = 0.05;        // relative change of the median time that matters
+};
+
+enum class Verdict {
+    Same,
+    Faster,
+    Slower,
+};
+
+/// A benchmark compared with its baseline (times in seconds, changes relative to the baseline median).
+struct Comparison {
+    std::string name;
+    double baseline_median = 0.0;
+    double current_median = 0.0;
+    double change = 0.0;            // Hodges-Lehmann estimate of the shift / baseline median
+    double change_low = 0.0;        // 95 % confidence interval of the change
+    double change_high = 0.0;
+    double p_value = 1.0;
+    Verdict verdict = Verdict::Same;
+};
+
+inline double median_of(std::vector<double> values) {
+
+    if ( values.empty() )
+        return 0.0;
+
+    std::sort( values.begin(), values.end() );
+    std::size_t n = values.size();
+    return n % 2 == 1 ? values[n / 2] : 0.5 * ( values[n / 2 - 1] + values[n / 2] );
+}
+
+/// Two-sided p-value of the Mann-Whitney U test (normal approximation with tie and continuity corrections).
+inline double mann_whitney_p(std::vector<double> const& a, std::vector<double> const& b) {
+
+    std::size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    if ( n1 == 0U || n2 == 0U )
+        return 1.0;
+
+    // ranks of the pooled samples, ties get their average rank
+    std::vector<std::pair<double, int>> pooled;
+    for ( double v : a )
+    {
+        pooled.emplace_back( v, 0 );
+    }
+    for ( double v : b )
+    {
+        pooled.emplace_back( v, 1 );
+    }
+    std::sort( pooled.begin(), pooled.end() );
+
+    double rankSumA = 0.0, tieTerm = 0.0;
+    for ( std::size_t i = 0; i < n; )
+    {
+        std::size_t j = i;
+        while ( j < n && pooled[j].first == pooled[i].first )
+        {
+            ++j;
+        }
+
+        double rank = 0.5 * ( i + 1 + j );      // average of the ranks i + 1 ... j
+        for ( std::size_t k = i; k < j; ++k )
+        {
+            if ( pooled[k].second == 0 )
+                rankSumA += rank;
+        }
+
+        double t = static_cast<double>( j - i );
+        tieTerm += t * t * t - t;
+        i = j;
+    }
+
+    double u = rankSumA - 0.5 * n1 * ( n1 + 1 );
+    double mean = 0.5 * n1 * n2;
+    double variance = n1 * n2 / 12.0 * ( ( n + 1 ) - tieTerm / ( static_cast<double>( n ) * ( n - 1 ) ) );
+
+    if ( variance <= 0.0 )
+        return 1.0;
+
+    double z = std::max( std::abs( u - mean ) - 0.5, 0.0 ) / std::sqrt( variance );
+    return std::erfc( z / std::sqrt( 2.0 ) );
+}
+
+/// Compares the times of a benchmark with its baseline times.
+inline Comparison compare_samples(std::string const& name, std::vector<double> const& baseline, std::vector<double> const& current,
+                                  GateSettings const& settings = GateSettings()) {
+
+    Comparison c;
+    c.name = name;
+    c.baseline_median = median_of( baseline );
+    c.current_median = median_of( current );
+    c.p_value = mann_whitney_p( baseline, current );
+
+    if ( baseline.empty() || current.empty() || c.baseline_median <= 0.0 )
+        return c;
+
+    // Hodges-Lehmann shift and its distribution-free confidence interval from the pairwise differences
+    std::vector<double> differences;
+    differences.reserve( baseline.size() * current.size() );
+    for ( double b : baseline )
+    {
+        for ( double x : current )
+        {
+            differences.push_back( x - b );
+        }
+    }
+    std::sort( differences.begin(), differences.end() );
+
+    double n1 = static_cast<double>( baseline.size() ), n2 = static_cast<double>( current.size() );
+    double k = 0.5 * n1 * n2 - 1.959964 * std::sqrt( n1 * n2 * ( n1 + n2 + 1.0 ) / 12.0 );
+    std::size_t low = static_cast<std::size_t>( std::max( std::floor( k ), 0.0 ) );
+    std::size_t high = differences.size() - 1U - std::min( low, differences.size() - 1U );
+
+    c.change = median_of( differences ) / c.baseline_median;
+    c.change_low = differences[std::min( low, high )] / c.baseline_median;
+    c.change_high = differences[high] / c.baseline_median;
+
+    if ( c.p_value < settings.alpha && c.change > settings.threshold )
+        c.verdict = Verdict::Slower;
+    else if ( c.p_value < settings.alpha && c.change < -settings.threshold )
+        c.verdict = Verdict::Faster;
+
+    return c;
+}
+
+/// Reads a baseline: one line per benchmark, "name time time ..." (seconds); the name has no spaces.
+inline std::map<std::string, std::vector<double>> read_baseline(std::string const& path) {
+
+    std::map<std::string, std::vector<double>> baseline;
+    std::ifstream in( path );
+    std::string line;
+
+    while ( std::getline( in, line ) )
+    {
+        std::istringstream fields( line );
+        std::string name;
+        if ( !( fields >> name ) || name[0] == '#' )
+            continue;
+
+        double seconds;
+        while ( fields >> seconds )
+        {
+            baseline[name].push_back( seconds );
+        }
+    }
+
+    return baseline;
+}
+
+/// Writes the times of the results as a baseline, false when the file cannot be written.
+inline bool write_baseline(std::string const& path, std::vector<BenchmarkResult> const& results) {
+
+    std::ofstream out( path );
+    if ( !out )
+        return false;
+
+    out << "# benchmark times in seconds\n" << std::setprecision( 9 );
+    for ( BenchmarkResult const& result : results )
+    {
+        out << result.name;
+        for ( double s : result.seconds )
+        {
+            out << ' ' << s;
+        }
+        out << '\n';
+    }
+
+    return static_cast<bool>( out );
+}
+
+/// Compares all results with the baseline and prints the report. Returns false when
+/// any benchmark got slower (benchmarks missing from the baseline are reported, not failed).
+inline bool gate(std::vector<BenchmarkResult> const& results, std::map<std::string, std::vector<double>> const& baseline,
+                 std::ostream& out, GateSettings const& settings = GateSettings()) {
+
+    bool pass = true;
+
+    out << std::left << std::setw( 24 ) << "benchmark" << std::right << std::setw( 12 ) << "base ms" << std::setw( 12 ) << "now ms"
+        << std::setw( 10 ) << "change" << std::setw( 22 ) << "95 % interval" << std::setw( 10 ) << "p" << "  verdict\n";
+
+    for ( BenchmarkResult const& result : results )
+    {
+        auto found = baseline.find( result.name );
+        if ( found == baseline.end() )
+        {
+            out << std::left << std::setw( 24 ) << result.name << std::right << "  no baseline\n";
+            continue;
+        }
+
+        Comparison c = compare_samples( result.name, found->second, result.seconds, settings );
+        char const* verdict = c.verdict == Verdict::Slower ? "FAIL (slower)" : c.verdict == Verdict::Faster ? "faster" : "same";
+        pass = pass && c.verdict != Verdict::Slower;
+
+        std::ostringstream interval;
+        interval << std::showpos << std::fixed << std::setprecision( 1 ) << c.change_low * 100.0 << "% .. " << c.change_high * 100.0 << "%";
+
+        out << std::left << std::setw( 24 ) << c.name << std::right << std::fixed << std::setprecision( 3 )
+            << std::setw( 12 ) << c.baseline_median * 1e3 << std::setw( 12 ) << c.current_median * 1e3
+            << std::setw( 9 ) << std::showpos << std::setprecision( 1 ) << c.change * 100.0 << "%" << std::noshowpos
+            << std::setw( 22 ) << interval.str() << std::setw( 10 ) << std::setprecision( 4 ) << c.p_value
+            << "  " << verdict << '\n';
+    }
+
+    out << ( pass ? "PASS" : "FAIL" ) << '\n';
+    return pass;
+}
@@ -0,0 +1,201 @@
+// Python module "lsystem": runs LTurtle without leaving the interpreter and exposes the
+// generated branches and leaves as NumPy arrays that view the C++ vectors (no copies).
+// Build with pybind11, with setup.py ("python setup.py build_ext --inplace", then run
+// test_python_bindings.py) or by hand, e.g.
+//   c++ -O2 -shared -std=c++17 -fPIC $(python3 -m pybind11 --includes) python_bindings.cpp \
+//       -o lsystem$(python3-config --extension-suffix) -pthread
+//
+//   import lsystem
+//   grammar = lsystem.Grammar.from_text(open("oak.txt").read())
+//   trees = lsystem.generate_many([grammar] * 100, threads=8)
+//   trees[0].p1            # (n, 3) float32 view of Branch::p1, alive as long as any view is
+
+#include "l_system.hpp"
+#include "grammar.hpp"
+#include "parallel.hpp"
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstddef>
+
+namespace py = pybind11;
+
+// the views below assume the tightly packed float layouts of the shader structs
+static_assert( sizeof(Branch) == 8U * sizeof(float), "Branch is expected to be p1, r1, p2, r2" );
+static_assert( sizeof(Leaf) == 16U * sizeof(float), "Leaf is expected to be four vec4" );
+
+/// Output of one generation. Python only reads it, so the vectors never reallocate
+/// while arrays view them; every array keeps the Geometry alive through its base.
+struct Geometry {
+    std::vector<Branch> branches;
+    std::vector<Leaf> leaves;
+};
+
+/// Runs the grammar; called without the GIL.
+static std::shared_ptr<Geometry> generate_geometry(Grammar const& grammar) {
+
+    std::shared_ptr<Geometry> geometry = std::make_shared<Geometry>();
+    LTurtle turtle( grammar.config, grammar.symbols, grammar.rules, geometry->branches, geometry->leaves );
+    turtle.run( grammar.axiom );
+
+    return geometry;
+}
+
+/// A float32 view of "count" elements "stride" bytes apart, starting "offset" bytes into "data";
+/// "columns" floats per element (0 -> a 1D array).
+static py::array float_view(py::object const& owner, void const* data, std::size_t const count, std::size_t const stride,
+                            std::size_t const offset, std::size_t const columns) {
+
+    float const* first = reinterpret_cast<float const*>( static_cast<char const*>( data ) + offset );
+
+    std::vector<py::ssize_t> shape = { static_cast<py::ssize_t>( count ) };
+    std::vector<py::ssize_t> strides = { static_cast<py::ssize_t>( stride ) };
+    if ( columns > 0U )
+    {
+        shape.push_back( static_cast<py::ssize_t>( columns ) );
+        strides.push_back( static_cast<py::ssize_t>( sizeof(float) ) );
+    }
+
+    py::array view( py::dtype::of<float>(), shape, strides, first, owner );
+
+    // the geometry is immutable from Python
+    view.attr( "setflags" )( py::arg( "write" ) = false );
+    return view;
+}
+
+static Grammar grammar_from_text(std::string const& text) {
+
+    Grammar grammar;
+    std::size_t line = 0U;
+    if ( !parse_grammar( text, grammar, &line ) )
+        throw py::value_error( "bad grammar statement on line " + std::to_string( line ) );
+
+    return grammar;
+}
+
+PYBIND11_MODULE(lsystem, m) {
+
+    m.doc() = "L-system generation with zero-copy NumPy access to the branches and leaves";
+
+    py::class_<LTurtle::Config>( m, "Config" )
+        .def( py::init( [](float radius, float distance, float leaf_size, float angle_world_y, float angle_turtle_left,
+                           float brush_decay_coef, unsigned int max_depth, std::uint64_t seed) {
+                  LTurtle::Config config{ radius, distance, leaf_size, angle_world_y, angle_turtle_left, brush_decay_coef, max_depth };
+                  config.seed = seed;
+                  return config;
+              } ),
+              py::arg( "radius" ) = 0.1f, py::arg( "distance" ) = 1.0f, py::arg( "leaf_size" ) = 0.3f,
+              py::arg( "angle_world_y" ) = glm::radians( 35.0f ), py::arg( "angle_turtle_left" ) = glm::radians( 25.0f ),
+              py::arg( "brush_decay_coef" ) = 0.75f, py::arg( "max_depth" ) = 6U, py::arg( "seed" ) = 0U )
+        .def_readwrite( "radius", &LTurtle::Config::radius )
+        .def_readwrite( "distance", &LTurtle::Config::distance )
+        .def_readwrite( "leaf_size", &LTurtle::Config::leaf_size )
+        .def_readwrite( "angle_world_y", &LTurtle::Config::angle_world_y, "radians" )
+        .def_readwrite( "angle_turtle_left", &LTurtle::Config::angle_turtle_left, "radians" )
+        .def_readwrite( "brush_decay_coef", &LTurtle::Config::brush_decay_coef )
+        .def_readwrite( "max_depth", &LTurtle::Config::max_depth )
+        .def_readwrite( "susceptibility", &LTurtle::Config::susceptibility )
+        .def_readwrite( "seed", &LTurtle::Config::seed )
+        .def_property( "tropism",
+                       [](LTurtle::Config const& c) { return py::make_tuple( c.tropism.x, c.tropism.y, c.tropism.z ); },
+                       [](LTurtle::Config& c, std::vector<float> const& xyz) {
+                           if ( xyz.size() != 3U )
+                               throw py::value_error( "tropism needs 3 components" );
+                           c.tropism = glm::vec3( xyz[0], xyz[1], xyz[2] );
+                       } );
+
+    py::class_<Grammar>( m, "Grammar" )
+        .def( py::init( [](LTurtle::Config const& config, std::unordered_map<char, std::string> const& rules, std::string const& axiom) {
+                  Grammar grammar;
+                  grammar.config = config;
+                  grammar.rules = SymbolRules( rules );
+                  grammar.axiom.clear();
+                  grammar.symbols.parse( axiom, grammar.axiom );
+                  return grammar;
+              } ),
+              py::arg( "config" ), py::arg( "rules" ), py::arg( "axiom" ),
+              "A grammar of single-character rules, e.g. Grammar(Config(), {'X': 'B[+X]L'}, 'BX')" )
+        .def_static( "from_text", &grammar_from_text, py::arg( "text" ), "Parses the text grammar format of grammar.hpp" )
+        .def_readwrite( "name", &Grammar::name )
+        .def_readwrite( "config", &Grammar::config );
+
+    py::class_<GrammarPack>( m, "GrammarPack" )
+        .def( py::init<std::string const&>(), py::arg( "path" ) )
+        .def( "__len__", &GrammarPack::grammar_count )
+        .def( "__getitem__", [](GrammarPack const& pack, std::size_t const index) {
+            if ( index >= pack.grammar_count() )
+                throw py::index_error();
+
+            Grammar grammar;
+            if ( !pack.load( index, grammar ) )
+                throw py::value_error( "damaged grammar record " + std::to_string( index ) );
+            return grammar;
+        } );
+
+    m.def( "write_grammar_pack", &write_grammar_pack, py::arg( "path" ), py::arg( "grammars" ) );
+
+    // every property is a view into the vectors, its base keeps the Geometry alive
+    py::class_<Geometry, std::shared_ptr<Geometry>>( m, "Geometry" )
+        .def_property_readonly( "branch_count", [](Geometry const& g) { return g.branches.size(); } )
+        .def_property_readonly( "leaf_count", [](Geometry const& g) { return g.leaves.size(); } )
+        .def_property_readonly( "branches", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.branches.data(), g.branches.size(), sizeof(Branch), 0U, 8U );
+        }, "(n, 8) float32: p1.xyz, r1, p2.xyz, r2" )
+        .def_property_readonly( "p1", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.branches.data(), g.branches.size(), sizeof(Branch), offsetof(Branch, p1), 3U );
+        } )
+        .def_property_readonly( "r1", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.branches.data(), g.branches.size(), sizeof(Branch), offsetof(Branch, r1), 0U );
+        } )
+        .def_property_readonly( "p2", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.branches.data(), g.branches.size(), sizeof(Branch), offsetof(Branch, p2), 3U );
+        } )
+        .def_property_readonly( "r2", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.branches.data(), g.branches.size(), sizeof(Branch), offsetof(Branch, r2), 0U );
+        } )
+        .def_property_readonly( "leaves", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.leaves.data(), g.leaves.size(), sizeof(Leaf), 0U, 16U );
+        }, "(n, 16) float32: position, direction, up, size (vec4 each)" )
+        .def_property_readonly( "leaf_position", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.leaves.data(), g.leaves.size(), sizeof(Leaf), offsetof(Leaf, position), 3U );
+        } )
+        .def_property_readonly( "leaf_direction", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.leaves.data(), g.leaves.size(), sizeof(Leaf), offsetof(Leaf, direction), 3U );
+        } )
+        .def_property_readonly( "leaf_up", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.leaves.data(), g.leaves.size(), sizeof(Leaf), offsetof(Leaf, up), 3U );
+        } )
+        .def_property_readonly( "leaf_size", [](py::object self) {
+            Geometry const& g = self.cast<Geometry const&>();
+            return float_view( self, g.leaves.data(), g.leaves.size(), sizeof(Leaf), offsetof(Leaf, size), 2U );
+        } );
+
+    m.def( "generate", [](Grammar const& grammar) {
+        py::gil_scoped_release release;
+        return generate_geometry( grammar );
+    }, py::arg( "grammar" ), "Generates one tree without holding the GIL" );
+
+    m.def( "generate_many", [](std::vector<Grammar> const& grammars, unsigned int const threads) {
+        std::vector<std::shared_ptr<Geometry>> trees( grammars.size() );
+        {
+            py::gil_scoped_release release;
+            parallel_for( grammars.size(), threads, [&](std::size_t const i) {
+                trees[i] = generate_geometry( grammars[i] );
+            } );
+        }
+        return trees;
+    }, py::arg( "grammars" ), py::arg( "threads" ) = 0U,
+       "Generates the trees on a pool of threads (0 -> all hardware threads) without holding the GIL" );
+}
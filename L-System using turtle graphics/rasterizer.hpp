@@ -0,0 +1,437 @@
+#pragma once
+
+#include "draw_primitives.hpp"
+#include "ray_tracing.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+/// The view the rasterizer projects to, either perspective (from a Camera)
+/// or orthographic (e.g. from a light).
+struct RasterView {
+    glm::vec3 origin;               // eye (perspective) or center of the view plane (orthographic)
+    glm::vec3 right;
+    glm::vec3 up;
+    glm::vec3 forward;
+    int width = 0;
+    int height = 0;
+    bool orthographic = false;
+    float scale = 1.0f;             // focal length in pixels (perspective) or pixels per world unit (orthographic)
+    float near = 0.01f;             // closest depth drawn
+
+    /// A perspective view matching the primary rays of the tracer for the camera.
+    static RasterView from_camera(Camera const& camera, int const width_, int const height_) {
+
+        RasterView view;
+        view.origin = camera.position;
+        camera.basis( view.right, view.up, view.forward );
+        view.width = width_;
+        view.height = height_;
+        view.scale = 0.5f * height_ / std::tan( 0.5f * camera.fov_y );
+
+        return view;
+    }
+
+    /// An orthographic view looking along "direction" covering "extent" world units horizontally.
+    static RasterView orthographic_view(glm::vec3 const& center, glm::vec3 const& direction, float const extent,
+                                        int const width_, int const height_) {
+
+        RasterView view;
+        view.forward = glm::normalize( direction );
+        glm::vec3 helper = std::abs( view.forward.y ) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+        view.right = glm::normalize( glm::cross( view.forward, helper ) );
+        view.up = glm::cross( view.right, view.forward );
+        view.origin = center;
+        view.width = width_;
+        view.height = height_;
+        view.orthographic = true;
+        view.scale = width_ / extent;
+        view.near = -std::numeric_limits<float>::max();
+
+        return view;
+    }
+
+    /// Transforms a world position to (x, y) in pixels and the depth along forward.
+    glm::vec3 project(glm::vec3 const& p) const {
+
+        glm::vec3 d = p - origin;
+        float depth = glm::dot( d, forward );
+        float s = orthographic ? scale : scale / depth;
+
+        return glm::vec3( 0.5f * width + glm::dot( d, right ) * s, 0.5f * height - glm::dot( d, up ) * s, depth );
+    }
+
+    /// Pixels per world unit at the depth.
+    float pixels_per_unit(float const depth) const {
+
+        return orthographic ? scale : scale / depth;
+    }
+};
+
+/// Settings of the software rasterizer.
+struct RasterSettings {
+    unsigned int threads = 0U;      // 0 -> all hardware threads
+    int tile_size = 32;
+    bool shade = true;              // false -> only depth and primitive ids (shadow maps)
+    bool ground = true;             // draw the ground plane like the tracer does (perspective only)
+};
+
+/// Output of the rasterizer.
+/// Depth is the distance along the view direction, ids are Hit::id() values.
+struct RasterTarget {
+    Image color;
+    std::vector<float> depth;
+    std::vector<std::uint32_t> ids;
+
+    void resize(int const width, int const height) {
+
+        color = Image( width, height );
+        depth.assign( static_cast<std::size_t>( width ) * height, std::numeric_limits<float>::max() );
+        ids.assign( static_cast<std::size_t>( width ) * height, Hit::make_id( Hit::Kind::Miss, 0U ) );
+    }
+};
+
+/// A multithreaded tile-binned software rasterizer for previews of LTurtle output.
+/// Branches are drawn as screen-space capsules (a ray-cast tube per pixel),
+/// leaves as alpha-tested quads, both with the lambert term of the tracer (no shadows).
+struct Rasterizer {
+
+    explicit Rasterizer(RasterSettings const& settings_ = RasterSettings())
+        : settings(settings_)
+    {}
+
+    void draw(Scene const& scene, std::vector<Branch> const& branches, std::vector<Leaf> const& leaves,
+              RasterView const& view, RasterTarget& target) {
+
+        target.resize( view.width, view.height );
+
+        tilesX = ( view.width + settings.tile_size - 1 ) / settings.tile_size;
+        tilesY = ( view.height + settings.tile_size - 1 ) / settings.tile_size;
+
+        setup( branches, leaves, view );
+        bin( view );
+
+        parallel_for( static_cast<std::size_t>( tilesX ) * tilesY, settings.threads, [&](std::size_t const tile) {
+            draw_tile( scene, view, static_cast<int>( tile ), target );
+        } );
+    }
+
+private:
+
+    /// A primitive after projection (capsule or quad).
+    struct Projected {
+        glm::vec2 minimum;
+        glm::vec2 maximum;
+        std::uint32_t id;
+
+        // capsule: screen endpoints, screen radii, depths and world radii
+        // quad: four screen corners (xy) with depth (z)
+        glm::vec3 a, b, c, d;
+        float ra, rb, wa, wb;
+        glm::vec3 normal;           // quad normal (world space)
+    };
+
+    void setup(std::vector<Branch> const& branches, std::vector<Leaf> const& leaves, RasterView const& view) {
+
+        projected.clear();
+        projected.reserve( branches.size() + leaves.size() );
+
+        for ( std::size_t i = 0; i < branches.size(); ++i )
+        {
+            Branch const& branch = branches[i];
+            glm::vec3 p1 = branch.p1, p2 = branch.p2;
+            float r1 = branch.r1, r2 = branch.r2;
+
+            float z1 = glm::dot( p1 - view.origin, view.forward );
+            float z2 = glm::dot( p2 - view.origin, view.forward );
+
+            if ( z1 < view.near && z2 < view.near )
+                continue;
+
+            // clip the axis at the near plane
+            if ( z1 < view.near || z2 < view.near )
+            {
+                float s = ( view.near - z1 ) / ( z2 - z1 );
+                glm::vec3 p = glm::mix( p1, p2, s );
+                float r = r1 + ( r2 - r1 ) * s;
+                if ( z1 < view.near ) { p1 = p; r1 = r; } else { p2 = p; r2 = r; }
+            }
+
+            Projected prim;
+            prim.id = Hit::make_id( Hit::Kind::Branch, static_cast<std::uint32_t>( i ) );
+            prim.a = view.project( p1 );
+            prim.b = view.project( p2 );
+            prim.wa = r1;
+            prim.wb = r2;
+            prim.ra = r1 * view.pixels_per_unit( prim.a.z );
+            prim.rb = r2 * view.pixels_per_unit( prim.b.z );
+            prim.minimum = glm::min( glm::vec2( prim.a ) - prim.ra, glm::vec2( prim.b ) - prim.rb );
+            prim.maximum = glm::max( glm::vec2( prim.a ) + prim.ra, glm::vec2( prim.b ) + prim.rb );
+
+            if ( visible( prim, view ) )
+                projected.push_back( prim );
+        }
+
+        for ( std::size_t i = 0; i < leaves.size(); ++i )
+        {
+            Leaf const& leaf = leaves[i];
+
+            // same parallelogram as make_leaf_record
+            glm::vec3 edgeU = glm::vec3( leaf.up ) * leaf.size.x;
+            glm::vec3 edgeV = glm::vec3( leaf.direction ) * leaf.size.y;
+            glm::vec3 corner = glm::vec3( leaf.position ) - 0.5f * edgeU;
+            glm::vec3 corners[4] = { corner, corner + edgeU, corner + edgeU + edgeV, corner + edgeV };
+
+            Projected prim;
+            prim.id = Hit::make_id( Hit::Kind::Leaf, static_cast<std::uint32_t>( i ) );
+
+            bool clipped = false;
+            glm::vec3* screen[4] = { &prim.a, &prim.b, &prim.c, &prim.d };
+            for ( int k = 0; k < 4; ++k )
+            {
+                *screen[k] = view.project( corners[k] );
+                clipped = clipped || screen[k]->z < view.near;
+            }
+
+            // leaves crossing the near plane are small enough to be dropped
+            if ( clipped )
+                continue;
+
+            prim.normal = glm::normalize( glm::cross( edgeU, edgeV ) );
+            prim.minimum = glm::min( glm::min( glm::vec2( prim.a ), glm::vec2( prim.b ) ), glm::min( glm::vec2( prim.c ), glm::vec2( prim.d ) ) );
+            prim.maximum = glm::max( glm::max( glm::vec2( prim.a ), glm::vec2( prim.b ) ), glm::max( glm::vec2( prim.c ), glm::vec2( prim.d ) ) );
+
+            if ( visible( prim, view ) )
+                projected.push_back( prim );
+        }
+    }
+
+    static bool visible(Projected const& prim, RasterView const& view) {
+
+        return prim.maximum.x >= 0.0f && prim.maximum.y >= 0.0f
+            && prim.minimum.x < view.width && prim.minimum.y < view.height;
+    }
+
+    /// Sorts the primitives into the tiles their bounds overlap.
+    /// Every thread bins its own chunk, tiles walk the chunks in order,
+    /// so the result does not depend on the scheduling.
+    void bin(RasterView const& view) {
+
+        std::size_t tiles = static_cast<std::size_t>( tilesX ) * tilesY;
+        std::size_t chunks = std::max<std::size_t>( 1U, std::min<std::size_t>( thread_count( settings.threads ), projected.size() / 4096U + 1U ) );
+        std::size_t chunkSize = ( projected.size() + chunks - 1 ) / chunks;
+
+        bins.assign( chunks, std::vector<std::vector<std::uint32_t>>( tiles ) );
+
+        parallel_for( chunks, settings.threads, [&](std::size_t const chunk) {
+            std::size_t end = std::min( projected.size(), ( chunk + 1 ) * chunkSize );
+            for ( std::size_t i = chunk * chunkSize; i < end; ++i )
+            {
+                Projected const& prim = projected[i];
+
+                // clamp in float, bounds close to the near plane overflow an int
+                int x0 = static_cast<int>( std::max( prim.minimum.x, 0.0f ) ) / settings.tile_size;
+                int y0 = static_cast<int>( std::max( prim.minimum.y, 0.0f ) ) / settings.tile_size;
+                int x1 = static_cast<int>( std::min( prim.maximum.x, view.width - 1.0f ) ) / settings.tile_size;
+                int y1 = static_cast<int>( std::min( prim.maximum.y, view.height - 1.0f ) ) / settings.tile_size;
+
+                for ( int ty = y0; ty <= y1; ++ty )
+                {
+                    for ( int tx = x0; tx <= x1; ++tx )
+                    {
+                        bins[chunk][static_cast<std::size_t>( ty ) * tilesX + tx].push_back( static_cast<std::uint32_t>( i ) );
+                    }
+                }
+            }
+        } );
+    }
+
+    void draw_tile(Scene const& scene, RasterView const& view, int const tile, RasterTarget& target) const {
+
+        int x0 = ( tile % tilesX ) * settings.tile_size;
+        int y0 = ( tile / tilesX ) * settings.tile_size;
+        int x1 = std::min( x0 + settings.tile_size, view.width );
+        int y1 = std::min( y0 + settings.tile_size, view.height );
+
+        for ( std::vector<std::vector<std::uint32_t>> const& chunk : bins )
+        {
+            for ( std::uint32_t i : chunk[tile] )
+            {
+                Projected const& prim = projected[i];
+
+                int px0 = static_cast<int>( std::floor( std::max( prim.minimum.x, static_cast<float>( x0 ) ) ) );
+                int py0 = static_cast<int>( std::floor( std::max( prim.minimum.y, static_cast<float>( y0 ) ) ) );
+                int px1 = std::min( x1, static_cast<int>( std::ceil( std::min( prim.maximum.x, static_cast<float>( x1 ) ) ) ) + 1 );
+                int py1 = std::min( y1, static_cast<int>( std::ceil( std::min( prim.maximum.y, static_cast<float>( y1 ) ) ) ) + 1 );
+
+                if ( ( prim.id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+                    draw_capsule( scene, view, prim, px0, py0, px1, py1, target );
+                else
+                    draw_quad( scene, view, prim, px0, py0, px1, py1, target );
+            }
+        }
+
+        if ( settings.ground && !view.orthographic )
+            draw_ground( scene, view, x0, y0, x1, y1, target );
+    }
+
+    void draw_capsule(Scene const& scene, RasterView const& view, Projected const& prim,
+                      int const x0, int const y0, int const x1, int const y1, RasterTarget& target) const {
+
+        glm::vec2 a = glm::vec2( prim.a );
+        glm::vec2 ab = glm::vec2( prim.b ) - a;
+        float abab = glm::dot( ab, ab );
+        float invA = view.orthographic ? prim.a.z : 1.0f / prim.a.z;
+        float invB = view.orthographic ? prim.b.z : 1.0f / prim.b.z;
+
+        for ( int y = y0; y < y1; ++y )
+        {
+            for ( int x = x0; x < x1; ++x )
+            {
+                glm::vec2 p = glm::vec2( x + 0.5f, y + 0.5f );
+
+                // closest point on the projected axis
+                float s = abab > 0.0f ? glm::clamp( glm::dot( p - a, ab ) / abab, 0.0f, 1.0f ) : 0.0f;
+                glm::vec2 offset = p - ( a + s * ab );
+                float r = prim.ra + ( prim.rb - prim.ra ) * s;
+                float d2 = glm::dot( offset, offset );
+
+                if ( d2 > r * r || r <= 0.0f )
+                    continue;
+
+                // depth along the axis (perspective correct) minus the bulge of the tube
+                float inv = invA + ( invB - invA ) * s;
+                float axisDepth = view.orthographic ? inv : 1.0f / inv;
+                float d = std::sqrt( d2 ) / r;
+                float h = std::sqrt( std::max( 1.0f - d * d, 0.0f ) );
+                float depth = axisDepth - ( prim.wa + ( prim.wb - prim.wa ) * s ) * h;
+
+                std::size_t pixel = static_cast<std::size_t>( y ) * view.width + x;
+                if ( depth >= target.depth[pixel] )
+                    continue;
+
+                target.depth[pixel] = depth;
+                target.ids[pixel] = prim.id;
+
+                if ( settings.shade )
+                {
+                    glm::vec2 side = d2 > 0.0f ? offset / std::sqrt( d2 ) : glm::vec2(0.0f);
+                    glm::vec3 normal = view.right * ( side.x * d ) - view.up * ( side.y * d ) - view.forward * h;
+                    target.color.at( x, y ) = lambert( scene, scene.branch_color, glm::normalize( normal ) );
+                }
+            }
+        }
+    }
+
+    void draw_quad(Scene const& scene, RasterView const& view, Projected const& prim,
+                   int const x0, int const y0, int const x1, int const y1, RasterTarget& target) const {
+
+        glm::vec3 const* corners[4] = { &prim.a, &prim.b, &prim.c, &prim.d };
+        glm::vec2 const uvs[4] = { glm::vec2(0.0f, 0.0f), glm::vec2(1.0f, 0.0f), glm::vec2(1.0f, 1.0f), glm::vec2(0.0f, 1.0f) };
+
+        // the normal faces the viewer (the leaf is two-sided)
+        glm::vec3 normal = glm::dot( prim.normal, view.forward ) > 0.0f ? -prim.normal : prim.normal;
+
+        // two triangles: (0, 1, 2) and (0, 2, 3)
+        for ( int triangle = 0; triangle < 2; ++triangle )
+        {
+            int i0 = 0, i1 = triangle + 1, i2 = triangle + 2;
+            glm::vec3 const& v0 = *corners[i0];
+            glm::vec3 const& v1 = *corners[i1];
+            glm::vec3 const& v2 = *corners[i2];
+
+            float area = ( v1.x - v0.x ) * ( v2.y - v0.y ) - ( v1.y - v0.y ) * ( v2.x - v0.x );
+            if ( std::abs( area ) < 1e-12f )
+                continue;
+            float invArea = 1.0f / area;
+
+            // per vertex 1/depth for perspective correct interpolation
+            float w0 = view.orthographic ? 1.0f : 1.0f / v0.z;
+            float w1 = view.orthographic ? 1.0f : 1.0f / v1.z;
+            float w2 = view.orthographic ? 1.0f : 1.0f / v2.z;
+
+            for ( int y = y0; y < y1; ++y )
+            {
+                for ( int x = x0; x < x1; ++x )
+                {
+                    float px = x + 0.5f, py = y + 0.5f;
+
+                    float b0 = ( ( v1.x - px ) * ( v2.y - py ) - ( v1.y - py ) * ( v2.x - px ) ) * invArea;
+                    float b1 = ( ( v2.x - px ) * ( v0.y - py ) - ( v2.y - py ) * ( v0.x - px ) ) * invArea;
+                    float b2 = 1.0f - b0 - b1;
+
+                    if ( b0 < 0.0f || b1 < 0.0f || b2 < 0.0f )
+                        continue;
+
+                    float w = b0 * w0 + b1 * w1 + b2 * w2;
+                    float depth = view.orthographic ? b0 * v0.z + b1 * v1.z + b2 * v2.z : 1.0f / w;
+
+                    std::size_t pixel = static_cast<std::size_t>( y ) * view.width + x;
+                    if ( depth >= target.depth[pixel] )
+                        continue;
+
+                    glm::vec2 uv = ( b0 * w0 * uvs[i0] + b1 * w1 * uvs[i1] + b2 * w2 * uvs[i2] ) / w;
+
+                    // alpha test like the tracer
+                    glm::vec4 texel = scene.laef_tex != nullptr ? scene.laef_tex->sample_level( uv, 0 ) : glm::vec4( scene.leaf_color, 1.0f );
+                    if ( texel.a <= 0.1f )
+                        continue;
+
+                    target.depth[pixel] = depth;
+                    target.ids[pixel] = prim.id;
+
+                    if ( settings.shade )
+                        target.color.at( x, y ) = lambert( scene, glm::vec3( texel ), normal );
+                }
+            }
+        }
+    }
+
+    void draw_ground(Scene const& scene, RasterView const& view, int const x0, int const y0, int const x1, int const y1, RasterTarget& target) const {
+
+        for ( int y = y0; y < y1; ++y )
+        {
+            for ( int x = x0; x < x1; ++x )
+            {
+                std::size_t pixel = static_cast<std::size_t>( y ) * view.width + x;
+
+                glm::vec3 direction = glm::normalize( view.forward + ( ( x + 0.5f - 0.5f * view.width ) * view.right
+                                                                     - ( y + 0.5f - 0.5f * view.height ) * view.up ) / view.scale );
+                Ray ray{ view.origin, direction };
+                Hit hit;
+
+                if ( RayPlaneIntersection( ray, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f), hit.t, hit ) )
+                {
+                    float depth = hit.t * glm::dot( direction, view.forward );
+                    if ( depth < target.depth[pixel] )
+                    {
+                        target.depth[pixel] = depth;
+                        target.ids[pixel] = Hit::make_id( Hit::Kind::Ground, 0U );
+
+                        if ( settings.shade )
+                            target.color.at( x, y ) = lambert( scene, scene.ground_color, hit.normal );
+                    }
+                }
+
+                if ( settings.shade && target.ids[pixel] == Hit::make_id( Hit::Kind::Miss, 0U ) )
+                    target.color.at( x, y ) = Sky( scene, direction );
+            }
+        }
+    }
+
+    static glm::vec3 lambert(Scene const& scene, glm::vec3 const& material, glm::vec3 const& normal) {
+
+        // ambient and diffuse terms of Trace() without the shadow ray
+        return 0.2f * material + 0.8f * material * scene.light.diffuse * std::max( glm::dot( normal, scene.light.direction ), 0.0f );
+    }
+
+    RasterSettings settings;
+    int tilesX = 0;
+    int tilesY = 0;
+    std::vector<Projected> projected;
+    std::vector<std::vector<std::vector<std::uint32_t>>> bins;
+};
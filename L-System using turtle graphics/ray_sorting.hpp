@@ -0,0 +1,229 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "bvh.hpp"
+#include "sampling.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+
+/// Spreads the low 10 bits of v so that two zero bits follow each of them.
+inline std::uint32_t spread_bits(std::uint32_t v) {
+
+    v &= 0x3FFU;
+    v = ( v | ( v << 16 ) ) & 0x030000FFU;
+    v = ( v | ( v << 8 ) ) & 0x0300F00FU;
+    v = ( v | ( v << 4 ) ) & 0x030C30C3U;
+    v = ( v | ( v << 2 ) ) & 0x09249249U;
+
+    return v;
+}
+
+/// 30 bit Morton code of a point inside the bounds.
+inline std::uint32_t morton_code(glm::vec3 const& p, Bounds const& bounds) {
+
+    glm::vec3 extent = glm::max( bounds.maximum - bounds.minimum, glm::vec3(1e-6f) );
+    glm::vec3 unit = glm::clamp( ( p - bounds.minimum ) / extent, 0.0f, 1.0f ) * 1023.0f;
+
+    return ( spread_bits( static_cast<std::uint32_t>( unit.x ) ) << 2 )
+         | ( spread_bits( static_cast<std::uint32_t>( unit.y ) ) << 1 )
+         |   spread_bits( static_cast<std::uint32_t>( unit.z ) );
+}
+
+/// Sort key of a ray: the octant of its direction, then the Morton code of its origin.
+/// Rays with equal keys start close together and walk the BVH in the same order.
+inline std::uint32_t ray_sort_key(Ray const& ray, Bounds const& bounds) {
+
+    std::uint32_t octant = ( ray.direction.x < 0.0f ? 4U : 0U ) | ( ray.direction.y < 0.0f ? 2U : 0U ) | ( ray.direction.z < 0.0f ? 1U : 0U );
+
+    return ( octant << 29 ) | ( morton_code( ray.origin, bounds ) >> 1 );
+}
+
+/// Fills "order" with the indices of the rays sorted by ray_sort_key(): a radix sort of the
+/// keys, 8 bits per pass from the lowest, skipping the passes where all keys share the digit.
+inline void sort_rays(std::vector<Ray> const& rays, Bounds const& bounds, std::vector<std::uint32_t>& order) {
+
+    std::size_t count = rays.size();
+    std::vector<std::uint32_t> keys( count ), swapKeys( count );
+    std::vector<std::uint32_t> swapOrder( count );
+    order.resize( count );
+
+    for ( std::size_t i = 0; i < count; ++i )
+    {
+        keys[i] = ray_sort_key( rays[i], bounds );
+        order[i] = static_cast<std::uint32_t>( i );
+    }
+
+    for ( int shift = 0; shift < 32; shift += 8 )
+    {
+        std::size_t offsets[256] = {};
+        for ( std::uint32_t key : keys )
+        {
+            ++offsets[( key >> shift ) & 0xFFU];
+        }
+        if ( count == 0U || offsets[( keys[0] >> shift ) & 0xFFU] == count )
+            continue;
+
+        std::size_t sum = 0U;
+        for ( std::size_t& offset : offsets )
+        {
+            std::size_t digits = offset;
+            offset = sum;
+            sum += digits;
+        }
+
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            std::size_t to = offsets[( keys[i] >> shift ) & 0xFFU]++;
+            swapKeys[to] = keys[i];
+            swapOrder[to] = order[i];
+        }
+        keys.swap( swapKeys );
+        order.swap( swapOrder );
+    }
+}
+
+/// Settings of the renderer with sorted shadow rays.
+struct SortedRenderSettings {
+    int tile_size = 32;
+    bool sort = false;              // true -> shadow rays are sorted by ray_sort_key() (see render_sorted())
+    RenderSettings render;
+};
+
+/// Renders the same image as render() but traces the shadow rays in batches: the primary
+/// hits of a tile are shaded first while their shadow rays are buffered, the buffer is
+/// sorted by ray_sort_key() and traced, then the shading is finished. Sorted rays visit the
+/// same BVH nodes one after another, so the nodes stay in cache. On a single tree that does
+/// not pay: its BVH fits in the caches and the shadow rays of a tile in pixel order are
+/// already coherent, so sorting was slower at every tile size measured (32 to 128 pixels)
+/// and is off by default. It is meant for scenes whose BVH does not fit.
+inline void render_sorted(Scene const& scene, Camera const& camera, Image& image,
+                          SortedRenderSettings const& settings = SortedRenderSettings()) {
+
+    const float epsilon = 0.01f;
+
+    Bounds bounds;
+    if ( !scene.bvh.empty() )
+    {
+        bounds.minimum = scene.bvh.nodes[0].minimum;
+        bounds.maximum = scene.bvh.nodes[0].maximum;
+    }
+
+    int tilesX = ( image.width + settings.tile_size - 1 ) / settings.tile_size;
+    int tilesY = ( image.height + settings.tile_size - 1 ) / settings.tile_size;
+    int samples = settings.render.samples;
+
+    parallel_for( static_cast<std::size_t>( tilesX ) * tilesY, settings.render.threads, [&](std::size_t const t) {
+        int x0 = static_cast<int>( t % tilesX ) * settings.tile_size;
+        int y0 = static_cast<int>( t / tilesX ) * settings.tile_size;
+        int x1 = std::min( x0 + settings.tile_size, image.width );
+        int y1 = std::min( y0 + settings.tile_size, image.height );
+
+        // one entry per sample of the tile
+        struct Sample {
+            Hit hit;
+            glm::vec3 material;
+            glm::vec3 color;
+            Random random;
+            bool occluded;
+        };
+
+        std::vector<Sample> buffer;
+        std::vector<Ray> shadowRays;
+        std::vector<std::uint32_t> shadowOwners;
+        buffer.reserve( static_cast<std::size_t>( x1 - x0 ) * ( y1 - y0 ) * samples );
+
+        // 1. primary rays, shading up to the shadow test (the random numbers are drawn as in Trace())
+        for ( int y = y0; y < y1; ++y )
+        {
+            for ( int x = x0; x < x1; ++x )
+            {
+                for ( int s = 0; s < samples; ++s )
+                {
+                    Sample sample{ Hit(), glm::vec3(0.0f), glm::vec3(0.0f), Random( Random::seed( x, y, s, settings.render.frame ) ), false };
+                    float jx = samples > 1 ? sample.random.next() : 0.5f;
+                    float jy = samples > 1 ? sample.random.next() : 0.5f;
+
+                    Ray ray = camera.generate_ray( x + jx, y + jy, image.width, image.height );
+                    sample.hit = Evaluate( scene, ray );
+
+                    if ( sample.hit.is_miss() )
+                    {
+                        sample.color = Sky( scene, ray.direction );
+                        buffer.push_back( sample );
+                        continue;
+                    }
+
+                    Hit const& hit = sample.hit;
+                    float cosine = std::max( std::abs( glm::dot( hit.normal, ray.direction ) ), 0.1f );
+                    sample.material = Material( scene, hit, hit.t * ray.spread / cosine );
+                    glm::vec3 L = scene.light.direction;
+
+                    glm::vec3 A = Ambient( scene, hit, sample.material );
+                    glm::vec3 D = 0.8f * sample.material * scene.light.diffuse * std::max( glm::dot( hit.normal, L ), 0.0f );
+                    sample.color = A + D;
+
+                    if ( scene.shadows != nullptr )
+                    {
+                        float lit = scene.shadows->visibility( hit.intersection, hit.normal );
+                        sample.color = ( 0.2f + 0.8f * lit ) * sample.color;
+                    }
+                    else
+                    {
+                        if ( samples > 1 && scene.light.angular_radius > 0.0f )
+                            L = sample_cone( L, scene.light.angular_radius, sample.random.next(), sample.random.next() );
+
+                        shadowRays.push_back( Ray{ hit.intersection + epsilon * hit.normal, L } );
+                        shadowOwners.push_back( static_cast<std::uint32_t>( buffer.size() ) );
+                    }
+
+                    buffer.push_back( sample );
+                }
+            }
+        }
+
+        // 2. shadow rays, sorted
+        std::vector<std::uint32_t> order;
+        if ( settings.sort )
+        {
+            sort_rays( shadowRays, bounds, order );
+        }
+        else
+        {
+            order.resize( shadowRays.size() );
+            for ( std::uint32_t i = 0; i < order.size(); ++i )
+            {
+                order[i] = i;
+            }
+        }
+
+        for ( std::uint32_t r : order )
+        {
+            buffer[shadowOwners[r]].occluded = Occluded( scene, shadowRays[r] );
+        }
+
+        // 3. finish the shading and average the samples
+        std::size_t next = 0U;
+        for ( int y = y0; y < y1; ++y )
+        {
+            for ( int x = x0; x < x1; ++x )
+            {
+                glm::vec3 color( 0.0f );
+                for ( int s = 0; s < samples; ++s )
+                {
+                    Sample& sample = buffer[next++];
+                    glm::vec3 c = sample.occluded ? 0.2f * sample.color : sample.color;
+
+                    if ( !sample.hit.is_miss() && scene.indirect != nullptr )
+                        c += sample.material * scene.indirect->irradiance( scene, sample.hit, samples > 1 ? &sample.random : nullptr );
+
+                    color += c;
+                }
+                image.at( x, y ) = color * ( 1.0f / samples );
+            }
+        }
+    } );
+}
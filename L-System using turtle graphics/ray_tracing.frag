@@ -18,6 +18,48 @@ struct Leaf
     vec4 size;		
 };
 
+// Intersection-ready branch, precomputed on the CPU (see intersection_records.hpp).
+struct BranchRecord
+{
+    vec3 p1;
+    float r1;
+    vec3 p2;
+    float r2;
+    vec3 axis;          // normalized p2 - p1
+    float length;       // |p2 - p1|
+    float slope;        // (r1 - r2) / length
+    float cos2;         // 1 - slope^2
+    float inv_length;   // 1 / length
+    float reserved;
+};
+
+// Intersection-ready leaf, precomputed on the CPU (see intersection_records.hpp).
+// Each member is a plane evaluated as dot(p, xyz) + w.
+struct LeafRecord
+{
+    vec4 plane;     // the leaf plane
+    vec4 u_plane;   // U coordinate of a point on the leaf
+    vec4 v_plane;   // V coordinate of a point on the leaf
+};
+
+layout (std430, binding = 3) readonly buffer BranchRecords { BranchRecord branch_records[]; };
+layout (std430, binding = 4) readonly buffer LeafRecords { LeafRecord leaf_records[]; };
+
+// Debug variant (compile with "#define DEBUG_STATS"): counts the work of every pixel
+// and outputs a heatmap of one counter instead of the color (see render_stats.hpp).
+#ifdef DEBUG_STATS
+layout (std430, binding = 5) buffer StatHistogram { uint stat_histogram[]; };   // stat_bins entries per counter
+
+uniform int debug_stat;         // 0 branch tests, 1 leaf tests, 2 texture fetches, 3 shadow queries
+uniform float debug_stat_max;   // the count shown as white
+uniform int stat_bins;
+
+uint stat_counters[4] = uint[4](0u, 0u, 0u, 0u);
+#define STAT(counter) stat_counters[counter]++
+#else
+#define STAT(counter)
+#endif
+
 layout (binding = 0) uniform samplerCube skybox_tex; 
 layout (binding = 1) uniform sampler2D wood_tex; 
 layout (binding = 2) uniform sampler2D laef_tex; 
@@ -67,6 +109,7 @@ vec3 getBranchMaterial(vec3 intersection, Branch branch){
     vec3 tex_crds = vec3( u * 0.2, v * 0.5, 0 );				// scale UVs with (0.2, 0.5)
 	
 	// color from interesection from texture 'wood_tex'
+	STAT(2);
 	vec4 texColor = texture( wood_tex, vec2(u, v) );			
 	
 	return texColor.xyz;
@@ -95,20 +138,134 @@ Hit RayLeafIntersection(Ray ray, Leaf leaf){
 	}
 }
 
+// Computes an intersection between a ray and a precomputed branch (rounded cone).
+Hit RayBranchRecordIntersection(Ray ray, BranchRecord branch){
+
+	vec3 oa = ray.origin - branch.p1;
+
+	float m1 = dot( branch.axis, oa );
+	float m2 = dot( branch.axis, ray.direction );
+	float m3 = dot( ray.direction, oa );
+	float m5 = dot( oa, oa );
+	float ra = branch.r1;
+
+	// body (cone between the two spheres)
+	float k2 = branch.cos2 - m2 * m2;
+	float k1 = branch.cos2 * m3 - m1 * m2 + m2 * branch.slope * ra;
+	float k0 = branch.cos2 * m5 - m1 * m1 + 2.0 * m1 * branch.slope * ra - ra * ra;
+	float h = k1 * k1 - k0 * k2;
+
+	if ( h < 0.0 )
+	{
+		return miss;
+	}
+
+	float t = ( -sqrt( h ) - k1 ) / k2;
+	float y = m1 - ra * branch.slope + t * m2;
+	vec3 n;
+
+	if ( y > 0.0 && y < branch.length * branch.cos2 )
+	{
+		if ( t <= 0.0 )
+		{
+			return miss;
+		}
+		n = branch.cos2 * ( oa + t * ray.direction ) - branch.axis * y;
+	}
+	else
+	{
+		// caps (the two spheres)
+		vec3 ob = ray.origin - branch.p2;
+		float m6 = dot( ob, ray.direction );
+		float m7 = dot( ob, ob );
+		float h1 = m3 * m3 - m5 + ra * ra;
+		float h2 = m6 * m6 - m7 + branch.r2 * branch.r2;
+
+		t = 1e20;
+		if ( h1 > 0.0 && -m3 - sqrt( h1 ) > 0.0 )
+		{
+			t = -m3 - sqrt( h1 );
+			n = oa + t * ray.direction;
+		}
+		if ( h2 > 0.0 && -m6 - sqrt( h2 ) > 0.0 && -m6 - sqrt( h2 ) < t )
+		{
+			t = -m6 - sqrt( h2 );
+			n = ob + t * ray.direction;
+		}
+		if ( t == 1e20 )
+		{
+			return miss;
+		}
+	}
+
+	vec3 intersection = ray.origin + t * ray.direction;
+	Branch branch_def = Branch( branch.p1, branch.r1, branch.p2, branch.r2 );
+
+	return Hit( intersection, t, normalize( n ), getBranchMaterial( intersection, branch_def ) );
+}
+
+// Computes an intersection between a ray and a precomputed leaf (parallelogram).
+Hit RayLeafRecordIntersection(Ray ray, LeafRecord leaf){
+
+	vec3 n = leaf.plane.xyz;
+	float denom = dot( n, ray.direction );
+
+	if ( abs( denom ) < 1e-8 )
+	{
+		return miss;
+	}
+
+	float t = -( dot( n, ray.origin ) + leaf.plane.w ) / denom;
+	if ( t <= 0.0 )
+	{
+		return miss;
+	}
+
+	vec3 intersection = ray.origin + t * ray.direction;
+	float u = dot( leaf.u_plane.xyz, intersection ) + leaf.u_plane.w;
+	float v = dot( leaf.v_plane.xyz, intersection ) + leaf.v_plane.w;
+
+	if ( u < 0.0 || u > 1.0 || v < 0.0 || v > 1.0 )
+	{
+		return miss;
+	}
+
+	STAT(2);
+	vec4 color = texture( laef_tex, vec2( u, v ) );
+
+	// if leaf hit
+	if ( color.w > 0.1 )
+	{
+		// the normal faces the ray (the leaf is two-sided)
+		if ( denom > 0 )
+		{
+			n = -n;
+		}
+
+		return Hit( intersection, t, n, color.xyz );
+	}
+	else
+	{
+		return miss;
+	}
+}
+
 // Evaluates the intersections of the ray with the scene objects and returns the closes hit.
 Hit Evaluate(Ray ray){
 	// Sets the closes hit either to miss or to an intersection with the plane representing the ground.
 	Hit closest_hit = RayPlaneIntersection(ray, vec3(0, 1, 0), vec3(0));
 
 	for(int i = 0; i < num_branches; i++){
-		Hit intersection = RayBranchIntersection(ray, branches[i]);
+		STAT(0);
+		Hit intersection = RayBranchRecordIntersection(ray, branch_records[i]);
 		if(intersection.t < closest_hit.t){
 			closest_hit = intersection;
 		}
 	}
 
 	for(int i = 0; i < num_leaves; i++){
-		Hit intersection = RayLeafIntersection(ray, leaves[i]);
+		STAT(1);
+		Hit intersection = RayLeafRecordIntersection(ray, leaf_records[i]);
 		if(intersection.t < closest_hit.t){
 			closest_hit = intersection;
 		}
@@ -135,6 +292,7 @@ vec3 Trace(Ray ray) {
 		shadowRay.direction = L;
 
 		// if ray for shadow hits something -> cast shadow
+		STAT(3);
 		Hit shadowHit = Evaluate( shadowRay );
 		if ( shadowHit != miss )
 		{
@@ -145,9 +303,36 @@ vec3 Trace(Ray ray) {
 	// everything missed -> sample skybox
 	else
 	{
+		STAT(2);
 		vec4 texColor = texture( skybox_tex, ray.direction );
 		color = texColor.xyz;
 	}
 
     return color;
-}
\ No newline at end of file
+}
+
+#ifdef DEBUG_STATS
+// Maps [0, 1] to the false color ramp of render_stats.hpp.
+vec3 HeatColor(float value) {
+	const vec3 ramp[7] = vec3[7]( vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 1), vec3(0, 1, 0),
+	                              vec3(1, 1, 0), vec3(1, 0, 0), vec3(1, 1, 1) );
+
+	float x = clamp( value, 0.0, 1.0 ) * 6.0;
+	int i = min( int( x ), 5 );
+
+	return mix( ramp[i], ramp[i + 1], x - float( i ) );
+}
+
+// Traces the ray, adds the counts of the pixel to the histograms and returns the heatmap color.
+vec3 TraceStats(Ray ray) {
+	Trace(ray);
+
+	for (int c = 0; c < 4; c++)
+	{
+		int bin = min( int( float( stat_counters[c] ) / debug_stat_max * float( stat_bins ) ), stat_bins - 1 );
+		atomicAdd( stat_histogram[c * stat_bins + bin], 1u );
+	}
+
+	return HeatColor( float( stat_counters[debug_stat] ) / debug_stat_max );
+}
+#endif
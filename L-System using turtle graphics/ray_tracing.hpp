@@ -0,0 +1,549 @@
+#pragma once
+
+#include "intersection_records.hpp"
+#include "bvh.hpp"
+#include "leaf_lanes.hpp"
+#include "image.hpp"
+#include "texture.hpp"
+#include "sampling.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cmath>
+
+/// A pinhole camera used by the CPU renderers.
+struct Camera {
+    glm::vec3 position = glm::vec3(0.0f, 5.0f, 20.0f);
+    glm::vec3 target = glm::vec3(0.0f, 5.0f, 0.0f);
+    glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+    float fov_y = glm::radians( 45.0f );
+
+    /// Creates a primary ray through the point (x, y) of the image
+    /// in pixel units, (0, 0) being the top left corner.
+    Ray generate_ray(float const x, float const y, int const width, int const height) const {
+
+        glm::vec3 u, v, w;
+        basis( u, v, w );
+
+        float scale = std::tan( 0.5f * fov_y );
+        float aspect = static_cast<float>( width ) / static_cast<float>( height );
+        float px = ( 2.0f * x / width - 1.0f ) * scale * aspect;
+        float py = ( 1.0f - 2.0f * y / height ) * scale;
+
+        Ray ray{ position, glm::normalize( w + px * u + py * v ) };
+        ray.spread = 2.0f * scale / height;
+
+        return ray;
+    }
+
+    /// Computes the orthonormal basis of the camera (right, up, forward).
+    void basis(glm::vec3& right, glm::vec3& up_, glm::vec3& forward) const {
+
+        forward = glm::normalize( target - position );
+        right = glm::normalize( glm::cross( forward, up ) );
+        up_ = glm::cross( right, forward );
+    }
+};
+
+/// The definition of a directional light (mirrors "lights[0]" in ray_tracing.frag).
+struct DirectionalLight {
+    glm::vec3 direction = glm::normalize( glm::vec3(1.0f, 2.0f, 1.0f) );   // towards the light
+    glm::vec3 diffuse = glm::vec3(1.0f);
+    float angular_radius = 0.0f;    // > 0 -> area light with soft shadows (needs samples)
+};
+
+/// A source of shadowing used instead of exact shadow rays (see shadow_map.hpp).
+struct ShadowSource {
+
+    virtual ~ShadowSource() {}
+
+    /// Fraction of the light reaching the point (0 -> fully in shadow).
+    virtual float visibility(glm::vec3 const& point, glm::vec3 const& normal) const = 0;
+};
+
+struct Scene;
+
+/// A source of indirect (bounced) light at shading points (see irradiance_cache.hpp).
+struct IndirectSource {
+
+    virtual ~IndirectSource() {}
+
+    /// Average radiance arriving at the surface that was hit (cosine weighted).
+    virtual glm::vec3 irradiance(Scene const& scene, Hit const& hit, Random* random) const = 0;
+};
+
+/// Work done by the tracer, counted while "active" points at an instance
+/// (per thread, see render_stats.hpp); nullptr -> nothing is counted.
+struct RenderCounters {
+    std::uint32_t nodes = 0U;               // BVH nodes visited
+    std::uint32_t branch_tests = 0U;
+    std::uint32_t leaf_tests = 0U;
+    std::uint32_t texture_fetches = 0U;
+    std::uint32_t shadow_queries = 0U;
+
+    static inline thread_local RenderCounters* active = nullptr;
+};
+
+/// Everything the CPU tracer needs to render a tree generated by LTurtle.
+struct Scene {
+    PrimitiveRecords records;
+    BVH bvh;
+    DirectionalLight light;
+
+    glm::vec3 branch_color = glm::vec3(0.45f, 0.3f, 0.15f);
+    glm::vec3 leaf_color = glm::vec3(0.2f, 0.5f, 0.1f);
+    glm::vec3 ground_color = glm::vec3(0.4f, 0.4f, 0.35f);
+    glm::vec3 sky_color = glm::vec3(0.6f, 0.75f, 0.95f);
+
+    // optional textures (mirror the samplers of ray_tracing.frag), the colors above are used without them
+    Cubemap const* skybox_tex = nullptr;
+    Texture2D const* wood_tex = nullptr;
+    Texture2D const* laef_tex = nullptr;
+
+    // shadows looked up here instead of tracing shadow rays (nullptr -> shadow rays)
+    ShadowSource const* shadows = nullptr;
+
+    // bounced light, replaces the constant ambient term (nullptr -> only the ambient term)
+    IndirectSource const* indirect = nullptr;
+
+    /// Preprocesses the output of LTurtle for tracing.
+    void build(std::vector<Branch> const& branches, std::vector<Leaf> const& leaves) {
+
+        records.build( branches, leaves );
+        bvh.build( records );
+    }
+};
+
+/// Computes an intersection between a ray and a plane given by its normal and a point.
+inline bool RayPlaneIntersection(Ray const& ray, glm::vec3 const& normal, glm::vec3 const& point, float const t_max, Hit& hit) {
+
+    float denom = glm::dot( normal, ray.direction );
+
+    if ( std::abs( denom ) < 1e-8f )
+        return false;
+
+    float t = glm::dot( point - ray.origin, normal ) / denom;
+
+    if ( t <= 0.0f || t >= t_max )
+        return false;
+
+    hit.t = t;
+    hit.intersection = ray.origin + t * ray.direction;
+    hit.normal = normal;
+    hit.kind = Hit::Kind::Ground;
+
+    return true;
+}
+
+/// Tells whether the leaf texture covers the point of a leaf (alpha test of ray_tracing.frag).
+inline bool LeafCovered(Scene const& scene, glm::vec2 const& uv) {
+
+    if ( scene.laef_tex == nullptr )
+        return true;
+
+    if ( RenderCounters::active != nullptr )
+        ++RenderCounters::active->texture_fetches;
+
+    return scene.laef_tex->sample_level( uv, 0 ).a > 0.1f;
+}
+
+/// Primitives of a BVH node from which RayNodeIntersection() sets its leaves aside for the
+/// lane kernel (leaf_lanes.hpp). Most nodes hold at most 4 primitives; a few hold up to 16,
+/// where no split was cheaper. Only built with AVX2, where the lanes run 8 wide: at -O2
+/// the lanes are slower than testing the leaves one at a time.
+constexpr std::uint32_t leaf_lanes_threshold = 5U;
+
+#if defined(__AVX2__)
+/// RayNodeIntersection() for large nodes: the leaves are set aside and tested
+/// leaf_lane_count at a time, the branches one at a time.
+inline bool RayNodeLanesIntersection(Scene const& scene, Ray const& ray, std::uint32_t const* ids, std::uint32_t const count,
+                                     Hit& closest, bool const any_hit) {
+
+    RenderCounters* counters = RenderCounters::active;
+    LeafRecords const& records = scene.records.leaves;
+
+    std::uint32_t leaves[leaf_lane_count];
+    std::uint32_t leafCount = 0U;
+    bool found = false;
+
+    auto testLeaves = [&]() {
+        found = RayLeavesIntersection( ray, records, leaves, leafCount, closest,
+                                       [&](glm::vec2 const& uv) { return LeafCovered( scene, uv ); } ) || found;
+        leafCount = 0U;
+    };
+
+    for ( std::uint32_t i = 0; i < count && !( any_hit && found ); ++i )
+    {
+        std::uint32_t index = ids[i] & 0x3FFFFFFFU;
+        bool branch = ( ids[i] >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch );
+
+        if ( counters != nullptr )
+            ++( branch ? counters->branch_tests : counters->leaf_tests );
+
+        if ( !branch )
+        {
+            leaves[leafCount++] = index;
+            if ( leafCount == leaf_lane_count )
+                testLeaves();
+        }
+        else if ( RayBranchIntersection( ray, scene.records.branches[index], closest.t, closest ) )
+        {
+            closest.index = index;
+            found = true;
+        }
+    }
+
+    if ( leafCount > 0U && !( any_hit && found ) )
+        testLeaves();
+
+    return found;
+}
+#endif
+
+/// Intersects the ray with the primitives "ids[0 .. count)" of a BVH leaf node, "closest" is
+/// replaced by any hit closer than it. With "any_hit" the test stops at the first hit (shadow rays).
+inline bool RayNodeIntersection(Scene const& scene, Ray const& ray, std::uint32_t const* ids, std::uint32_t const count,
+                                Hit& closest, bool const any_hit) {
+
+#if defined(__AVX2__)
+    if ( count >= leaf_lanes_threshold )
+        return RayNodeLanesIntersection( scene, ray, ids, count, closest, any_hit );
+#endif
+
+    RenderCounters* counters = RenderCounters::active;
+    bool found = false;
+
+    for ( std::uint32_t i = 0; i < count && !( any_hit && found ); ++i )
+    {
+        std::uint32_t index = ids[i] & 0x3FFFFFFFU;
+        bool branch = ( ids[i] >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch );
+
+        if ( counters != nullptr )
+            ++( branch ? counters->branch_tests : counters->leaf_tests );
+
+        if ( branch )
+        {
+            if ( RayBranchIntersection( ray, scene.records.branches[index], closest.t, closest ) )
+            {
+                closest.index = index;
+                found = true;
+            }
+        }
+        else
+        {
+            Hit candidate;
+            if ( RayLeafIntersection( ray, scene.records.leaves[index], closest.t, candidate ) && LeafCovered( scene, candidate.uv ) )
+            {
+                closest = candidate;
+                closest.index = index;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+/// Intersects the ray with the branches and leaves only (no ground),
+/// "closest" is replaced by any primitive hit closer than it.
+inline void EvaluatePrimitives(Scene const& scene, Ray const& ray, Hit& closest) {
+
+    std::uint32_t visited = scene.bvh.traverse_leaves( ray, closest.t, [&](std::uint32_t const* ids, std::uint32_t const count) {
+        RayNodeIntersection( scene, ray, ids, count, closest, false );
+        return false;
+    } );
+
+    if ( RenderCounters::active != nullptr )
+        RenderCounters::active->nodes += visited;
+}
+
+/// Evaluates the intersections of the ray with the scene objects and returns the closest hit.
+inline Hit Evaluate(Scene const& scene, Ray const& ray) {
+
+    // sets the closest hit either to miss or to an intersection with the plane representing the ground
+    Hit closest;
+    RayPlaneIntersection( ray, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f), closest.t, closest );
+
+    EvaluatePrimitives( scene, ray, closest );
+
+    return closest;
+}
+
+/// Tells whether anything blocks the ray before "t_max" (used for shadow rays, stops at the first hit).
+/// The ground is not tested, shadow rays towards the light never reach it.
+inline bool Occluded(Scene const& scene, Ray const& ray, float const t_max = 1e20f) {
+
+    bool occluded = false;
+    RenderCounters* counters = RenderCounters::active;
+
+    Hit blocker;
+    blocker.t = t_max;
+
+    std::uint32_t visited = scene.bvh.traverse_leaves( ray, t_max, [&](std::uint32_t const* ids, std::uint32_t const count) {
+        occluded = RayNodeIntersection( scene, ray, ids, count, blocker, true );
+        return occluded;
+    } );
+
+    if ( counters != nullptr )
+    {
+        ++counters->shadow_queries;
+        counters->nodes += visited;
+    }
+
+    return occluded;
+}
+
+/// Computes the branch texture coordinates (mirrors "getBranchMaterial" in ray_tracing.frag).
+inline glm::vec2 BranchUV(BranchRecord const& branch, glm::vec3 const& intersection) {
+
+    glm::vec3 w = branch.axis;
+    glm::vec3 q = intersection - branch.p1;
+
+    // V for texture
+    float v = glm::dot( w, q );
+
+    // vectors t and s
+    glm::vec3 t = glm::cross( w, glm::vec3(0.0f, 0.0f, 1.0f) );
+    glm::vec3 s = glm::cross( w, t );
+
+    // recalculate with new set vector for t
+    if ( t == glm::vec3(0.0f) || glm::dot( q, s ) == 0.0f )
+    {
+        t = glm::cross( w, glm::vec3(0.0f, 1.0f, 0.0f) );
+        s = glm::cross( w, t );
+    }
+
+    t = glm::normalize( t );
+    s = glm::normalize( s );
+
+    // U for texture
+    float u = std::atan( glm::dot( q, t ) / glm::dot( q, s ) );
+
+    return glm::vec2( u, v );
+}
+
+/// Returns the (unlit) color of a branch at the point, "footprint" is the width of the ray there.
+inline glm::vec3 BranchMaterial(Scene const& scene, BranchRecord const& branch, glm::vec3 const& intersection, float const footprint = 0.0f) {
+
+    if ( scene.wood_tex == nullptr )
+        return scene.branch_color;
+
+    if ( RenderCounters::active != nullptr )
+        ++RenderCounters::active->texture_fetches;
+
+    // U is an angle -> one world unit covers about 1 / radius of it
+    float radius = std::max( std::min( branch.r1, branch.r2 ), 1e-4f );
+    float uvFootprint = footprint * std::max( 1.0f, 1.0f / radius );
+
+    return glm::vec3( scene.wood_tex->sample( BranchUV( branch, intersection ), uvFootprint ) );
+}
+
+/// Returns the (unlit) color of a leaf at the texture coordinates, "footprint" is the width of the ray there.
+inline glm::vec3 LeafMaterial(Scene const& scene, LeafRecord const& leaf, glm::vec2 const& uv, float const footprint = 0.0f) {
+
+    if ( scene.laef_tex == nullptr )
+        return scene.leaf_color;
+
+    if ( RenderCounters::active != nullptr )
+        ++RenderCounters::active->texture_fetches;
+
+    // the lengths of the inverse edge vectors are UV units per world unit
+    float uvPerUnit = std::max( glm::length( glm::vec3( leaf.u_plane ) ), glm::length( glm::vec3( leaf.v_plane ) ) );
+
+    return glm::vec3( scene.laef_tex->sample( uv, footprint * uvPerUnit ) );
+}
+
+/// Returns the (unlit) color of the surface that was hit,
+/// "footprint" is the width of the ray at the hit in world units.
+inline glm::vec3 Material(Scene const& scene, Hit const& hit, float const footprint = 0.0f) {
+
+    switch ( hit.kind )
+    {
+    case Hit::Kind::Branch:
+        return BranchMaterial( scene, scene.records.branches[hit.index], hit.intersection, footprint );
+    case Hit::Kind::Leaf:
+        return LeafMaterial( scene, scene.records.leaves[hit.index], hit.uv, footprint );
+    case Hit::Kind::Ground:
+        return scene.ground_color;
+    default:
+        return scene.sky_color;
+    }
+}
+
+/// Returns the baked ambient occlusion of the primitive that was hit (1 without a bake).
+inline float AmbientOcclusion(Scene const& scene, Hit const& hit) {
+
+    switch ( hit.kind )
+    {
+    case Hit::Kind::Branch:
+        return scene.records.branches.ao[hit.index];
+    case Hit::Kind::Leaf:
+        return scene.records.leaves.ao[hit.index];
+    default:
+        return 1.0f;
+    }
+}
+
+/// Returns the constant ambient term (darkened by the baked occlusion) standing in for bounced
+/// light; zero when the scene has an indirect source, which adds the bounces itself.
+inline glm::vec3 Ambient(Scene const& scene, Hit const& hit, glm::vec3 const& material) {
+
+    if ( scene.indirect != nullptr )
+        return glm::vec3(0.0f);
+
+    return 0.2f * material * AmbientOcclusion( scene, hit );
+}
+
+/// Returns the color of the sky in the direction of the ray.
+inline glm::vec3 Sky(Scene const& scene, glm::vec3 const& direction) {
+
+    if ( scene.skybox_tex == nullptr )
+        return scene.sky_color;
+
+    if ( RenderCounters::active != nullptr )
+        ++RenderCounters::active->texture_fetches;
+
+    return glm::vec3( scene.skybox_tex->sample( direction ) );
+}
+
+/// Traces the ray through the scene and accumulates the color (mirrors "Trace" in ray_tracing.frag).
+/// With a random generator the shadow ray is jittered inside the cone of the light (soft shadows).
+inline glm::vec3 Trace(Scene const& scene, Ray const& ray, Random* random = nullptr, Hit* primary = nullptr) {
+
+    const float epsilon = 0.01f;
+
+    Hit hit = Evaluate( scene, ray );
+
+    if ( primary != nullptr )
+        *primary = hit;
+
+    // everything missed -> sample skybox
+    if ( hit.is_miss() )
+        return Sky( scene, ray.direction );
+
+    // width of the ray at the hit, widened by the grazing angle
+    float cosine = std::max( std::abs( glm::dot( hit.normal, ray.direction ) ), 0.1f );
+    glm::vec3 material = Material( scene, hit, hit.t * ray.spread / cosine );
+    glm::vec3 L = scene.light.direction;
+
+    // add diffuse lighting
+    glm::vec3 A = Ambient( scene, hit, material );
+    glm::vec3 D = 0.8f * material * scene.light.diffuse * std::max( glm::dot( hit.normal, L ), 0.0f );
+    glm::vec3 color = A + D;
+
+    if ( scene.shadows != nullptr )
+    {
+        // partially lit points (filtered shadow map) blend towards the shadowed color
+        float lit = scene.shadows->visibility( hit.intersection, hit.normal );
+        color = ( 0.2f + 0.8f * lit ) * color;
+    }
+    else
+    {
+        if ( random != nullptr && scene.light.angular_radius > 0.0f )
+            L = sample_cone( L, scene.light.angular_radius, random->next(), random->next() );
+
+        // ray for shadow (offset along the normal to avoid self-intersection)
+        Ray shadowRay{ hit.intersection + epsilon * hit.normal, L };
+
+        // if ray for shadow hits something -> cast shadow
+        if ( Occluded( scene, shadowRay ) )
+            color = 0.2f * color;
+    }
+
+    if ( scene.indirect != nullptr )
+        color += material * scene.indirect->irradiance( scene, hit, random );
+
+    return color;
+}
+
+/// Per pixel guides for denoising: surface color, normal and distance of the primary hits.
+struct GBuffer {
+    Image albedo;
+    Image normal;
+    std::vector<float> depth;
+
+    void resize(int const width, int const height) {
+
+        albedo = Image( width, height );
+        normal = Image( width, height );
+        depth.assign( static_cast<std::size_t>( width ) * height, 0.0f );
+    }
+};
+
+/// Settings of the CPU tracer.
+struct RenderSettings {
+    int samples = 1;                // rays per pixel (1 -> through the pixel center)
+    unsigned int threads = 0U;      // 0 -> all hardware threads
+    std::uint32_t frame = 0U;       // decorrelates the random numbers of animations
+};
+
+/// Guides of one pixel averaged over its samples (see GBuffer).
+struct PixelGuides {
+    glm::vec3 albedo = glm::vec3(0.0f);
+    glm::vec3 normal = glm::vec3(0.0f);
+    float depth = 0.0f;
+};
+
+/// Renders the pixel (x, y) of a "width" x "height" image.
+/// With more samples the rays are jittered inside the pixel and averaged.
+inline glm::vec3 render_pixel(Scene const& scene, Camera const& camera, int const x, int const y, int const width, int const height,
+                              RenderSettings const& settings = RenderSettings(), PixelGuides* guides = nullptr) {
+
+    glm::vec3 color( 0.0f ), albedo( 0.0f ), normal( 0.0f );
+    float depth = 0.0f;
+
+    for ( int s = 0; s < settings.samples; ++s )
+    {
+        Random random( Random::seed( x, y, s, settings.frame ) );
+        float jx = settings.samples > 1 ? random.next() : 0.5f;
+        float jy = settings.samples > 1 ? random.next() : 0.5f;
+
+        Ray ray = camera.generate_ray( x + jx, y + jy, width, height );
+        Hit hit;
+        color += Trace( scene, ray, settings.samples > 1 ? &random : nullptr, &hit );
+
+        if ( guides != nullptr )
+        {
+            albedo += hit.is_miss() ? Sky( scene, ray.direction ) : Material( scene, hit );
+            normal += hit.normal;
+            depth += hit.is_miss() ? 1e20f : hit.t;
+        }
+    }
+
+    float weight = 1.0f / settings.samples;
+
+    if ( guides != nullptr )
+    {
+        guides->albedo = albedo * weight;
+        guides->normal = glm::length( normal ) > 0.0f ? glm::normalize( normal ) : normal;
+        guides->depth = depth * weight;
+    }
+
+    return color * weight;
+}
+
+/// Renders the whole image, rows are spread over the threads.
+inline void render(Scene const& scene, Camera const& camera, Image& image,
+                   RenderSettings const& settings = RenderSettings(), GBuffer* gbuffer = nullptr) {
+
+    if ( gbuffer != nullptr )
+        gbuffer->resize( image.width, image.height );
+
+    parallel_for( static_cast<std::size_t>( image.height ), settings.threads, [&](std::size_t const row) {
+        int y = static_cast<int>( row );
+
+        for ( int x = 0; x < image.width; ++x )
+        {
+            PixelGuides guides;
+            image.at( x, y ) = render_pixel( scene, camera, x, y, image.width, image.height, settings,
+                                             gbuffer != nullptr ? &guides : nullptr );
+
+            if ( gbuffer != nullptr )
+            {
+                gbuffer->albedo.at( x, y ) = guides.albedo;
+                gbuffer->normal.at( x, y ) = guides.normal;
+                gbuffer->depth[static_cast<std::size_t>( y ) * image.width + x] = guides.depth;
+            }
+        }
+    } );
+}
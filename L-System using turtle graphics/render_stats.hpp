@@ -0,0 +1,178 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "image.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstdint>
+
+/// The counters of RenderCounters.
+enum class RenderCounter {
+    Nodes,
+    BranchTests,
+    LeafTests,
+    TextureFetches,
+    ShadowQueries,
+};
+
+inline std::uint32_t counter_value(RenderCounters const& counters, RenderCounter const counter) {
+
+    switch ( counter )
+    {
+    case RenderCounter::Nodes:
+        return counters.nodes;
+    case RenderCounter::BranchTests:
+        return counters.branch_tests;
+    case RenderCounter::LeafTests:
+        return counters.leaf_tests;
+    case RenderCounter::TextureFetches:
+        return counters.texture_fetches;
+    default:
+        return counters.shadow_queries;
+    }
+}
+
+inline char const* counter_name(RenderCounter const counter) {
+
+    switch ( counter )
+    {
+    case RenderCounter::Nodes:
+        return "nodes";
+    case RenderCounter::BranchTests:
+        return "branch_tests";
+    case RenderCounter::LeafTests:
+        return "leaf_tests";
+    case RenderCounter::TextureFetches:
+        return "texture_fetches";
+    default:
+        return "shadow_queries";
+    }
+}
+
+/// Maps [0, 1] to a false color ramp: black, blue, cyan, green, yellow, red, white.
+inline glm::vec3 heat_color(float const value) {
+
+    static const glm::vec3 ramp[] = {
+        glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+        glm::vec3(1.0f, 1.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(1.0f, 1.0f, 1.0f)
+    };
+    const int last = 6;
+
+    float x = glm::clamp( value, 0.0f, 1.0f ) * last;
+    int i = std::min( static_cast<int>( x ), last - 1 );
+
+    return glm::mix( ramp[i], ramp[i + 1], x - i );
+}
+
+/// Per pixel counters of a frame (summed over the samples of the pixel).
+struct RenderStats {
+    int width = 0;
+    int height = 0;
+    std::vector<RenderCounters> pixels;
+
+    RenderCounters const& at(int const x, int const y) const {
+
+        return pixels[static_cast<std::size_t>( y ) * width + x];
+    }
+
+    /// Sum over the frame.
+    std::uint64_t total(RenderCounter const counter) const {
+
+        std::uint64_t sum = 0U;
+        for ( RenderCounters const& p : pixels )
+        {
+            sum += counter_value( p, counter );
+        }
+        return sum;
+    }
+
+    std::uint32_t maximum(RenderCounter const counter) const {
+
+        std::uint32_t m = 0U;
+        for ( RenderCounters const& p : pixels )
+        {
+            m = std::max( m, counter_value( p, counter ) );
+        }
+        return m;
+    }
+
+    /// False color image of a counter, scaled to "scale" (0 -> the maximum of the frame).
+    Image heatmap(RenderCounter const counter, float scale = 0.0f) const {
+
+        if ( scale <= 0.0f )
+            scale = static_cast<float>( std::max( maximum( counter ), 1U ) );
+
+        Image image( width, height );
+        for ( int y = 0; y < height; ++y )
+        {
+            for ( int x = 0; x < width; ++x )
+            {
+                image.at( x, y ) = heat_color( counter_value( at( x, y ), counter ) / scale );
+            }
+        }
+        return image;
+    }
+
+    /// Number of pixels per value range, "bins" equal ranges over [0, maximum].
+    std::vector<std::uint64_t> histogram(RenderCounter const counter, int const bins = 32) const {
+
+        std::vector<std::uint64_t> counts( static_cast<std::size_t>( bins ), 0U );
+        float scale = static_cast<float>( bins ) / ( static_cast<float>( maximum( counter ) ) + 1.0f );
+
+        for ( RenderCounters const& p : pixels )
+        {
+            ++counts[std::min( static_cast<int>( counter_value( p, counter ) * scale ), bins - 1 )];
+        }
+        return counts;
+    }
+
+    /// Writes the totals and the histograms of all counters as CSV
+    /// ("counter,total,max,bin,low,high,pixels" rows), false when the file cannot be written.
+    bool write_csv(std::string const& path, int const bins = 32) const {
+
+        std::ofstream out( path );
+        if ( !out )
+            return false;
+
+        out << "counter,total,max,bin,low,high,pixels\n";
+        for ( RenderCounter counter : { RenderCounter::Nodes, RenderCounter::BranchTests, RenderCounter::LeafTests,
+                                        RenderCounter::TextureFetches, RenderCounter::ShadowQueries } )
+        {
+            std::vector<std::uint64_t> counts = histogram( counter, bins );
+            float binWidth = ( static_cast<float>( maximum( counter ) ) + 1.0f ) / bins;
+
+            for ( int b = 0; b < bins; ++b )
+            {
+                out << counter_name( counter ) << ',' << total( counter ) << ',' << maximum( counter ) << ','
+                    << b << ',' << b * binWidth << ',' << ( b + 1 ) * binWidth << ',' << counts[b] << '\n';
+            }
+        }
+
+        return static_cast<bool>( out );
+    }
+};
+
+/// Renders the image like render() and records the work of every pixel.
+inline void render_with_stats(Scene const& scene, Camera const& camera, Image& image, RenderStats& stats,
+                              RenderSettings const& settings = RenderSettings()) {
+
+    stats.width = image.width;
+    stats.height = image.height;
+    stats.pixels.assign( static_cast<std::size_t>( image.width ) * image.height, RenderCounters() );
+
+    parallel_for( static_cast<std::size_t>( image.height ), settings.threads, [&](std::size_t const row) {
+        int y = static_cast<int>( row );
+
+        for ( int x = 0; x < image.width; ++x )
+        {
+            RenderCounters::active = &stats.pixels[row * image.width + x];
+            image.at( x, y ) = render_pixel( scene, camera, x, y, image.width, image.height, settings );
+        }
+
+        RenderCounters::active = nullptr;
+    } );
+}
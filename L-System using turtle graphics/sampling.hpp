@@ -0,0 +1,82 @@
+#pragma once
+
+#include "glm_headers.hpp"
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+/// A small random generator (PCG) for the stochastic parts of the CPU tracer.
+/// It is seeded per pixel and sample, never per thread, so images do not
+/// depend on how the work is split between threads.
+struct Random {
+
+    explicit Random(std::uint64_t const seed = 0U) {
+
+        state = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        next_uint();
+    }
+
+    /// Seed for a pixel of a frame.
+    static std::uint64_t seed(std::uint32_t const x, std::uint32_t const y, std::uint32_t const sample, std::uint32_t const frame = 0U) {
+
+        return ( static_cast<std::uint64_t>( y ) << 40 ) ^ ( static_cast<std::uint64_t>( x ) << 20 )
+             ^ ( static_cast<std::uint64_t>( frame ) << 52 ) ^ sample;
+    }
+
+    std::uint32_t next_uint() {
+
+        std::uint64_t old = state;
+        state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+
+        std::uint32_t shifted = static_cast<std::uint32_t>( ( ( old >> 18U ) ^ old ) >> 27U );
+        std::uint32_t rotation = static_cast<std::uint32_t>( old >> 59U );
+
+        return ( shifted >> rotation ) | ( shifted << ( ( 32U - rotation ) & 31U ) );
+    }
+
+    /// Uniform number in [0, 1).
+    float next() {
+
+        return static_cast<float>( next_uint() >> 8 ) * ( 1.0f / 16777216.0f );
+    }
+
+private:
+    std::uint64_t state;
+};
+
+/// Builds two vectors perpendicular to the unit vector "n".
+inline void orthonormal_basis(glm::vec3 const& n, glm::vec3& t, glm::vec3& b) {
+
+    float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / ( sign + n.z );
+    float c = n.x * n.y * a;
+
+    t = glm::vec3( 1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x );
+    b = glm::vec3( c, sign + n.y * n.y * a, -n.y );
+}
+
+/// Cosine weighted direction in the hemisphere around the unit vector "n".
+inline glm::vec3 sample_cosine_hemisphere(glm::vec3 const& n, float const u1, float const u2) {
+
+    float r = std::sqrt( u1 );
+    float phi = 6.28318530718f * u2;
+
+    glm::vec3 t, b;
+    orthonormal_basis( n, t, b );
+
+    return r * std::cos( phi ) * t + r * std::sin( phi ) * b + std::sqrt( std::max( 1.0f - u1, 0.0f ) ) * n;
+}
+
+/// Uniform direction inside the cone around the unit vector "axis" with the given half angle.
+inline glm::vec3 sample_cone(glm::vec3 const& axis, float const half_angle, float const u1, float const u2) {
+
+    float cosMax = std::cos( half_angle );
+    float cosTheta = 1.0f - u1 * ( 1.0f - cosMax );
+    float sinTheta = std::sqrt( std::max( 1.0f - cosTheta * cosTheta, 0.0f ) );
+    float phi = 6.28318530718f * u2;
+
+    glm::vec3 t, b;
+    orthonormal_basis( axis, t, b );
+
+    return sinTheta * std::cos( phi ) * t + sinTheta * std::sin( phi ) * b + cosTheta * axis;
+}
@@ -0,0 +1,34 @@
+# Builds the Python module "lsystem" of python_bindings.cpp next to this file:
+#
+#   pip install pybind11 numpy
+#   python setup.py build_ext --inplace
+#   python test_python_bindings.py
+#
+# glm and draw_primitives.hpp are found like for the C++ sources; directories to add to the
+# include path can be given in LSYSTEM_INCLUDE_DIRS (separated like PATH).
+
+import os
+import sys
+
+from pybind11.setup_helpers import Pybind11Extension, build_ext
+from setuptools import setup
+
+include_dirs = [d for d in os.environ.get("LSYSTEM_INCLUDE_DIRS", "").split(os.pathsep) if d]
+threads = [] if sys.platform == "win32" else ["-pthread"]
+
+setup(
+    name="lsystem",
+    description="L-system generation with zero-copy NumPy access to the branches and leaves",
+    ext_modules=[
+        Pybind11Extension(
+            "lsystem",
+            ["python_bindings.cpp"],
+            include_dirs=include_dirs,
+            cxx_std=17,
+            extra_compile_args=threads,
+            extra_link_args=threads,
+        ),
+    ],
+    cmdclass={"build_ext": build_ext},
+    zip_safe=False,
+)
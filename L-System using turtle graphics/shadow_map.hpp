@@ -0,0 +1,195 @@
+#pragma once
+
+#include "rasterizer.hpp"
+#include "ray_tracing.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+/// Settings of the shadow map.
+struct ShadowMapSettings {
+    int resolution = 2048;          // texels along each side of a cascade
+    int cascades = 1;               // 1 -> a single map over the whole scene
+    float split_lambda = 0.75f;     // blend between logarithmic (1) and uniform (0) cascade splits
+    int pcf_radius = 1;             // PCF kernel is (2r + 1)^2 texels
+    float bias = 0.02f;             // depth bias in world units (added to one texel)
+    unsigned int threads = 0U;
+};
+
+/// Shadows from the directional light looked up in depth maps rasterized from the light,
+/// an alternative to one shadow ray per pixel in Trace().
+/// With more cascades the view frustum of a camera is split along its depth and each slice
+/// gets its own map, so large forests keep the texel density close to the camera.
+struct ShadowMap : public ShadowSource {
+
+    explicit ShadowMap(ShadowMapSettings const& settings_ = ShadowMapSettings())
+        : settings(settings_)
+    {}
+
+    /// Renders the maps; "camera" is needed only for more than one cascade.
+    void build(Scene const& scene, std::vector<Branch> const& branches, std::vector<Leaf> const& leaves,
+               Camera const* camera = nullptr, int const image_width = 1, int const image_height = 1) {
+
+        glm::vec3 minimum( std::numeric_limits<float>::max() );
+        glm::vec3 maximum( -std::numeric_limits<float>::max() );
+
+        for ( Branch const& branch : branches )
+        {
+            minimum = glm::min( minimum, glm::min( branch.p1 - branch.r1, branch.p2 - branch.r2 ) );
+            maximum = glm::max( maximum, glm::max( branch.p1 + branch.r1, branch.p2 + branch.r2 ) );
+        }
+        for ( Leaf const& leaf : leaves )
+        {
+            float reach = glm::length( glm::vec2( leaf.size ) );
+            minimum = glm::min( minimum, glm::vec3( leaf.position ) - reach );
+            maximum = glm::max( maximum, glm::vec3( leaf.position ) + reach );
+        }
+
+        glm::vec3 center = 0.5f * ( minimum + maximum );
+        float radius = 0.5f * glm::length( maximum - minimum ) + 1e-3f;
+        glm::vec3 lightDirection = -scene.light.direction;
+
+        cascades.clear();
+        splits.clear();
+
+        if ( camera == nullptr || settings.cascades <= 1 )
+        {
+            add_cascade( scene, branches, leaves, center, radius, lightDirection );
+            return;
+        }
+
+        // split the visible depth range of the camera
+        glm::vec3 right, up, forward;
+        camera->basis( right, up, forward );
+
+        float near = 0.1f;
+        float far = std::max( glm::dot( center - camera->position, forward ) + radius, near * 2.0f );
+        float tanY = std::tan( 0.5f * camera->fov_y );
+        float tanX = tanY * static_cast<float>( image_width ) / static_cast<float>( image_height );
+
+        float sliceNear = near;
+        for ( int c = 0; c < settings.cascades; ++c )
+        {
+            float f = static_cast<float>( c + 1 ) / settings.cascades;
+            float logSplit = near * std::pow( far / near, f );
+            float uniformSplit = near + ( far - near ) * f;
+            float sliceFar = settings.split_lambda * logSplit + ( 1.0f - settings.split_lambda ) * uniformSplit;
+
+            // bounding sphere of the frustum slice: the corners at depth d are d * k off the view
+            // axis, so a center on the axis at depth c needs the radius
+            // max( (c - near)^2 + (near k)^2, (far - c)^2 + (far k)^2 ), smallest where both are
+            // equal (or at the far plane for wide slices). It depends only on the slice, so the
+            // texel size of the cascade does not change while the camera turns.
+            float k2 = tanX * tanX + tanY * tanY;
+            float sliceDepth = std::min( 0.5f * ( sliceNear + sliceFar ) * ( 1.0f + k2 ), sliceFar );
+            float nearReach = std::sqrt( ( sliceDepth - sliceNear ) * ( sliceDepth - sliceNear ) + sliceNear * sliceNear * k2 );
+            float farReach = std::sqrt( ( sliceFar - sliceDepth ) * ( sliceFar - sliceDepth ) + sliceFar * sliceFar * k2 );
+
+            glm::vec3 sliceCenter = camera->position + sliceDepth * forward;
+            float sliceRadius = std::max( nearReach, farReach );
+
+            // slices larger than the scene are covered by a map of the scene
+            if ( sliceRadius >= radius )
+            {
+                sliceCenter = center;
+                sliceRadius = radius;
+            }
+
+            add_cascade( scene, branches, leaves, sliceCenter, sliceRadius, lightDirection );
+            splits.push_back( sliceFar );
+            sliceNear = sliceFar;
+        }
+
+        cameraPosition = camera->position;
+        cameraForward = forward;
+    }
+
+    /// Fraction of the (2r + 1)^2 PCF taps that see the light.
+    float visibility(glm::vec3 const& point, glm::vec3 const& normal) const override {
+
+        if ( cascades.empty() )
+            return 1.0f;
+
+        Cascade const& cascade = cascades[select( point )];
+
+        // push the point off the surface by a texel to avoid acne
+        glm::vec3 p = cascade.view.project( point + normal * cascade.texel );
+        float reference = p.z - settings.bias - cascade.texel;
+
+        int cx = static_cast<int>( std::floor( p.x ) );
+        int cy = static_cast<int>( std::floor( p.y ) );
+        int lit = 0;
+        int taps = 0;
+
+        for ( int dy = -settings.pcf_radius; dy <= settings.pcf_radius; ++dy )
+        {
+            for ( int dx = -settings.pcf_radius; dx <= settings.pcf_radius; ++dx )
+            {
+                int x = cx + dx, y = cy + dy;
+                ++taps;
+
+                // outside of the map -> nothing casts a shadow there
+                if ( x < 0 || y < 0 || x >= cascade.view.width || y >= cascade.view.height )
+                {
+                    ++lit;
+                    continue;
+                }
+
+                if ( cascade.depth[static_cast<std::size_t>( y ) * cascade.view.width + x] >= reference )
+                    ++lit;
+            }
+        }
+
+        return static_cast<float>( lit ) / taps;
+    }
+
+private:
+
+    struct Cascade {
+        RasterView view;
+        std::vector<float> depth;
+        float texel;                // world size of a texel
+    };
+
+    void add_cascade(Scene const& scene, std::vector<Branch> const& branches, std::vector<Leaf> const& leaves,
+                     glm::vec3 const& center, float const radius, glm::vec3 const& direction) {
+
+        Cascade cascade;
+        cascade.view = RasterView::orthographic_view( center, direction, 2.0f * radius, settings.resolution, settings.resolution );
+        cascade.texel = 2.0f * radius / settings.resolution;
+
+        RasterSettings raster;
+        raster.threads = settings.threads;
+        raster.shade = false;
+        raster.ground = false;
+
+        RasterTarget target;
+        Rasterizer( raster ).draw( scene, branches, leaves, cascade.view, target );
+        cascade.depth = std::move( target.depth );
+
+        cascades.push_back( std::move( cascade ) );
+    }
+
+    std::size_t select(glm::vec3 const& point) const {
+
+        if ( splits.empty() )
+            return 0U;
+
+        float depth = glm::dot( point - cameraPosition, cameraForward );
+        for ( std::size_t c = 0; c < splits.size(); ++c )
+        {
+            if ( depth <= splits[c] )
+                return c;
+        }
+
+        return splits.size() - 1;
+    }
+
+    ShadowMapSettings settings;
+    std::vector<Cascade> cascades;
+    std::vector<float> splits;
+    glm::vec3 cameraPosition = glm::vec3(0.0f);
+    glm::vec3 cameraForward = glm::vec3(0.0f, 0.0f, -1.0f);
+};
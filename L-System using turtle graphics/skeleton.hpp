@@ -0,0 +1,70 @@
+#pragma once
+
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+
+/// The bracket hierarchy of a derivation: every "[ ... ]" subtree is a bone,
+/// the whole tree is the root bone 0. LTurtle records a bone when it pushes
+/// (its parent is the bone being drawn, its rest frame is the turtle state at
+/// the bracket) and tags every branch and leaf with the bone it was drawn in.
+/// A bone always comes after its parent, so walking the bones in order visits
+/// parents before children.
+struct Skeleton {
+
+    std::vector<std::int32_t> parent;       // -1 for the root
+    std::vector<std::uint32_t> depth;       // bracket nesting level
+    std::vector<glm::vec3> origin;          // rest pivot (turtle position at "[", at the start for the root)
+    std::vector<glm::vec3> forward;         // rest direction (turtle forward at "[", at the start for the root)
+
+    std::vector<std::uint32_t> branch_bones;    // bone of every branch, in the order of the branches
+    std::vector<std::uint32_t> leaf_bones;      // bone of every leaf, in the order of the leaves
+
+    Skeleton() {
+
+        clear();
+    }
+
+    /// Removes all bones except the root, which rests at the given turtle state.
+    void clear(glm::vec3 const& root_origin = glm::vec3(0.0f), glm::vec3 const& root_forward = glm::vec3(0.0f, 1.0f, 0.0f)) {
+
+        parent.assign( 1U, -1 );
+        depth.assign( 1U, 0U );
+        origin.assign( 1U, root_origin );
+        forward.assign( 1U, root_forward );
+        branch_bones.clear();
+        leaf_bones.clear();
+        current = 0U;
+    }
+
+    std::size_t size() const {
+
+        return parent.size();
+    }
+
+    /// Bone the next primitives belong to.
+    std::uint32_t current_bone() const {
+
+        return current;
+    }
+
+    /// Opens a child bone of the current one.
+    void push_bone(glm::vec3 const& rest_origin, glm::vec3 const& rest_forward) {
+
+        parent.push_back( static_cast<std::int32_t>( current ) );
+        depth.push_back( depth[current] + 1U );
+        origin.push_back( rest_origin );
+        forward.push_back( rest_forward );
+        current = static_cast<std::uint32_t>( parent.size() - 1U );
+    }
+
+    /// Returns to the parent of the current bone.
+    void pop_bone() {
+
+        if ( parent[current] >= 0 )
+            current = static_cast<std::uint32_t>( parent[current] );
+    }
+
+private:
+    std::uint32_t current = 0U;
+};
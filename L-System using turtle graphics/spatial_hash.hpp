@@ -0,0 +1,229 @@
+#pragma once
+
+#include "glm_headers.hpp"
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+/// Settings of the spatial hash.
+struct SpatialHashSettings {
+    float cell_size = 0.5f;             // edge of a grid cell in world units
+    std::uint32_t capacity_log2 = 20U;  // the table has 2^capacity_log2 cells
+};
+
+/// A hashed grid marking the space occupied by obstacles and generated branches.
+/// Every occupied cell remembers its owner (a tree, or "obstacle") so a growing tree
+/// collides with its neighbours but not with itself. Inserts are lock-free: a cell is
+/// claimed by a compare-and-swap of its key and the first owner stays, so trees can be
+/// generated in parallel into the same hash.
+struct SpatialHash {
+
+    static constexpr std::uint32_t obstacle = 0xFFFFFFFFU;
+
+    explicit SpatialHash(SpatialHashSettings const& settings_ = SpatialHashSettings())
+        : settings(settings_)
+        , mask((std::size_t(1) << settings_.capacity_log2) - 1U)
+        , cells(new Cell[std::size_t(1) << settings_.capacity_log2])
+    {}
+
+    float cell_size() const {
+
+        return settings.cell_size;
+    }
+
+    SpatialHashSettings const& hash_settings() const {
+
+        return settings;
+    }
+
+    /// Marks the cell of the point, returns false when the table is full.
+    bool insert(glm::vec3 const& p, std::uint32_t const owner) {
+
+        Cell* cell = find( make_key( p ), true );
+        if ( cell == nullptr )
+            return false;
+
+        // the first owner wins
+        std::uint32_t expected = empty_owner;
+        cell->owner.compare_exchange_strong( expected, owner, std::memory_order_acq_rel );
+
+        return true;
+    }
+
+    /// Marks the cells along a segment.
+    void insert_segment(glm::vec3 const& a, glm::vec3 const& b, std::uint32_t const owner) {
+
+        int steps = segment_steps( a, b );
+        for ( int s = 0; s <= steps; ++s )
+        {
+            insert( a + ( b - a ) * ( static_cast<float>( s ) / steps ), owner );
+        }
+    }
+
+    /// Marks the cell of the point for "owner" unless a lower owner (or an obstacle) holds
+    /// it; the lowest owner wins, so the result does not depend on the order of the claims.
+    /// Returns false when the table is full.
+    bool claim(glm::vec3 const& p, std::uint32_t const owner) {
+
+        Cell* cell = find( make_key( p ), true );
+        if ( cell == nullptr )
+            return false;
+
+        std::uint32_t current = cell->owner.load( std::memory_order_acquire );
+        while ( current != obstacle && owner < current
+                && !cell->owner.compare_exchange_weak( current, owner, std::memory_order_acq_rel ) )
+        {
+        }
+
+        return true;
+    }
+
+    /// Claims the cells along a segment.
+    void claim_segment(glm::vec3 const& a, glm::vec3 const& b, std::uint32_t const owner) {
+
+        int steps = segment_steps( a, b );
+        for ( int s = 0; s <= steps; ++s )
+        {
+            claim( a + ( b - a ) * ( static_cast<float>( s ) / steps ), owner );
+        }
+    }
+
+    /// Marks all cells overlapping an axis aligned box as an obstacle.
+    void insert_box(glm::vec3 const& minimum, glm::vec3 const& maximum) {
+
+        glm::ivec3 lo = coordinates( minimum ), hi = coordinates( maximum );
+        for ( int z = lo.z; z <= hi.z; ++z )
+        {
+            for ( int y = lo.y; y <= hi.y; ++y )
+            {
+                for ( int x = lo.x; x <= hi.x; ++x )
+                {
+                    insert( ( glm::vec3( x, y, z ) + 0.5f ) * settings.cell_size, obstacle );
+                }
+            }
+        }
+    }
+
+    /// Tells whether the cell of the point is occupied by anything but "owner".
+    bool occupied(glm::vec3 const& p, std::uint32_t const owner) const {
+
+        Cell const* cell = find( make_key( p ), false );
+        if ( cell == nullptr )
+            return false;
+
+        std::uint32_t current = cell->owner.load( std::memory_order_acquire );
+        return current != empty_owner && current != owner;
+    }
+
+    /// Tells whether a segment passes through space occupied by anything but "owner".
+    bool occupied_segment(glm::vec3 const& a, glm::vec3 const& b, std::uint32_t const owner) const {
+
+        int steps = segment_steps( a, b );
+        for ( int s = 0; s <= steps; ++s )
+        {
+            if ( occupied( a + ( b - a ) * ( static_cast<float>( s ) / steps ), owner ) )
+                return true;
+        }
+
+        return false;
+    }
+
+    /// Tells whether the cell of the point is held by an owner lower than "owner" (obstacles are not).
+    bool claimed_below(glm::vec3 const& p, std::uint32_t const owner) const {
+
+        Cell const* cell = find( make_key( p ), false );
+        return cell != nullptr && cell->owner.load( std::memory_order_acquire ) < owner;
+    }
+
+    /// Tells whether a segment passes through a cell held by an owner lower than "owner".
+    bool claimed_below_segment(glm::vec3 const& a, glm::vec3 const& b, std::uint32_t const owner) const {
+
+        int steps = segment_steps( a, b );
+        for ( int s = 0; s <= steps; ++s )
+        {
+            if ( claimed_below( a + ( b - a ) * ( static_cast<float>( s ) / steps ), owner ) )
+                return true;
+        }
+
+        return false;
+    }
+
+    /// Empties the hash (not thread-safe).
+    void clear() {
+
+        for ( std::size_t i = 0; i <= mask; ++i )
+        {
+            cells[i].key.store( 0U );
+            cells[i].owner.store( empty_owner );
+        }
+    }
+
+private:
+
+    static constexpr std::uint32_t empty_owner = 0xFFFFFFFEU;
+
+    struct Cell {
+        std::atomic<std::uint64_t> key{ 0U };
+        std::atomic<std::uint32_t> owner{ empty_owner };
+    };
+
+    /// Samples every half cell, so no cell along the segment is skipped.
+    int segment_steps(glm::vec3 const& a, glm::vec3 const& b) const {
+
+        return std::max( 1, static_cast<int>( std::ceil( 2.0f * glm::length( b - a ) / settings.cell_size ) ) );
+    }
+
+    glm::ivec3 coordinates(glm::vec3 const& p) const {
+
+        return glm::ivec3( glm::floor( p / settings.cell_size ) );
+    }
+
+    /// Grid coordinates (21 bits each); the top bit is set so that 0 can mark empty cells.
+    std::uint64_t make_key(glm::vec3 const& p) const {
+
+        glm::ivec3 c = coordinates( p );
+
+        auto coordinate = [](int const v) {
+            std::int64_t shifted = static_cast<std::int64_t>( v ) + ( 1 << 20 );
+            return static_cast<std::uint64_t>( std::min<std::int64_t>( std::max<std::int64_t>( shifted, 0 ), ( 1 << 21 ) - 1 ) );
+        };
+
+        return ( 1ULL << 63 ) | ( coordinate( c.x ) << 42 ) | ( coordinate( c.y ) << 21 ) | coordinate( c.z );
+    }
+
+    /// Finds the cell of the key with linear probing, optionally claiming an empty one.
+    Cell* find(std::uint64_t const key, bool const insert) const {
+
+        // splitmix64 finalizer
+        std::uint64_t h = key;
+        h = ( h ^ ( h >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+        h = ( h ^ ( h >> 27 ) ) * 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+
+        for ( std::size_t probe = 0; probe < 32U; ++probe )
+        {
+            Cell& cell = cells[( h + probe ) & mask];
+            std::uint64_t current = cell.key.load( std::memory_order_acquire );
+
+            if ( current == key )
+                return &cell;
+
+            if ( current == 0U )
+            {
+                if ( !insert )
+                    return nullptr;
+
+                if ( cell.key.compare_exchange_strong( current, key, std::memory_order_acq_rel ) || current == key )
+                    return &cell;
+            }
+        }
+
+        return nullptr;
+    }
+
+    SpatialHashSettings settings;
+    std::size_t mask;
+    std::unique_ptr<Cell[]> cells;
+};
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+/// An interned symbol of an L-system. The ids 0 - 255 are the single characters
+/// themselves, so plain char grammars need no table; named tokens get ids from 256 on.
+using Symbol = std::uint16_t;
+
+constexpr Symbol invalid_symbol = 0xFFFF;
+
+/// Interns named tokens to 16-bit ids and tells which turtle command each symbol is.
+/// A character is the command of the same name; a named token is a no-op for the
+/// turtle unless it is bound to a command, e.g. "Internode" -> 'B'. Only the named
+/// tokens are stored, the ids of the characters are implicit.
+struct SymbolTable {
+
+    SymbolTable()
+        : commands(256U)
+    {
+        for ( std::size_t c = 0; c < 256U; ++c )
+        {
+            commands[c] = static_cast<char>( c );
+        }
+    }
+
+    // the index refers to the names -> rebuilt for a copy
+    SymbolTable(SymbolTable const& other)
+        : names(other.names)
+        , commands(other.commands)
+    {
+        reindex();
+    }
+
+    SymbolTable& operator=(SymbolTable const& other) {
+
+        names = other.names;
+        commands = other.commands;
+        reindex();
+        return *this;
+    }
+
+    SymbolTable(SymbolTable&&) = default;
+    SymbolTable& operator=(SymbolTable&&) = default;
+
+    /// Id of "name" (added when new), invalid_symbol when the table is full.
+    /// Looking up a known name does not allocate.
+    Symbol intern(std::string_view const name) {
+
+        if ( name.size() == 1U )
+            return static_cast<unsigned char>( name[0] );
+
+        auto found = ids.find( name );
+        if ( found != ids.end() )
+            return found->second;
+
+        if ( size() >= invalid_symbol )
+            return invalid_symbol;
+
+        Symbol symbol = static_cast<Symbol>( size() );
+        names.emplace_back( name );
+        commands.push_back( '\0' );
+        ids.emplace( names.back(), symbol );
+
+        return symbol;
+    }
+
+    /// Looks "name" up without adding it, false when it is not interned.
+    bool find(std::string_view const name, Symbol& symbol) const {
+
+        if ( name.size() == 1U )
+        {
+            symbol = static_cast<unsigned char>( name[0] );
+            return true;
+        }
+
+        auto found = ids.find( name );
+        if ( found == ids.end() )
+            return false;
+
+        symbol = found->second;
+        return true;
+    }
+
+    std::string_view name(Symbol const symbol) const {
+
+        if ( symbol < 256U )
+            return std::string_view( &characters()[symbol], 1U );
+
+        return names[symbol - 256U];
+    }
+
+    /// Makes the turtle execute "command" for "symbol" ('\0' -> no-op).
+    void bind(Symbol const symbol, char const command) { commands[symbol] = command; }
+
+    char command(Symbol const symbol) const { return commands[symbol]; }
+
+    /// Turtle command of every symbol, indexed by id.
+    std::vector<char> const& command_table() const { return commands; }
+
+    std::size_t size() const { return 256U + names.size(); }
+
+    /// Appends the symbols of "text" to "out": every character but spaces and tabs is
+    /// a symbol, "{name}" is the named token "name". False on an unterminated brace or a full table.
+    bool parse(std::string_view const text, std::vector<Symbol>& out) {
+
+        for ( std::size_t i = 0; i < text.size(); ++i )
+        {
+            if ( text[i] == ' ' || text[i] == '\t' )
+                continue;
+
+            if ( text[i] != '{' )
+            {
+                out.push_back( static_cast<unsigned char>( text[i] ) );
+                continue;
+            }
+
+            std::size_t close = text.find( '}', i + 1U );
+            if ( close == std::string_view::npos )
+                return false;
+
+            Symbol symbol = intern( text.substr( i + 1U, close - i - 1U ) );
+            if ( symbol == invalid_symbol )
+                return false;
+
+            out.push_back( symbol );
+            i = close;
+        }
+
+        return true;
+    }
+
+private:
+
+    void reindex() {
+
+        ids.clear();
+        for ( std::size_t n = 0; n < names.size(); ++n )
+        {
+            ids.emplace( names[n], static_cast<Symbol>( 256U + n ) );
+        }
+    }
+
+    /// Every character once, in order (the names of the symbols 0 - 255).
+    static char const* characters() {
+
+        struct Characters {
+            char all[256];
+
+            Characters() {
+
+                for ( std::size_t c = 0; c < 256U; ++c )
+                {
+                    all[c] = static_cast<char>( c );
+                }
+            }
+        };
+        static Characters const table;
+
+        return table.all;
+    }
+
+    std::deque<std::string> names;      // of the named tokens (id 256 + n); a deque keeps the strings the index views in place
+    std::vector<char> commands;
+    std::unordered_map<std::string_view, Symbol> ids;
+};
+
+/// Productions over symbols stored as dense tables indexed by the head symbol, so
+/// finding a rule is an array read instead of a hash lookup. A head may have several
+/// weighted alternatives (a stochastic L-system); alternative a has the body
+/// symbols[offsets[a] .. offsets[a] + lengths[a]). The tables are public for serialization.
+struct SymbolRules {
+
+    static constexpr std::uint32_t no_rule = 0xFFFFFFFF;
+
+    // per head symbol
+    std::vector<std::uint32_t> firsts;      // its first alternative, no_rule -> no rule
+    std::vector<std::uint32_t> counts;      // number of alternatives
+    std::vector<float> totals;              // sum of their weights
+
+    // per alternative
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> lengths;
+    std::vector<float> weights;             // running sum of the weights of the head up to this one
+
+    std::vector<Symbol> symbols;
+
+    SymbolRules() = default;
+
+    /// Compiles character rules, every character of a body being one symbol.
+    explicit SymbolRules(std::unordered_map<char, std::string> const& rules) {
+
+        std::vector<Symbol> body;
+        for ( auto const& rule : rules )
+        {
+            body.clear();
+            for ( char c : rule.second )
+            {
+                body.push_back( static_cast<unsigned char>( c ) );
+            }
+            add( static_cast<unsigned char>( rule.first ), body );
+        }
+    }
+
+    /// Sets the only rule of "head" (replacing earlier ones).
+    void add(Symbol const head, std::vector<Symbol> const& body) {
+
+        if ( head < firsts.size() )
+        {
+            firsts[head] = no_rule;
+            counts[head] = 0U;
+            totals[head] = 0.0f;
+        }
+
+        add_alternative( head, body.data(), body.size(), 1.0f );
+    }
+
+    /// Adds an alternative body chosen with probability weight / (sum of the weights of "head").
+    /// "body" must not point into "symbols".
+    void add_alternative(Symbol const head, Symbol const* body, std::size_t const length, float const weight) {
+
+        if ( head >= firsts.size() )
+        {
+            firsts.resize( head + 1U, no_rule );
+            counts.resize( head + 1U, 0U );
+            totals.resize( head + 1U, 0.0f );
+        }
+
+        std::uint32_t next = static_cast<std::uint32_t>( offsets.size() );
+
+        if ( firsts[head] == no_rule )
+        {
+            firsts[head] = next;
+        }
+        else if ( firsts[head] + counts[head] != next )
+        {
+            // the alternatives of a head stay contiguous -> move the earlier ones to the end
+            std::uint32_t first = firsts[head];
+            firsts[head] = next;
+            for ( std::uint32_t k = 0; k < counts[head]; ++k )
+            {
+                std::uint32_t offset = offsets[first + k], count = lengths[first + k];
+                float sum = weights[first + k];
+                offsets.push_back( offset );
+                lengths.push_back( count );
+                weights.push_back( sum );
+            }
+        }
+
+        totals[head] += weight;
+        offsets.push_back( static_cast<std::uint32_t>( symbols.size() ) );
+        lengths.push_back( static_cast<std::uint32_t>( length ) );
+        weights.push_back( totals[head] );
+        symbols.insert( symbols.end(), body, body + length );
+        ++counts[head];
+    }
+
+    bool has(Symbol const head) const {
+
+        return head < firsts.size() && firsts[head] != no_rule;
+    }
+
+    /// The alternative of "head" for a uniform random number "u" in [0, 1).
+    std::uint32_t choose(Symbol const head, float const u) const {
+
+        std::uint32_t first = firsts[head], last = first + counts[head] - 1U;
+        float target = u * totals[head];
+
+        std::uint32_t a = first;
+        while ( a < last && weights[a] <= target )
+        {
+            ++a;
+        }
+
+        return a;
+    }
+
+    Symbol const* body(std::uint32_t const alternative) const { return symbols.data() + offsets[alternative]; }
+
+    std::uint32_t length(std::uint32_t const alternative) const { return lengths[alternative]; }
+
+    /// Heads with a rule, in id order.
+    std::vector<Symbol> heads() const {
+
+        std::vector<Symbol> result;
+        for ( std::size_t s = 0; s < firsts.size(); ++s )
+        {
+            if ( firsts[s] != no_rule )
+                result.push_back( static_cast<Symbol>( s ) );
+        }
+
+        return result;
+    }
+};
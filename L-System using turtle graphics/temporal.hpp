@@ -0,0 +1,260 @@
+#pragma once
+
+#include "ray_tracing.hpp"
+#include "rasterizer.hpp"
+#include "parallel.hpp"
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+/// Settings of the temporal reuse.
+struct TemporalSettings {
+    int max_history = 16;           // samples a pixel accumulates at most
+    float depth_tolerance = 0.03f;  // relative depth behind a closer footprint treated as a disocclusion
+    int validation_stride = 16;     // every n-th reused pixel is traced again to catch stale history (0 -> never)
+    RenderSettings render;          // threads and soft shadow sampling (samples are per traced pixel)
+};
+
+/// Renders camera fly-throughs of a static tree reusing the previous frame.
+/// The surfaces seen in the last frame are reprojected into the new camera
+/// (the motion vectors of a static scene follow from the two cameras). Rays are
+/// traced only where the history is invalid: holes, disocclusions (a reprojected
+/// surface behind the footprint of a closer one), silhouettes and pixels whose sparse
+/// validation ray hit a different primitive. Everywhere else the shading is reused,
+/// and validated pixels accumulate their new sample into the history. The sky is
+/// looked up without tracing wherever the ray misses the ground and the box of the tree.
+struct TemporalRenderer {
+
+    explicit TemporalRenderer(TemporalSettings const& settings_ = TemporalSettings())
+        : settings(settings_)
+    {}
+
+    /// Renders the next frame into "image".
+    void render(Scene const& scene, Camera const& camera, Image& image) {
+
+        int width = image.width, height = image.height;
+        std::size_t count = static_cast<std::size_t>( width ) * height;
+
+        std::vector<Pixel> current( count );
+        std::vector<std::uint8_t> trace( count, 1U );
+
+        if ( history.size() == count )
+        {
+            std::vector<float> cover( count, std::numeric_limits<float>::max() );
+            reproject( camera, width, height, current, cover );
+            reject_disocclusions( width, height, current, cover, trace );
+        }
+
+        // sparse validation of the reused pixels
+        std::vector<std::uint32_t> validate;
+        std::vector<std::uint8_t> validated( count, 0U );
+        if ( settings.validation_stride > 0 )
+        {
+            for ( std::size_t i = 0; i < count; ++i )
+            {
+                if ( !trace[i] && ( i + frame ) % static_cast<std::size_t>( settings.validation_stride ) == 0U )
+                {
+                    validate.push_back( static_cast<std::uint32_t>( i ) );
+                    validated[i] = 1U;
+                }
+            }
+        }
+
+        std::vector<std::uint8_t> mismatch( count, 0U );
+        traced = shade( scene, camera, width, height, validate, current, mismatch );
+
+        // a different primitive -> the neighbourhood is stale as well
+        for ( std::uint32_t i : validate )
+        {
+            if ( !mismatch[i] )
+                continue;
+
+            int x = static_cast<int>( i % width ), y = static_cast<int>( i / width );
+            for ( int dy = -1; dy <= 1; ++dy )
+            {
+                for ( int dx = -1; dx <= 1; ++dx )
+                {
+                    int nx = x + dx, ny = y + dy;
+                    if ( nx >= 0 && ny >= 0 && nx < width && ny < height )
+                        trace[static_cast<std::size_t>( ny ) * width + nx] = 1U;
+                }
+            }
+        }
+
+        // a validated pixel already holds the sample of this frame (restarted on a mismatch)
+        std::vector<std::uint32_t> invalid;
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            if ( trace[i] && !validated[i] )
+            {
+                current[i].samples = 0U;
+                invalid.push_back( static_cast<std::uint32_t>( i ) );
+            }
+        }
+
+        traced += shade( scene, camera, width, height, invalid, current, mismatch );
+
+        for ( std::size_t i = 0; i < count; ++i )
+        {
+            image.pixels[i] = current[i].color;
+        }
+
+        history.swap( current );
+        ++frame;
+    }
+
+    /// Number of pixels traced in the last frame (the rest reused the history or are sky).
+    std::size_t traced_pixels() const {
+
+        return traced;
+    }
+
+    /// Forgets the history (e.g. after the scene changed).
+    void reset() {
+
+        history.clear();
+    }
+
+private:
+
+    struct Pixel {
+        glm::vec3 color = glm::vec3(0.0f);
+        glm::vec3 position = glm::vec3(0.0f);       // world position of the surface
+        float depth = std::numeric_limits<float>::max();     // along the view direction, as RasterView::project gives it
+        std::uint32_t id = Hit::make_id( Hit::Kind::Miss, 0U );
+        std::uint16_t samples = 0U;
+    };
+
+    /// Splats every surface of the last frame into the pixel it moves to (closest wins), and its
+    /// footprint into "cover": a pixel of the last frame spans old depth / new depth pixels now,
+    /// so a surface coming closer also covers the pixels between its samples.
+    void reproject(Camera const& camera, int const width, int const height, std::vector<Pixel>& current,
+                   std::vector<float>& cover) const {
+
+        RasterView view = RasterView::from_camera( camera, width, height );
+
+        for ( Pixel const& old : history )
+        {
+            // the sky has no position, shade() finds it without traversal
+            if ( old.samples == 0U || ( old.id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Miss ) )
+                continue;
+
+            glm::vec3 p = view.project( old.position );
+            if ( p.z <= view.near || p.x < 0.0f || p.y < 0.0f || p.x >= width || p.y >= height )
+                continue;
+
+            Pixel& target = current[static_cast<std::size_t>( p.y ) * width + static_cast<std::size_t>( p.x )];
+            if ( p.z < target.depth )
+            {
+                target = old;
+                target.depth = p.z;
+            }
+
+            // the footprint, at most a few pixels wide (surfaces right in front of the camera)
+            float radius = std::min( 0.5f * old.depth / p.z, 4.0f );
+            int x0 = std::max( static_cast<int>( std::ceil( p.x - radius - 0.5f ) ), 0 );
+            int x1 = std::min( static_cast<int>( std::floor( p.x + radius - 0.5f ) ), width - 1 );
+            int y0 = std::max( static_cast<int>( std::ceil( p.y - radius - 0.5f ) ), 0 );
+            int y1 = std::min( static_cast<int>( std::floor( p.y + radius - 0.5f ) ), height - 1 );
+
+            for ( int y = y0; y <= y1; ++y )
+            {
+                for ( int x = x0; x <= x1; ++x )
+                {
+                    float& depth = cover[static_cast<std::size_t>( y ) * width + x];
+                    depth = std::min( depth, p.z );
+                }
+            }
+        }
+    }
+
+    /// Keeps only reprojected pixels whose surface is at the depth expected of it: not behind the
+    /// footprint of a closer surface (background showing through the gaps between its samples).
+    /// Pixels next to another primitive are traced again as well: the sample reused for a pixel
+    /// lies anywhere inside it, at a silhouette it may be on the other side of the edge.
+    void reject_disocclusions(int const width, int const height, std::vector<Pixel> const& current,
+                              std::vector<float> const& cover, std::vector<std::uint8_t>& trace) const {
+
+        for ( int y = 0; y < height; ++y )
+        {
+            for ( int x = 0; x < width; ++x )
+            {
+                std::size_t i = static_cast<std::size_t>( y ) * width + x;
+                if ( current[i].samples == 0U )
+                    continue;
+
+                std::uint32_t id = current[i].id;
+                bool edge = ( x > 0 && current[i - 1].id != id ) || ( x + 1 < width && current[i + 1].id != id )
+                    || ( y > 0 && current[i - width].id != id ) || ( y + 1 < height && current[i + width].id != id );
+
+                trace[i] = edge || current[i].depth > cover[i] * ( 1.0f + settings.depth_tolerance ) ? 1U : 0U;
+            }
+        }
+    }
+
+    /// Traces the listed pixels and blends the samples into their history
+    /// (a primitive mismatch restarts the accumulation). Returns the number of rays
+    /// traced, sky pixels are looked up without.
+    std::size_t shade(Scene const& scene, Camera const& camera, int const width, int const height,
+                      std::vector<std::uint32_t> const& pixels, std::vector<Pixel>& current, std::vector<std::uint8_t>& mismatch) const {
+
+        // the view depth of the hits, the one reproject() compares
+        glm::vec3 right, up, forward;
+        camera.basis( right, up, forward );
+
+        std::atomic<std::size_t> rays{ 0U };
+
+        parallel_for( pixels.size(), settings.render.threads, [&](std::size_t const k) {
+            std::uint32_t i = pixels[k];
+            int x = static_cast<int>( i % width ), y = static_cast<int>( i / width );
+            Pixel& pixel = current[i];
+
+            Random random( Random::seed( x, y, pixel.samples, frame ) );
+            bool stochastic = settings.render.samples > 1 || scene.light.angular_radius > 0.0f;
+            float jx = stochastic ? random.next() : 0.5f;
+            float jy = stochastic ? random.next() : 0.5f;
+
+            Ray ray = camera.generate_ray( x + jx, y + jy, width, height );
+            Hit hit;
+            glm::vec3 color;
+
+            // above the horizon and outside the box of the tree -> Trace() would find the sky
+            Hit ground;
+            bool sky = !RayPlaneIntersection( ray, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f), ground.t, ground )
+                && ( scene.bvh.empty() || BVH::enter( scene.bvh.nodes[0], ray.origin, 1.0f / ray.direction, ground.t )
+                                          == std::numeric_limits<float>::infinity() );
+            if ( sky )
+            {
+                color = Sky( scene, ray.direction );
+            }
+            else
+            {
+                color = Trace( scene, ray, stochastic ? &random : nullptr, &hit );
+                ++rays;
+            }
+
+            if ( pixel.samples > 0U && hit.id() != pixel.id )
+            {
+                mismatch[i] = 1U;
+                pixel.samples = 0U;
+            }
+
+            int samples = std::min<int>( pixel.samples + 1, settings.max_history );
+            pixel.color = pixel.samples == 0U ? color : glm::mix( pixel.color, color, 1.0f / samples );
+            pixel.samples = static_cast<std::uint16_t>( samples );
+            pixel.id = hit.id();
+            pixel.position = hit.intersection;
+            pixel.depth = hit.is_miss() ? std::numeric_limits<float>::max() : glm::dot( hit.intersection - camera.position, forward );
+        } );
+
+        return rays;
+    }
+
+    TemporalSettings settings;
+    std::vector<Pixel> history;
+    std::uint32_t frame = 0U;
+    std::size_t traced = 0U;
+};
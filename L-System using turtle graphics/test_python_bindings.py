@@ -0,0 +1,52 @@
+# Smoke test of the "lsystem" module (build it first, see setup.py):
+#
+#   python test_python_bindings.py
+#
+# Generates one tree and checks that the arrays are read-only views owned by the Geometry,
+# and that a view stays valid after the last Python reference to its Geometry is gone.
+
+import gc
+import sys
+
+import numpy as np
+
+import lsystem
+
+
+def main():
+    grammar = lsystem.Grammar(lsystem.Config(), {"X": "B[&+*X][&-*X][^*X]*L"}, "BBX")
+    tree = lsystem.generate(grammar)
+    n = tree.branch_count
+    assert n > 0, "the grammar generates no branches"
+
+    # a (n, 3) float32 view of Branch::p1, read-only, with the Geometry as its base
+    p1 = tree.p1
+    assert p1.shape == (n, 3), p1.shape
+    assert p1.dtype == np.float32, p1.dtype
+    assert not p1.flags.writeable
+    assert not p1.flags.owndata
+    assert p1.base is tree
+
+    try:
+        p1[0, 0] = 1.0
+    except ValueError:
+        pass
+    else:
+        raise AssertionError("p1 is writeable")
+
+    # the view of the whole records shows the same points
+    assert np.array_equal(tree.branches[:, 0:3], p1)
+
+    # the view keeps the Geometry alive
+    expected = p1.copy()
+    del tree
+    gc.collect()
+    assert p1.base.branch_count == n
+    assert np.array_equal(p1, expected)
+
+    print("lsystem: %d branches, views ok" % n)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
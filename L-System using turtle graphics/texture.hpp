@@ -0,0 +1,261 @@
+#pragma once
+
+#include "glm_headers.hpp"
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// An RGBA8 texture for the CPU tracer.
+/// Texels are stored in 8x8 tiles, Morton (Z) ordered inside each tile, so the
+/// four texels of a bilinear lookup and its neighbours usually share a cache line
+/// even when rays hit the surfaces in random order. Every texture has a full
+/// mip pyramid, the level is selected from the footprint of the ray.
+struct Texture2D {
+
+    /// Addressing of coordinates outside of [0, 1].
+    enum class Wrap { Repeat, Clamp };
+
+    Texture2D() = default;
+
+    /// Creates the texture (and its mip levels) from row-major RGBA8 data.
+    Texture2D(int const width, int const height, unsigned char const* rgba, Wrap const wrap_ = Wrap::Repeat)
+        : wrap(wrap_)
+    {
+        mips.push_back( make_level( width, height ) );
+        for ( int y = 0; y < height; ++y )
+        {
+            for ( int x = 0; x < width; ++x )
+            {
+                unsigned char const* texel = rgba + ( static_cast<std::size_t>(y) * width + x ) * 4;
+                std::uint32_t packed = texel[0] | ( texel[1] << 8 ) | ( texel[2] << 16 ) | ( static_cast<std::uint32_t>(texel[3]) << 24 );
+                mips[0].texels[texel_index( mips[0], x, y )] = packed;
+            }
+        }
+
+        // box filter each level down to 1x1
+        while ( mips.back().width > 1 || mips.back().height > 1 )
+        {
+            Level const& src = mips.back();
+            Level dst = make_level( std::max( src.width / 2, 1 ), std::max( src.height / 2, 1 ) );
+
+            for ( int y = 0; y < dst.height; ++y )
+            {
+                for ( int x = 0; x < dst.width; ++x )
+                {
+                    int x0 = std::min( 2 * x, src.width - 1 ), x1 = std::min( 2 * x + 1, src.width - 1 );
+                    int y0 = std::min( 2 * y, src.height - 1 ), y1 = std::min( 2 * y + 1, src.height - 1 );
+
+                    glm::vec4 sum = unpack( src.texels[texel_index( src, x0, y0 )] ) + unpack( src.texels[texel_index( src, x1, y0 )] )
+                                  + unpack( src.texels[texel_index( src, x0, y1 )] ) + unpack( src.texels[texel_index( src, x1, y1 )] );
+
+                    dst.texels[texel_index( dst, x, y )] = pack( 0.25f * sum );
+                }
+            }
+
+            mips.push_back( std::move( dst ) );
+        }
+    }
+
+    bool empty() const {
+
+        return mips.empty();
+    }
+
+    int width() const {
+
+        return mips.empty() ? 0 : mips[0].width;
+    }
+
+    int height() const {
+
+        return mips.empty() ? 0 : mips[0].height;
+    }
+
+    int levels() const {
+
+        return static_cast<int>( mips.size() );
+    }
+
+    /// Returns a single texel of a mip level (coordinates are wrapped).
+    glm::vec4 fetch(int const level, int const x, int const y) const {
+
+        Level const& l = mips[level];
+        return unpack( l.texels[texel_index( l, address( x, l.width ), address( y, l.height ) )] );
+    }
+
+    /// Bilinearly filtered lookup; "footprint" is the size of the area covered
+    /// by the ray in UV units and selects the mip level (0 -> the finest level).
+    glm::vec4 sample(glm::vec2 const& uv, float const footprint = 0.0f) const {
+
+        float texels = footprint * static_cast<float>( std::max( width(), height() ) );
+        int level = 0;
+
+        if ( texels > 1.0f )
+            level = std::min( static_cast<int>( std::log2( texels ) + 0.5f ), levels() - 1 );
+
+        return sample_level( uv, level );
+    }
+
+    /// Bilinearly filtered lookup in the given mip level.
+    glm::vec4 sample_level(glm::vec2 const& uv, int const level) const {
+
+        Level const& l = mips[level];
+
+        float x = uv.x * l.width - 0.5f;
+        float y = uv.y * l.height - 0.5f;
+        float fx0 = std::floor( x );
+        float fy0 = std::floor( y );
+        float fx = x - fx0;
+        float fy = y - fy0;
+
+        int x0 = static_cast<int>( fx0 ), y0 = static_cast<int>( fy0 );
+        int ax0 = address( x0, l.width ), ax1 = address( x0 + 1, l.width );
+        int ay0 = address( y0, l.height ), ay1 = address( y0 + 1, l.height );
+
+        std::uint32_t t00 = l.texels[texel_index( l, ax0, ay0 )];
+        std::uint32_t t10 = l.texels[texel_index( l, ax1, ay0 )];
+        std::uint32_t t01 = l.texels[texel_index( l, ax0, ay1 )];
+        std::uint32_t t11 = l.texels[texel_index( l, ax1, ay1 )];
+
+        return bilinear( t00, t10, t01, t11, fx, fy );
+    }
+
+private:
+
+    struct Level {
+        int width;
+        int height;
+        int tiles_x;
+        std::vector<std::uint32_t> texels;
+    };
+
+    static constexpr int tile_size = 8;
+
+    static Level make_level(int const width, int const height) {
+
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.tiles_x = ( width + tile_size - 1 ) / tile_size;
+
+        int tilesY = ( height + tile_size - 1 ) / tile_size;
+        level.texels.assign( static_cast<std::size_t>( level.tiles_x ) * tilesY * tile_size * tile_size, 0U );
+
+        return level;
+    }
+
+    /// Index of a texel: tiles are row-major, texels inside a tile are Morton ordered.
+    static std::size_t texel_index(Level const& level, int const x, int const y) {
+
+        // spreads 3 bits to the even bit positions
+        static constexpr std::array<std::uint32_t, 8> spread = { 0, 1, 4, 5, 16, 17, 20, 21 };
+
+        std::size_t tile = static_cast<std::size_t>( y / tile_size ) * level.tiles_x + ( x / tile_size );
+        std::uint32_t morton = spread[x & ( tile_size - 1 )] | ( spread[y & ( tile_size - 1 )] << 1 );
+
+        return tile * ( tile_size * tile_size ) + morton;
+    }
+
+    int address(int const coord, int const size) const {
+
+        if ( wrap == Wrap::Clamp )
+            return std::min( std::max( coord, 0 ), size - 1 );
+
+        int wrapped = coord % size;
+        return wrapped < 0 ? wrapped + size : wrapped;
+    }
+
+    static glm::vec4 unpack(std::uint32_t const texel) {
+
+        return glm::vec4( texel & 0xFFU, ( texel >> 8 ) & 0xFFU, ( texel >> 16 ) & 0xFFU, texel >> 24 ) * ( 1.0f / 255.0f );
+    }
+
+    static std::uint32_t pack(glm::vec4 const& color) {
+
+        glm::vec4 c = glm::clamp( color, 0.0f, 1.0f ) * 255.0f + 0.5f;
+        return static_cast<std::uint32_t>( c.r ) | ( static_cast<std::uint32_t>( c.g ) << 8 )
+             | ( static_cast<std::uint32_t>( c.b ) << 16 ) | ( static_cast<std::uint32_t>( c.a ) << 24 );
+    }
+
+    /// Interpolates four RGBA8 texels, all four channels at once.
+    static glm::vec4 bilinear(std::uint32_t const t00, std::uint32_t const t10, std::uint32_t const t01, std::uint32_t const t11,
+                              float const fx, float const fy) {
+#if defined(__SSE2__)
+        __m128i zero = _mm_setzero_si128();
+        __m128i packed = _mm_setr_epi32( static_cast<int>( t00 ), static_cast<int>( t10 ), static_cast<int>( t01 ), static_cast<int>( t11 ) );
+        __m128i top = _mm_unpacklo_epi8( packed, zero );
+        __m128i bottom = _mm_unpackhi_epi8( packed, zero );
+
+        __m128 c00 = _mm_cvtepi32_ps( _mm_unpacklo_epi16( top, zero ) );
+        __m128 c10 = _mm_cvtepi32_ps( _mm_unpackhi_epi16( top, zero ) );
+        __m128 c01 = _mm_cvtepi32_ps( _mm_unpacklo_epi16( bottom, zero ) );
+        __m128 c11 = _mm_cvtepi32_ps( _mm_unpackhi_epi16( bottom, zero ) );
+
+        __m128 wx = _mm_set1_ps( fx );
+        __m128 wy = _mm_set1_ps( fy );
+        __m128 rowTop = _mm_add_ps( c00, _mm_mul_ps( _mm_sub_ps( c10, c00 ), wx ) );
+        __m128 rowBottom = _mm_add_ps( c01, _mm_mul_ps( _mm_sub_ps( c11, c01 ), wx ) );
+        __m128 result = _mm_mul_ps( _mm_add_ps( rowTop, _mm_mul_ps( _mm_sub_ps( rowBottom, rowTop ), wy ) ), _mm_set1_ps( 1.0f / 255.0f ) );
+
+        alignas(16) float out[4];
+        _mm_store_ps( out, result );
+
+        return glm::vec4( out[0], out[1], out[2], out[3] );
+#else
+        glm::vec4 rowTop = glm::mix( unpack( t00 ), unpack( t10 ), fx );
+        glm::vec4 rowBottom = glm::mix( unpack( t01 ), unpack( t11 ), fx );
+
+        return glm::mix( rowTop, rowBottom, fy );
+#endif
+    }
+
+    std::vector<Level> mips;
+    Wrap wrap = Wrap::Repeat;
+};
+
+/// A cube map for the skybox (mirrors "samplerCube skybox_tex" in ray_tracing.frag).
+/// Faces are in the OpenGL order +X, -X, +Y, -Y, +Z, -Z and should use Wrap::Clamp.
+struct Cubemap {
+
+    std::array<Texture2D, 6> faces;
+
+    /// Looks the direction up the same way as OpenGL does.
+    glm::vec4 sample(glm::vec3 const& direction) const {
+
+        glm::vec3 a = glm::abs( direction );
+        int face;
+        float sc, tc, ma;
+
+        if ( a.x >= a.y && a.x >= a.z )
+        {
+            face = direction.x > 0.0f ? 0 : 1;
+            ma = a.x;
+            sc = direction.x > 0.0f ? -direction.z : direction.z;
+            tc = -direction.y;
+        }
+        else if ( a.y >= a.z )
+        {
+            face = direction.y > 0.0f ? 2 : 3;
+            ma = a.y;
+            sc = direction.x;
+            tc = direction.y > 0.0f ? direction.z : -direction.z;
+        }
+        else
+        {
+            face = direction.z > 0.0f ? 4 : 5;
+            ma = a.z;
+            sc = direction.z > 0.0f ? direction.x : -direction.x;
+            tc = -direction.y;
+        }
+
+        glm::vec2 uv = 0.5f * ( glm::vec2( sc, tc ) / ma + 1.0f );
+
+        return faces[face].sample_level( uv, 0 );
+    }
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "intersection_records.hpp"
+#include "parallel.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+/// Result of a nearest branch query.
+struct NearestBranch {
+    std::uint32_t index = 0xFFFFFFFFU;      // 0xFFFFFFFF -> nothing within the distance
+    float distance = std::numeric_limits<float>::infinity();   // to the surface, negative inside
+    glm::vec3 point = glm::vec3(0.0f);      // closest point on the axis of the branch
+
+    bool found() const {
+
+        return index != 0xFFFFFFFFU;
+    }
+};
+
+/// Geometric queries over the output of LTurtle (for physics, placement, particles).
+/// The records and the BVH are built once; all queries are const and keep their
+/// state on the stack, so any number of threads can query at the same time.
+struct TreeQuery {
+
+    PrimitiveRecords records;
+    BVH bvh;
+
+    void build(std::vector<Branch> const& branches, std::vector<Leaf> const& leaves) {
+
+        records.build( branches, leaves );
+        bvh.build( records );
+    }
+
+    /// The branch whose surface is closest to the point (only within "max_distance").
+    NearestBranch nearest_branch(glm::vec3 const& point, float const max_distance = std::numeric_limits<float>::infinity()) const {
+
+        NearestBranch best;
+        best.distance = max_distance;
+
+        if ( bvh.empty() )
+            return best;
+
+        // as deep as BVH::traverse() goes, the build keeps the tree within the stack
+        std::uint32_t stack[BVH::stack_size];
+        int top = 0;
+        stack[top++] = 0U;
+
+        while ( top > 0 )
+        {
+            std::uint32_t n = stack[--top];
+            BVH::Node const& node = bvh.nodes[n];
+
+            // the whole node is farther than the best branch so far
+            if ( box_distance( node, point ) > best.distance )
+                continue;
+
+            if ( node.is_leaf() )
+            {
+                for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+                {
+                    std::uint32_t id = bvh.primitives[i];
+                    if ( ( id >> 30 ) != static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+                        continue;
+
+                    std::uint32_t index = id & 0x3FFFFFFFU;
+                    glm::vec3 axisPoint;
+                    float distance = branch_distance( records.branches[index], point, axisPoint );
+
+                    if ( distance < best.distance )
+                    {
+                        best.index = index;
+                        best.distance = distance;
+                        best.point = axisPoint;
+                    }
+                }
+                continue;
+            }
+
+            // visit the closer child first
+            std::uint32_t left = n + 1U, right = node.first;
+            if ( box_distance( bvh.nodes[left], point ) < box_distance( bvh.nodes[right], point ) )
+                std::swap( left, right );
+
+            stack[top++] = left;
+            stack[top++] = right;
+        }
+
+        return best;
+    }
+
+    /// The first branch or leaf on the segment from "a" to "b" (a miss when the segment is free).
+    Hit segment_cast(glm::vec3 const& a, glm::vec3 const& b) const {
+
+        Hit closest;
+
+        float length = glm::length( b - a );
+        if ( length <= 0.0f )
+            return closest;
+
+        Ray ray{ a, ( b - a ) / length };
+        closest.t = length;
+
+        bvh.traverse( ray, closest.t, [&](std::uint32_t const id) {
+            std::uint32_t index = id & 0x3FFFFFFFU;
+
+            if ( ( id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+            {
+                if ( RayBranchIntersection( ray, records.branches[index], closest.t, closest ) )
+                    closest.index = index;
+            }
+            else if ( RayLeafIntersection( ray, records.leaves[index], closest.t, closest ) )
+            {
+                closest.index = index;
+            }
+
+            return false;
+        } );
+
+        // traversal starts from t = length -> a miss keeps that value
+        if ( closest.is_miss() )
+            closest.t = 1e20f;
+
+        return closest;
+    }
+
+    /// Tells whether anything lies on the segment from "a" to "b" (stops at the first hit).
+    bool segment_blocked(glm::vec3 const& a, glm::vec3 const& b) const {
+
+        float length = glm::length( b - a );
+        if ( length <= 0.0f )
+            return false;
+
+        Ray ray{ a, ( b - a ) / length };
+        Hit hit;
+        bool blocked = false;
+
+        bvh.traverse( ray, length, [&](std::uint32_t const id) {
+            std::uint32_t index = id & 0x3FFFFFFFU;
+
+            if ( ( id >> 30 ) == static_cast<std::uint32_t>( Hit::Kind::Branch ) )
+                blocked = RayBranchIntersection( ray, records.branches[index], length, hit );
+            else
+                blocked = RayLeafIntersection( ray, records.leaves[index], length, hit );
+
+            return blocked;
+        } );
+
+        return blocked;
+    }
+
+    /// Appends the indices of the leaves whose bounds overlap the box.
+    void leaves_in_box(glm::vec3 const& minimum, glm::vec3 const& maximum, std::vector<std::uint32_t>& out) const {
+
+        box_query( minimum, maximum, Hit::Kind::Leaf, out );
+    }
+
+    /// Appends the indices of the branches whose bounds overlap the box.
+    void branches_in_box(glm::vec3 const& minimum, glm::vec3 const& maximum, std::vector<std::uint32_t>& out) const {
+
+        box_query( minimum, maximum, Hit::Kind::Branch, out );
+    }
+
+    /// Answers many nearest branch queries on "threads" threads.
+    void nearest_branches(std::vector<glm::vec3> const& points, std::vector<NearestBranch>& results,
+                          float const max_distance = std::numeric_limits<float>::infinity(), unsigned int const threads = 0U) const {
+
+        results.resize( points.size() );
+        parallel_for( points.size(), threads, [&](std::size_t const i) {
+            results[i] = nearest_branch( points[i], max_distance );
+        } );
+    }
+
+    /// Casts many segments ("from[i]" to "to[i]") on "threads" threads.
+    void segment_casts(std::vector<glm::vec3> const& from, std::vector<glm::vec3> const& to, std::vector<Hit>& results,
+                       unsigned int const threads = 0U) const {
+
+        results.resize( std::min( from.size(), to.size() ) );
+        parallel_for( results.size(), threads, [&](std::size_t const i) {
+            results[i] = segment_cast( from[i], to[i] );
+        } );
+    }
+
+private:
+
+    static float box_distance(BVH::Node const& node, glm::vec3 const& p) {
+
+        glm::vec3 outside = glm::max( glm::max( node.minimum - p, p - node.maximum ), glm::vec3(0.0f) );
+        return glm::length( outside );
+    }
+
+    /// Distance from the point to the surface of the branch (the radius is interpolated along the axis).
+    static float branch_distance(BranchRecord const& branch, glm::vec3 const& p, glm::vec3& axis_point) {
+
+        float s = branch.length > 0.0f ? glm::clamp( glm::dot( p - branch.p1, branch.axis ) * branch.inv_length, 0.0f, 1.0f ) : 0.0f;
+        axis_point = branch.p1 + branch.axis * ( branch.length * s );
+
+        return glm::length( p - axis_point ) - ( branch.r1 + ( branch.r2 - branch.r1 ) * s );
+    }
+
+    void box_query(glm::vec3 const& minimum, glm::vec3 const& maximum, Hit::Kind const kind, std::vector<std::uint32_t>& out) const {
+
+        if ( bvh.empty() )
+            return;
+
+        auto overlaps = [&](glm::vec3 const& lo, glm::vec3 const& hi) {
+            return lo.x <= maximum.x && hi.x >= minimum.x && lo.y <= maximum.y && hi.y >= minimum.y
+                && lo.z <= maximum.z && hi.z >= minimum.z;
+        };
+
+        std::uint32_t stack[BVH::stack_size];
+        int top = 0;
+        stack[top++] = 0U;
+
+        while ( top > 0 )
+        {
+            std::uint32_t n = stack[--top];
+            BVH::Node const& node = bvh.nodes[n];
+
+            if ( !overlaps( node.minimum, node.maximum ) )
+                continue;
+
+            if ( node.is_leaf() )
+            {
+                for ( std::uint32_t i = node.first; i < node.first + node.count; ++i )
+                {
+                    std::uint32_t id = bvh.primitives[i];
+                    if ( ( id >> 30 ) != static_cast<std::uint32_t>( kind ) )
+                        continue;
+
+                    Bounds b = primitive_bounds( records, id );
+                    if ( overlaps( b.minimum, b.maximum ) )
+                        out.push_back( id & 0x3FFFFFFFU );
+                }
+                continue;
+            }
+
+            stack[top++] = node.first;
+            stack[top++] = n + 1U;
+        }
+    }
+};
@@ -0,0 +1,364 @@
+#pragma once
+
+#include "skeleton.hpp"
+#include "ray_tracing.hpp"
+#include "glm_headers.hpp"
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+
+/// Settings of the wind.
+struct WindSettings {
+    glm::vec3 direction = glm::vec3(1.0f, 0.0f, 0.0f);    // the way the wind blows
+    float strength = 0.05f;         // bend of one bone in radians
+    float gust = 0.5f;              // part of the bend that oscillates
+    float frequency = 0.5f;         // oscillations per second of the root
+    float depth_frequency = 0.3f;   // relative increase of the frequency per bracket level
+};
+
+// The bones and the primitives are posed wind_lane_count at a time: a block is copied into
+// small arrays of the stack (its lanes), where the compiler knows nothing else is written,
+// and the arithmetic runs over the lanes without branches, so it becomes SIMD code (build
+// with e.g. -O3 -mavx2 for 8 lanes per instruction).
+constexpr std::size_t wind_lane_count = 8U;
+
+/// Sine and cosine of x without branches or calls (within 1e-6 for |x| < 1e4): x is
+/// reduced to [-pi, pi] and halved, the polynomials of the half are doubled back.
+inline void sin_cos(float const x, float& sine, float& cosine) {
+
+    // x - 2 pi round(x / 2 pi), rounded through the mantissa of y + 1.5 * 2^23, 2 pi in two
+    // parts so that the first product is exact
+    float turns = x * 0.159154943f;
+    float rounded = ( turns + 12582912.0f ) - 12582912.0f;
+    float h = 0.5f * ( ( x - rounded * 6.28125f ) - rounded * 1.93530718e-3f );
+
+    float h2 = h * h;
+    float s = h * ( 1.0f + h2 * ( -1.0f / 6.0f + h2 * ( 1.0f / 120.0f + h2 * ( -1.0f / 5040.0f
+                  + h2 * ( 1.0f / 362880.0f - h2 * ( 1.0f / 39916800.0f ) ) ) ) ) );
+    float c = 1.0f + h2 * ( -0.5f + h2 * ( 1.0f / 24.0f + h2 * ( -1.0f / 720.0f + h2 * ( 1.0f / 40320.0f
+                  + h2 * ( -1.0f / 3628800.0f + h2 * ( 1.0f / 479001600.0f ) ) ) ) ) );
+
+    sine = 2.0f * s * c;
+    cosine = 1.0f - 2.0f * s * s;
+}
+
+/// 1 / sqrt(x) for x > 0 without branches (std::sqrt checks its argument to set errno):
+/// a first guess from the bits of x, refined to float precision by three Newton steps.
+inline float inverse_sqrt(float const x) {
+
+    std::int32_t bits;
+    std::memcpy( &bits, &x, sizeof(bits) );
+    bits = 0x5F375A86 - ( bits >> 1 );
+
+    float y;
+    std::memcpy( &y, &bits, sizeof(y) );
+    for ( int step = 0; step < 3; ++step )
+    {
+        y *= 1.5f - 0.5f * x * y * y;
+    }
+
+    return y;
+}
+
+/// Sways a tree in the wind by skinning it to its Skeleton. Every frame each bone
+/// bends about its rest pivot (towards the wind, with an oscillation of its own phase)
+/// and inherits the motion of its parent; one linear pass over the bones suffices since
+/// parents come first. Bones without primitives in them or below them are dropped when
+/// the deformer is built (the brackets around unexpanded symbols). A second pass moves
+/// the branch ends and the leaf frames with the transform of their bone. The bends of a
+/// block of bones and the transforms of a block of primitives are computed in lanes;
+/// composing a bone with its parent stays scalar.
+struct WindDeformer {
+
+    /// Keeps the rest pose (the output of the LTurtle that filled the skeleton).
+    WindDeformer(Skeleton const& skeleton, std::vector<Branch> const& branches, std::vector<Leaf> const& leaves) {
+
+        // the bones carrying primitives and their ancestors, renumbered in order (parents still come first)
+        std::vector<std::uint8_t> used( skeleton.size(), 0U );
+        for ( std::vector<std::uint32_t> const* tags : { &skeleton.branch_bones, &skeleton.leaf_bones } )
+        {
+            for ( std::uint32_t b : *tags )
+            {
+                used[b] = 1U;
+            }
+        }
+        for ( std::size_t b = skeleton.size(); b-- > 1; )
+        {
+            if ( used[b] )
+                used[static_cast<std::size_t>( skeleton.parent[b] )] = 1U;
+        }
+
+        std::vector<std::uint32_t> slot( skeleton.size(), 0U );
+        std::vector<glm::vec3> forward;
+        for ( std::size_t b = 0; b < skeleton.size(); ++b )
+        {
+            if ( !used[b] )
+                continue;
+
+            slot[b] = static_cast<std::uint32_t>( parent.size() );
+            parent.push_back( skeleton.parent[b] >= 0 ? static_cast<std::int32_t>( slot[static_cast<std::size_t>( skeleton.parent[b] )] ) : -1 );
+            pivot.push_back( skeleton.origin[b] );
+            forward.push_back( skeleton.forward[b] );
+            depth.push_back( static_cast<float>( skeleton.depth[b] ) );
+            // golden ratio phases of the skeleton's numbering keep neighbouring bones out of step
+            phase.push_back( 6.28318530718f * std::fmod( b * 0.61803398875f, 1.0f ) );
+        }
+
+        std::size_t boneCount = padded( parent.size() );
+        rest_forward.set( boneCount );
+        for ( std::size_t b = 0; b < forward.size(); ++b )
+        {
+            rest_forward.store( b, forward[b] );
+        }
+        depth.resize( boneCount );
+        phase.resize( boneCount );
+        for ( std::vector<float>* array : { &r00, &r01, &r02, &r10, &r11, &r12, &r20, &r21, &r22, &tx, &ty, &tz } )
+        {
+            array->resize( parent.size() );
+        }
+
+        for ( std::uint32_t b : skeleton.branch_bones )
+        {
+            branch_bones.push_back( slot[b] );
+        }
+        for ( std::uint32_t b : skeleton.leaf_bones )
+        {
+            leaf_bones.push_back( slot[b] );
+        }
+        branch_bones.resize( padded( branch_bones.size() ), 0U );
+        leaf_bones.resize( padded( leaf_bones.size() ), 0U );
+
+        rest_p1.set( padded( branches.size() ) );
+        rest_p2.set( padded( branches.size() ) );
+        radius1.resize( branches.size() );
+        radius2.resize( branches.size() );
+        for ( std::size_t i = 0; i < branches.size(); ++i )
+        {
+            rest_p1.store( i, branches[i].p1 );
+            rest_p2.store( i, branches[i].p2 );
+            radius1[i] = branches[i].r1;
+            radius2[i] = branches[i].r2;
+        }
+
+        rest_position.set( padded( leaves.size() ) );
+        rest_direction.set( padded( leaves.size() ) );
+        rest_up.set( padded( leaves.size() ) );
+        sizes.resize( leaves.size() );
+        for ( std::size_t i = 0; i < leaves.size(); ++i )
+        {
+            rest_position.store( i, glm::vec3( leaves[i].position ) );
+            rest_direction.store( i, glm::vec3( leaves[i].direction ) );
+            rest_up.store( i, glm::vec3( leaves[i].up ) );
+            sizes[i] = glm::vec2( leaves[i].size.x, leaves[i].size.y );
+        }
+
+        p1 = rest_p1;
+        p2 = rest_p2;
+        position = rest_position;
+        direction = rest_direction;
+        up = rest_up;
+    }
+
+    /// Poses the tree at "time" (seconds) and writes the result to the vectors.
+    void deform(float const time, WindSettings const& settings, std::vector<Branch>& branches, std::vector<Leaf>& leaves) {
+
+        pose_bones( time, settings );
+
+        transform( rest_p1, branch_bones, true, p1 );
+        transform( rest_p2, branch_bones, true, p2 );
+        transform( rest_position, leaf_bones, true, position );
+        transform( rest_direction, leaf_bones, false, direction );
+        transform( rest_up, leaf_bones, false, up );
+
+        branches.clear();
+        branches.reserve( radius1.size() );
+        for ( std::size_t i = 0; i < radius1.size(); ++i )
+        {
+            branches.push_back( Branch( p1.load( i ), radius1[i], p2.load( i ), radius2[i] ) );
+        }
+
+        leaves.clear();
+        leaves.reserve( sizes.size() );
+        for ( std::size_t i = 0; i < sizes.size(); ++i )
+        {
+            leaves.push_back( Leaf( position.load( i ), direction.load( i ), up.load( i ), sizes[i] ) );
+        }
+    }
+
+    /// Poses the tree at "time" and updates the records and the BVH of the scene (refit, no rebuild).
+    /// The baked ambient occlusion is kept.
+    void apply(Scene& scene, float const time, WindSettings const& settings) {
+
+        deform( time, settings, branches_buffer, leaves_buffer );
+
+        scene.records.build( branches_buffer, leaves_buffer );
+        scene.bvh.refit( scene.records );
+    }
+
+private:
+
+    /// Three float arrays holding vectors.
+    struct Vec3Array {
+        std::vector<float> x, y, z;
+
+        void set(std::size_t const count) {
+
+            x.resize( count );
+            y.resize( count );
+            z.resize( count );
+        }
+
+        void store(std::size_t const i, glm::vec3 const& v) {
+
+            x[i] = v.x;
+            y[i] = v.y;
+            z[i] = v.z;
+        }
+
+        glm::vec3 load(std::size_t const i) const {
+
+            return glm::vec3( x[i], y[i], z[i] );
+        }
+    };
+
+    static std::size_t padded(std::size_t const count) {
+
+        return ( count + wind_lane_count - 1U ) / wind_lane_count * wind_lane_count;
+    }
+
+    /// World transform of every bone: x' = R x + t.
+    void pose_bones(float const time, WindSettings const& settings) {
+
+        glm::vec3 wind = settings.direction;
+        float windLength = glm::length( wind );
+        if ( windLength > 0.0f )
+            wind /= windLength;
+
+        float omega = 6.28318530718f * settings.frequency;
+        float bend = settings.strength * windLength;
+
+        for ( std::size_t first = 0; first < parent.size(); first += wind_lane_count )
+        {
+            // the bend of every bone about its pivot, towards the wind (fading out below an axis of 1e-6
+            // when the bone points along the wind)
+            float l00[wind_lane_count], l01[wind_lane_count], l02[wind_lane_count];
+            float l10[wind_lane_count], l11[wind_lane_count], l12[wind_lane_count];
+            float l20[wind_lane_count], l21[wind_lane_count], l22[wind_lane_count];
+
+            for ( std::size_t l = 0; l < wind_lane_count; ++l )
+            {
+                std::size_t b = first + l;
+                float fx = rest_forward.x[b], fy = rest_forward.y[b], fz = rest_forward.z[b];
+
+                float ax = fy * wind.z - fz * wind.y;
+                float ay = fz * wind.x - fx * wind.z;
+                float az = fx * wind.y - fy * wind.x;
+                float inv = inverse_sqrt( ax * ax + ay * ay + az * az + 1e-12f );
+
+                float wave, unused;
+                sin_cos( omega * ( 1.0f + settings.depth_frequency * depth[b] ) * time + phase[b], wave, unused );
+                float angle = bend * ( 1.0f - settings.gust + settings.gust * wave );
+
+                // the rotation of the quaternion (cos(angle / 2), sin(angle / 2) axis), as glm::toMat3
+                float s, w;
+                sin_cos( 0.5f * angle, s, w );
+                float x = ax * inv * s, y = ay * inv * s, z = az * inv * s;
+
+                l00[l] = 1.0f - 2.0f * ( y * y + z * z ); l01[l] = 2.0f * ( x * y - w * z ); l02[l] = 2.0f * ( x * z + w * y );
+                l10[l] = 2.0f * ( x * y + w * z ); l11[l] = 1.0f - 2.0f * ( x * x + z * z ); l12[l] = 2.0f * ( y * z - w * x );
+                l20[l] = 2.0f * ( x * z - w * y ); l21[l] = 2.0f * ( y * z + w * x ); l22[l] = 1.0f - 2.0f * ( x * x + y * y );
+            }
+
+            // composed with the parent, which comes first
+            std::size_t last = std::min( first + wind_lane_count, parent.size() );
+            for ( std::size_t b = first; b < last; ++b )
+            {
+                std::size_t l = b - first;
+                glm::mat3 local( l00[l], l10[l], l20[l], l01[l], l11[l], l21[l], l02[l], l12[l], l22[l] );
+                glm::mat3 rotation = local;
+                glm::vec3 translation = pivot[b] - local * pivot[b];
+
+                if ( parent[b] >= 0 )
+                {
+                    std::size_t p = static_cast<std::size_t>( parent[b] );
+                    glm::mat3 parentRotation( r00[p], r10[p], r20[p], r01[p], r11[p], r21[p], r02[p], r12[p], r22[p] );
+                    glm::vec3 parentTranslation( tx[p], ty[p], tz[p] );
+
+                    rotation = parentRotation * local;
+                    translation = parentRotation * translation + parentTranslation;
+                }
+
+                // glm is column major: rotation[column][row]
+                r00[b] = rotation[0][0]; r01[b] = rotation[1][0]; r02[b] = rotation[2][0];
+                r10[b] = rotation[0][1]; r11[b] = rotation[1][1]; r12[b] = rotation[2][1];
+                r20[b] = rotation[0][2]; r21[b] = rotation[1][2]; r22[b] = rotation[2][2];
+                tx[b] = translation.x; ty[b] = translation.y; tz[b] = translation.z;
+            }
+        }
+    }
+
+    /// Applies the bone transforms to points (with translation) or vectors (without).
+    void transform(Vec3Array const& in, std::vector<std::uint32_t> const& bones, bool const point, Vec3Array& out) const {
+
+        float w = point ? 1.0f : 0.0f;
+
+        for ( std::size_t first = 0; first < in.x.size(); first += wind_lane_count )
+        {
+            // the transforms of the bones of the block, gathered
+            float m00[wind_lane_count], m01[wind_lane_count], m02[wind_lane_count];
+            float m10[wind_lane_count], m11[wind_lane_count], m12[wind_lane_count];
+            float m20[wind_lane_count], m21[wind_lane_count], m22[wind_lane_count];
+            float mx[wind_lane_count], my[wind_lane_count], mz[wind_lane_count];
+
+            for ( std::size_t l = 0; l < wind_lane_count; ++l )
+            {
+                std::size_t b = bones[first + l];
+                m00[l] = r00[b]; m01[l] = r01[b]; m02[l] = r02[b];
+                m10[l] = r10[b]; m11[l] = r11[b]; m12[l] = r12[b];
+                m20[l] = r20[b]; m21[l] = r21[b]; m22[l] = r22[b];
+                mx[l] = w * tx[b]; my[l] = w * ty[b]; mz[l] = w * tz[b];
+            }
+
+            float x[wind_lane_count], y[wind_lane_count], z[wind_lane_count];
+            for ( std::size_t l = 0; l < wind_lane_count; ++l )
+            {
+                x[l] = in.x[first + l]; y[l] = in.y[first + l]; z[l] = in.z[first + l];
+            }
+
+            float* ox = out.x.data() + first;
+            float* oy = out.y.data() + first;
+            float* oz = out.z.data() + first;
+            for ( std::size_t l = 0; l < wind_lane_count; ++l )
+            {
+                ox[l] = m00[l] * x[l] + m01[l] * y[l] + m02[l] * z[l] + mx[l];
+                oy[l] = m10[l] * x[l] + m11[l] * y[l] + m12[l] * z[l] + my[l];
+                oz[l] = m20[l] * x[l] + m21[l] * y[l] + m22[l] * z[l] + mz[l];
+            }
+        }
+    }
+
+    // bones (renumbered, see the constructor), their inputs padded to whole blocks
+    std::vector<std::int32_t> parent;
+    std::vector<glm::vec3> pivot;
+    Vec3Array rest_forward;
+    std::vector<float> depth;
+    std::vector<float> phase;
+    std::vector<std::uint32_t> branch_bones, leaf_bones;     // of every primitive, padded with bone 0
+
+    // bone transforms
+    std::vector<float> r00, r01, r02, r10, r11, r12, r20, r21, r22;
+    std::vector<float> tx, ty, tz;
+
+    // rest pose (padded to whole blocks)
+    Vec3Array rest_p1, rest_p2;
+    std::vector<float> radius1, radius2;
+    Vec3Array rest_position, rest_direction, rest_up;
+    std::vector<glm::vec2> sizes;
+
+    // deformed pose
+    Vec3Array p1, p2;
+    Vec3Array position, direction, up;
+    std::vector<Branch> branches_buffer;
+    std::vector<Leaf> leaves_buffer;
+};